@@ -0,0 +1,321 @@
+/* Convert.cpp
+ * Pixel conversion kernels for tile decoding
+ *
+ * Every kernel exists as portable scalar code and, on x86, as SSE2 and AVX2
+ * variant. The variant is chosen at runtime depending on the CPU.
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#include <string.h>
+
+#include "Convert.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CONVERT_X86
+#include <immintrin.h>
+#endif
+
+
+// Exact integer version of (c*a + bg*(255-a)) / 255 with rounding
+static inline uint8_t blend(unsigned c, unsigned a, unsigned bg) {
+	unsigned t = c * a + bg * (255 - a) + 128;
+	return (uint8_t)((t + (t >> 8)) >> 8);
+}
+
+/* ==== Scalar kernels ====================================================== */
+
+static void palette_to_rgb_scalar(const uint8_t *index, const uint32_t *palette, uint8_t *rgb, size_t n) {
+	const uint8_t *pal = (const uint8_t*)palette;
+	for(size_t i = 0; i < n; i++) {
+		const uint8_t *entry = pal + 4 * index[i];
+		rgb[3*i]   = entry[0];
+		rgb[3*i+1] = entry[1];
+		rgb[3*i+2] = entry[2];
+	}
+}
+
+static void rgba_to_rgb_scalar(const uint8_t *rgba, uint8_t *rgb, size_t n) {
+	for(size_t i = 0; i < n; i++) {
+		rgb[3*i]   = rgba[4*i];
+		rgb[3*i+1] = rgba[4*i+1];
+		rgb[3*i+2] = rgba[4*i+2];
+	}
+}
+
+static void rgba_blend_rgb_scalar(const uint8_t *rgba, const uint8_t *background, uint8_t *rgb, size_t n) {
+	for(size_t i = 0; i < n; i++) {
+		const unsigned a = rgba[4*i+3];
+		rgb[3*i]   = blend(rgba[4*i],   a, background[0]);
+		rgb[3*i+1] = blend(rgba[4*i+1], a, background[1]);
+		rgb[3*i+2] = blend(rgba[4*i+2], a, background[2]);
+	}
+}
+
+static void downsample_rgb_scalar(const uint8_t *row0, const uint8_t *row1, uint8_t *rgb, size_t n) {
+	for(size_t i = 0; i < 3 * n; i++) {
+		// Same channel of the left input pixel
+		const size_t j = i + (i / 3) * 3;
+		rgb[i] = (uint8_t)((row0[j] + row0[j+3] + row1[j] + row1[j+3] + 2) >> 2);
+	}
+}
+
+static const ConvertKernels kernels_scalar = {
+	"scalar", palette_to_rgb_scalar, rgba_to_rgb_scalar, rgba_blend_rgb_scalar, downsample_rgb_scalar
+};
+
+#ifdef CONVERT_X86
+
+/* ==== SSE2 kernels ======================================================== */
+
+#ifdef __SSE2__
+
+// Pack 4 RGBA pixels into 12 RGB bytes. The upper 4 bytes are zero
+static inline __m128i pack_rgb_sse2(__m128i v) {
+	// Per 64-bit half: R0 G0 B0 from bits 0..23, R1 G1 B1 shifted to bits 24..47
+	const __m128i lo24 = _mm_set1_epi64x(0x0000000000FFFFFFLL);
+	const __m128i hi24 = _mm_set1_epi64x(0x0000FFFFFF000000LL);
+	__m128i t = _mm_or_si128(_mm_and_si128(v, lo24), _mm_and_si128(_mm_srli_epi64(v, 8), hi24));
+	// Move the 6 bytes of the upper half next to the lower half
+	const __m128i low6 = _mm_set_epi64x(0, 0x0000FFFFFFFFFFFFLL);
+	const __m128i high6 = _mm_set_epi64x(0x0000FFFFFFFFFFFFLL, 0);
+	return _mm_or_si128(_mm_and_si128(t, low6), _mm_srli_si128(_mm_and_si128(t, high6), 2));
+}
+
+// Store 16 RGBA pixels as 48 RGB bytes
+static inline void store_rgb48_sse2(uint8_t *rgb, __m128i a, __m128i b, __m128i c, __m128i d) {
+	a = pack_rgb_sse2(a);
+	b = pack_rgb_sse2(b);
+	c = pack_rgb_sse2(c);
+	d = pack_rgb_sse2(d);
+	_mm_storeu_si128((__m128i*)rgb,        _mm_or_si128(a, _mm_slli_si128(b, 12)));
+	_mm_storeu_si128((__m128i*)(rgb + 16), _mm_or_si128(_mm_srli_si128(b, 4), _mm_slli_si128(c, 8)));
+	_mm_storeu_si128((__m128i*)(rgb + 32), _mm_or_si128(_mm_srli_si128(c, 8), _mm_slli_si128(d, 4)));
+}
+
+static void palette_to_rgb_sse2(const uint8_t *index, const uint32_t *palette, uint8_t *rgb, size_t n) {
+	size_t i = 0;
+	for(; i + 16 <= n; i += 16) {
+		const uint8_t *x = index + i;
+		__m128i a = _mm_setr_epi32(palette[x[0]],  palette[x[1]],  palette[x[2]],  palette[x[3]]);
+		__m128i b = _mm_setr_epi32(palette[x[4]],  palette[x[5]],  palette[x[6]],  palette[x[7]]);
+		__m128i c = _mm_setr_epi32(palette[x[8]],  palette[x[9]],  palette[x[10]], palette[x[11]]);
+		__m128i d = _mm_setr_epi32(palette[x[12]], palette[x[13]], palette[x[14]], palette[x[15]]);
+		store_rgb48_sse2(rgb + 3 * i, a, b, c, d);
+	}
+	palette_to_rgb_scalar(index + i, palette, rgb + 3 * i, n - i);
+}
+
+static void rgba_to_rgb_sse2(const uint8_t *rgba, uint8_t *rgb, size_t n) {
+	size_t i = 0;
+	for(; i + 16 <= n; i += 16) {
+		const __m128i *src = (const __m128i*)(rgba + 4 * i);
+		store_rgb48_sse2(rgb + 3 * i, _mm_loadu_si128(src), _mm_loadu_si128(src + 1),
+			_mm_loadu_si128(src + 2), _mm_loadu_si128(src + 3));
+	}
+	rgba_to_rgb_scalar(rgba + 4 * i, rgb + 3 * i, n - i);
+}
+
+// Blend 2 RGBA pixels, widened to 16 bit per channel
+static inline __m128i blend2_sse2(__m128i px, __m128i bg) {
+	const __m128i c255 = _mm_set1_epi16(255);
+	const __m128i c128 = _mm_set1_epi16(128);
+	__m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(px, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
+	__m128i t = _mm_add_epi16(_mm_mullo_epi16(px, a), _mm_mullo_epi16(bg, _mm_sub_epi16(c255, a)));
+	t = _mm_add_epi16(t, c128);
+	return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+// Blend 4 RGBA pixels
+static inline __m128i blend4_sse2(__m128i px, __m128i bg) {
+	const __m128i zero = _mm_setzero_si128();
+	return _mm_packus_epi16(blend2_sse2(_mm_unpacklo_epi8(px, zero), bg),
+		blend2_sse2(_mm_unpackhi_epi8(px, zero), bg));
+}
+
+static void rgba_blend_rgb_sse2(const uint8_t *rgba, const uint8_t *background, uint8_t *rgb, size_t n) {
+	const __m128i bg = _mm_setr_epi16(background[0], background[1], background[2], 0,
+		background[0], background[1], background[2], 0);
+	size_t i = 0;
+	for(; i + 16 <= n; i += 16) {
+		const __m128i *src = (const __m128i*)(rgba + 4 * i);
+		store_rgb48_sse2(rgb + 3 * i,
+			blend4_sse2(_mm_loadu_si128(src), bg), blend4_sse2(_mm_loadu_si128(src + 1), bg),
+			blend4_sse2(_mm_loadu_si128(src + 2), bg), blend4_sse2(_mm_loadu_si128(src + 3), bg));
+	}
+	rgba_blend_rgb_scalar(rgba + 4 * i, background, rgb + 3 * i, n - i);
+}
+
+// Load a RGB pixel into the lower 24 bits. Reads one byte past the pixel
+static inline int load_rgb(const uint8_t *pixel) {
+	int v;
+	memcpy(&v, pixel, 4);
+	return v;
+}
+
+// Sum of four vectors of 2 pixels, widened to 16 bit per channel, rounded and divided by 4
+static inline __m128i average4_sse2(__m128i a, __m128i b, __m128i c, __m128i d) {
+	__m128i t = _mm_add_epi16(_mm_add_epi16(a, b), _mm_add_epi16(c, d));
+	return _mm_srli_epi16(_mm_add_epi16(t, _mm_set1_epi16(2)), 2);
+}
+
+// Downsample 8 input pixels of both rows to 4 pixels, one per 32-bit lane
+static inline __m128i downsample4_sse2(const uint8_t *row0, const uint8_t *row1) {
+	const __m128i zero = _mm_setzero_si128();
+	__m128i l0 = _mm_setr_epi32(load_rgb(row0),     load_rgb(row0 + 6), load_rgb(row0 + 12), load_rgb(row0 + 18));
+	__m128i r0 = _mm_setr_epi32(load_rgb(row0 + 3), load_rgb(row0 + 9), load_rgb(row0 + 15), load_rgb(row0 + 21));
+	__m128i l1 = _mm_setr_epi32(load_rgb(row1),     load_rgb(row1 + 6), load_rgb(row1 + 12), load_rgb(row1 + 18));
+	__m128i r1 = _mm_setr_epi32(load_rgb(row1 + 3), load_rgb(row1 + 9), load_rgb(row1 + 15), load_rgb(row1 + 21));
+	__m128i lo = average4_sse2(_mm_unpacklo_epi8(l0, zero), _mm_unpacklo_epi8(r0, zero),
+		_mm_unpacklo_epi8(l1, zero), _mm_unpacklo_epi8(r1, zero));
+	__m128i hi = average4_sse2(_mm_unpackhi_epi8(l0, zero), _mm_unpackhi_epi8(r0, zero),
+		_mm_unpackhi_epi8(l1, zero), _mm_unpackhi_epi8(r1, zero));
+	return _mm_packus_epi16(lo, hi);
+}
+
+static void downsample_rgb_sse2(const uint8_t *row0, const uint8_t *row1, uint8_t *rgb, size_t n) {
+	size_t i = 0;
+	// The last pixel is left to the scalar code, as load_rgb reads past it
+	for(; i + 16 < n; i += 16) {
+		const uint8_t *a = row0 + 6 * i, *b = row1 + 6 * i;
+		store_rgb48_sse2(rgb + 3 * i, downsample4_sse2(a, b), downsample4_sse2(a + 24, b + 24),
+			downsample4_sse2(a + 48, b + 48), downsample4_sse2(a + 72, b + 72));
+	}
+	downsample_rgb_scalar(row0 + 6 * i, row1 + 6 * i, rgb + 3 * i, n - i);
+}
+
+static const ConvertKernels kernels_sse2 = {
+	"sse2", palette_to_rgb_sse2, rgba_to_rgb_sse2, rgba_blend_rgb_sse2, downsample_rgb_sse2
+};
+
+#endif
+
+/* ==== AVX2 kernels ======================================================== */
+
+#define AVX2 __attribute__((target("avx2")))
+
+// Store 8 RGBA pixels as 24 RGB bytes
+AVX2 static inline void store_rgb24_avx2(uint8_t *rgb, __m256i v) {
+	const __m256i shuffle = _mm256_setr_epi8(
+		0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+		0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	__m256i s = _mm256_shuffle_epi8(v, shuffle);
+	// Close the gap between the two 12 byte halves
+	s = _mm256_permutevar8x32_epi32(s, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+	_mm_storeu_si128((__m128i*)rgb, _mm256_castsi256_si128(s));
+	_mm_storel_epi64((__m128i*)(rgb + 16), _mm256_extracti128_si256(s, 1));
+}
+
+AVX2 static void palette_to_rgb_avx2(const uint8_t *index, const uint32_t *palette, uint8_t *rgb, size_t n) {
+	size_t i = 0;
+	for(; i + 8 <= n; i += 8) {
+		__m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(index + i)));
+		store_rgb24_avx2(rgb + 3 * i, _mm256_i32gather_epi32((const int*)palette, idx, 4));
+	}
+	palette_to_rgb_scalar(index + i, palette, rgb + 3 * i, n - i);
+}
+
+AVX2 static void rgba_to_rgb_avx2(const uint8_t *rgba, uint8_t *rgb, size_t n) {
+	size_t i = 0;
+	for(; i + 8 <= n; i += 8)
+		store_rgb24_avx2(rgb + 3 * i, _mm256_loadu_si256((const __m256i*)(rgba + 4 * i)));
+	rgba_to_rgb_scalar(rgba + 4 * i, rgb + 3 * i, n - i);
+}
+
+// Blend 4 RGBA pixels, widened to 16 bit per channel
+AVX2 static inline __m256i blend4_avx2(__m256i px, __m256i bg) {
+	const __m256i c255 = _mm256_set1_epi16(255);
+	const __m256i c128 = _mm256_set1_epi16(128);
+	__m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(px, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
+	__m256i t = _mm256_add_epi16(_mm256_mullo_epi16(px, a), _mm256_mullo_epi16(bg, _mm256_sub_epi16(c255, a)));
+	t = _mm256_add_epi16(t, c128);
+	return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+AVX2 static void rgba_blend_rgb_avx2(const uint8_t *rgba, const uint8_t *background, uint8_t *rgb, size_t n) {
+	const __m256i bg = _mm256_setr_epi16(
+		background[0], background[1], background[2], 0, background[0], background[1], background[2], 0,
+		background[0], background[1], background[2], 0, background[0], background[1], background[2], 0);
+	const __m256i zero = _mm256_setzero_si256();
+	size_t i = 0;
+	for(; i + 8 <= n; i += 8) {
+		__m256i px = _mm256_loadu_si256((const __m256i*)(rgba + 4 * i));
+		// Unpacking and packing both work per 128-bit lane, so the pixel order is kept
+		__m256i lo = blend4_avx2(_mm256_unpacklo_epi8(px, zero), bg);
+		__m256i hi = blend4_avx2(_mm256_unpackhi_epi8(px, zero), bg);
+		store_rgb24_avx2(rgb + 3 * i, _mm256_packus_epi16(lo, hi));
+	}
+	rgba_blend_rgb_scalar(rgba + 4 * i, background, rgb + 3 * i, n - i);
+}
+
+// Sum of four vectors of 4 pixels, widened to 16 bit per channel, rounded and divided by 4
+AVX2 static inline __m256i average4_avx2(__m256i a, __m256i b, __m256i c, __m256i d) {
+	__m256i t = _mm256_add_epi16(_mm256_add_epi16(a, b), _mm256_add_epi16(c, d));
+	return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_set1_epi16(2)), 2);
+}
+
+AVX2 static void downsample_rgb_avx2(const uint8_t *row0, const uint8_t *row1, uint8_t *rgb, size_t n) {
+	// Byte offsets of the left pixels of 8 pairs
+	const __m256i offsets = _mm256_setr_epi32(0, 6, 12, 18, 24, 30, 36, 42);
+	const __m256i zero = _mm256_setzero_si256();
+	size_t i = 0;
+	// The gathers read 4 bytes per pixel, so the last pixel is left to the scalar code
+	for(; i + 8 < n; i += 8) {
+		const uint8_t *a = row0 + 6 * i, *b = row1 + 6 * i;
+		__m256i l0 = _mm256_i32gather_epi32((const int*)a, offsets, 1);
+		__m256i r0 = _mm256_i32gather_epi32((const int*)(a + 3), offsets, 1);
+		__m256i l1 = _mm256_i32gather_epi32((const int*)b, offsets, 1);
+		__m256i r1 = _mm256_i32gather_epi32((const int*)(b + 3), offsets, 1);
+		// Unpacking and packing both work per 128-bit lane, so the pixel order is kept
+		__m256i lo = average4_avx2(_mm256_unpacklo_epi8(l0, zero), _mm256_unpacklo_epi8(r0, zero),
+			_mm256_unpacklo_epi8(l1, zero), _mm256_unpacklo_epi8(r1, zero));
+		__m256i hi = average4_avx2(_mm256_unpackhi_epi8(l0, zero), _mm256_unpackhi_epi8(r0, zero),
+			_mm256_unpackhi_epi8(l1, zero), _mm256_unpackhi_epi8(r1, zero));
+		store_rgb24_avx2(rgb + 3 * i, _mm256_packus_epi16(lo, hi));
+	}
+	downsample_rgb_scalar(row0 + 6 * i, row1 + 6 * i, rgb + 3 * i, n - i);
+}
+
+static const ConvertKernels kernels_avx2 = {
+	"avx2", palette_to_rgb_avx2, rgba_to_rgb_avx2, rgba_blend_rgb_avx2, downsample_rgb_avx2
+};
+
+#endif
+
+
+const ConvertKernels* convert_kernels(const char *name) {
+	if(strcmp(name, "scalar") == 0) return &kernels_scalar;
+#ifdef CONVERT_X86
+#ifdef __SSE2__
+	if(strcmp(name, "sse2") == 0) return &kernels_sse2;
+#endif
+	if(strcmp(name, "avx2") == 0) {
+		if(__builtin_cpu_supports("avx2")) return &kernels_avx2;
+		return NULL;
+	}
+#endif
+	return NULL;
+}
+
+static const ConvertKernels* best_kernels() {
+	const ConvertKernels *kernels = convert_kernels("avx2");
+	if(kernels == NULL) kernels = convert_kernels("sse2");
+	if(kernels == NULL) kernels = &kernels_scalar;
+	return kernels;
+}
+
+const ConvertKernels& convert_kernels() {
+	static const ConvertKernels *best = best_kernels();
+	return *best;
+}
+
+void blend_palette(uint32_t *palette, const uint8_t *background) {
+	uint8_t *entry = (uint8_t*)palette;
+	for(int i = 0; i < 256; i++, entry += 4) {
+		const unsigned a = entry[3];
+		entry[0] = blend(entry[0], a, background[0]);
+		entry[1] = blend(entry[1], a, background[1]);
+		entry[2] = blend(entry[2], a, background[2]);
+		entry[3] = 255;
+	}
+}
@@ -0,0 +1,38 @@
+/* Convert.hpp
+ * Pixel conversion kernels for tile decoding and downsampling
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#ifndef _OSMPNG_CONVERT_HPP_
+#define _OSMPNG_CONVERT_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* A set of conversion kernels for one instruction set. All kernels convert
+ * n pixels and write exactly n*3 bytes of RGB output.
+ * Palettes have 256 entries of 4 bytes each, in the byte order R, G, B, A */
+struct ConvertKernels {
+	const char *name;
+
+	// Look up 8-bit palette indices, alpha is dropped
+	void (*palette_to_rgb)(const uint8_t *index, const uint32_t *palette, uint8_t *rgb, size_t n);
+	// Drop the alpha channel
+	void (*rgba_to_rgb)(const uint8_t *rgba, uint8_t *rgb, size_t n);
+	// Composite onto the given RGB background color
+	void (*rgba_blend_rgb)(const uint8_t *rgba, const uint8_t *background, uint8_t *rgb, size_t n);
+	// 2x2 box filter: Average 2n RGB pixels of two adjacent rows to n pixels
+	void (*downsample_rgb)(const uint8_t *row0, const uint8_t *row1, uint8_t *rgb, size_t n);
+};
+
+// The fastest kernels supported by this CPU
+const ConvertKernels& convert_kernels();
+// Kernels for an instruction set ("scalar", "sse2", "avx2") or NULL if not supported
+const ConvertKernels* convert_kernels(const char *name);
+
+// Composite a palette onto an RGB background, alpha of all entries becomes opaque
+void blend_palette(uint32_t *palette, const uint8_t *background);
+
+#endif
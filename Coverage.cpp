@@ -0,0 +1,237 @@
+/* Coverage.cpp
+ * Tiles intersecting polygons and buffered tracks
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#include <algorithm>
+#include <sstream>
+#include <limits.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "Coverage.hpp"
+
+using namespace std;
+
+// Equator length of the Web Mercator sphere in meters
+#define EARTH_CIRCUMFERENCE 40075016.686
+// Corners of the polygon around a buffered point
+#define ROUND_SEGMENTS 16
+
+
+// Tile column or row of a coordinate. Edges are traced in their direction,
+// so that a point exactly on a border belongs to the tile the edge enters
+static int cell(REAL value, REAL direction) {
+	value = max((REAL)-1.0, min(value, (REAL)(1 << 25)));
+	return direction < 0.0 ? (int)ceil(value) - 1 : (int)floor(value);
+}
+
+Coverage::Coverage(int zoom) {
+	this->level = zoom;
+	for(int i = 0; i < 4; i++) box[i] = 0.0;
+}
+
+void Coverage::add(int y, int x0, int x1) {
+	const int n = 1 << level;
+	if(y < 0 || y >= n) return;
+	x0 = max(x0, 0);
+	x1 = min(x1, n - 1);
+	if(x0 <= x1) rows[y].push_back(make_pair(x0, x1));
+}
+
+void Coverage::trace(const pair<REAL, REAL> &a, const pair<REAL, REAL> &b) {
+	const REAL dx = b.first - a.first, dy = b.second - a.second;
+	int x = cell(a.first, dx), y = cell(a.second, dy);
+	const int end_x = cell(b.first, -dx), end_y = cell(b.second, -dy);
+	const int step_x = dx > 0.0 ? 1 : -1, step_y = dy > 0.0 ? 1 : -1;
+	// Position along the edge (0..1), where it crosses the next column and row border
+	REAL next_x = dx != 0.0 ? ((step_x > 0 ? x + 1 : x) - a.first) / dx : HUGE_VAL;
+	REAL next_y = dy != 0.0 ? ((step_y > 0 ? y + 1 : y) - a.second) / dy : HUGE_VAL;
+	const REAL delta_x = dx != 0.0 ? fabs(1.0 / dx) : HUGE_VAL;
+	const REAL delta_y = dy != 0.0 ? fabs(1.0 / dy) : HUGE_VAL;
+
+	add(y, x, x);
+	// One step per tile border, so rounding never leads past the end
+	for(int steps = abs(end_x - x) + abs(end_y - y); steps > 0; steps--) {
+		if(y == end_y || (x != end_x && next_x < next_y)) {
+			x += step_x;
+			next_x += delta_x;
+		} else {
+			y += step_y;
+			next_y += delta_y;
+		}
+		add(y, x, x);
+	}
+}
+
+void Coverage::add_polygon(const vector<Ring> &rings) {
+	const REAL n = (REAL)(1 << level);
+	REAL top = HUGE_VAL, bottom = -HUGE_VAL;
+	for(size_t r = 0; r < rings.size(); r++) {
+		const Ring &ring = rings[r];
+		for(size_t i = 0; i < ring.size(); i++) {
+			trace(ring[i], ring[(i + 1) % ring.size()]);
+			const REAL x = max((REAL)0.0, min(ring[i].first, n));
+			const REAL y = max((REAL)0.0, min(ring[i].second, n));
+			box[0] = min(box[0], x);
+			box[1] = max(box[1], x);
+			box[2] = min(box[2], y);
+			box[3] = max(box[3], y);
+			top = min(top, ring[i].second);
+			bottom = max(bottom, ring[i].second);
+		}
+	}
+	if(top > bottom) return;
+
+	// The outline covers all tiles the polygon touches partially, the rest
+	// is inside exactly if its center is
+	vector<REAL> crossings;
+	const int last = min((int)n - 1, cell(bottom, 1.0));
+	for(int y = max(0, cell(top, 1.0)); y <= last; y++) {
+		const REAL center = y + 0.5;
+		crossings.clear();
+		for(size_t r = 0; r < rings.size(); r++) {
+			const Ring &ring = rings[r];
+			for(size_t i = 0; i < ring.size(); i++) {
+				const pair<REAL, REAL> &a = ring[i], &b = ring[(i + 1) % ring.size()];
+				if((a.second <= center) != (b.second <= center))
+					crossings.push_back(a.first + (center - a.second) * (b.first - a.first) / (b.second - a.second));
+			}
+		}
+		sort(crossings.begin(), crossings.end());
+		for(size_t i = 0; i + 1 < crossings.size(); i += 2)
+			add(y, (int)ceil(crossings[i] - 0.5), (int)floor(crossings[i+1] - 0.5));
+	}
+}
+
+void Coverage::normalize() {
+	for(map<int, Spans>::iterator it = rows.begin(); it != rows.end(); it++) {
+		Spans &spans = it->second;
+		if(spans.empty()) continue;
+		sort(spans.begin(), spans.end());
+		size_t joined = 0;
+		for(size_t i = 1; i < spans.size(); i++) {
+			if(spans[i].first <= spans[joined].second + 1) spans[joined].second = max(spans[joined].second, spans[i].second);
+			else spans[++joined] = spans[i];
+		}
+		spans.resize(joined + 1);
+	}
+}
+
+// Fractional tile coordinates of a position
+static pair<REAL, REAL> tile_point(const GeoPoint &point, REAL n) {
+	if(!(point.lon >= -180.0 && point.lon <= 180.0 && point.lat >= -90.0 && point.lat <= 90.0)) {
+		stringstream ss;
+		ss << "Position out of range: " << point.lon << ", " << point.lat;
+		throw ss.str();
+	}
+	const REAL lat = max(-MAX_LATITUDE, min(point.lat, MAX_LATITUDE));
+	return make_pair(getTileX(point.lon, n), getTileY(lat, n));
+}
+
+Coverage Coverage::rasterize(const Geometry &geometry, int zoom, REAL buffer) {
+	Coverage coverage(zoom);
+	const REAL n = (REAL)(1 << zoom);
+	coverage.box[0] = coverage.box[2] = n;
+	coverage.box[1] = coverage.box[3] = 0.0;
+
+	for(size_t p = 0; p < geometry.polygons.size(); p++) {
+		vector<Ring> rings;
+		for(size_t r = 0; r < geometry.polygons[p].size(); r++) {
+			const GeoPath &path = geometry.polygons[p][r];
+			Ring ring;
+			for(size_t i = 0; i < path.size(); i++) ring.push_back(tile_point(path[i], n));
+			rings.push_back(ring);
+		}
+		coverage.add_polygon(rings);
+	}
+
+	/* A buffered line is the union of a round polygon around every point and
+	 * a rectangle along every segment. The buffer is converted to tiles with
+	 * the Mercator scale at each point, a segment takes the wider end */
+	const REAL corner = M_PI / ROUND_SEGMENTS;
+	for(size_t l = 0; l < geometry.lines.size(); l++) {
+		const GeoPath &line = geometry.lines[l];
+		Ring points;
+		vector<REAL> radius;
+		for(size_t i = 0; i < line.size(); i++) {
+			points.push_back(tile_point(line[i], n));
+			const REAL lat = max(-MAX_LATITUDE, min(line[i].lat, MAX_LATITUDE));
+			radius.push_back(buffer * n / (EARTH_CIRCUMFERENCE * cos(lat * M_PI / 180.0)));
+		}
+		for(size_t i = 0; i < points.size(); i++) {
+			// The polygon encloses the circle, its edges touch it
+			Ring round;
+			const REAL outer = radius[i] / cos(corner);
+			for(int k = 0; k < (radius[i] > 0.0 ? ROUND_SEGMENTS : 1); k++)
+				round.push_back(make_pair(points[i].first + outer * cos(2 * k * corner),
+					points[i].second + outer * sin(2 * k * corner)));
+			coverage.add_polygon(vector<Ring>(1, round));
+			if(i + 1 == points.size()) break;
+
+			const pair<REAL, REAL> &a = points[i], &b = points[i+1];
+			const REAL dx = b.first - a.first, dy = b.second - a.second;
+			const REAL length = sqrt(dx * dx + dy * dy);
+			if(length == 0.0) continue;
+			const REAL width = max(radius[i], radius[i+1]);
+			const REAL nx = -dy / length * width, ny = dx / length * width;
+			Ring rectangle;
+			rectangle.push_back(make_pair(a.first + nx, a.second + ny));
+			rectangle.push_back(make_pair(b.first + nx, b.second + ny));
+			rectangle.push_back(make_pair(b.first - nx, b.second - ny));
+			rectangle.push_back(make_pair(a.first - nx, a.second - ny));
+			coverage.add_polygon(vector<Ring>(1, rectangle));
+		}
+	}
+	coverage.normalize();
+	if(coverage.empty()) {
+		for(int i = 0; i < 4; i++) coverage.box[i] = 0.0;
+	}
+	return coverage;
+}
+
+size_t Coverage::size() const {
+	size_t count = 0;
+	for(map<int, Spans>::const_iterator it = rows.begin(); it != rows.end(); it++)
+		for(size_t i = 0; i < it->second.size(); i++)
+			count += (size_t)(it->second[i].second - it->second[i].first + 1);
+	return count;
+}
+
+bool Coverage::contains(int x, int y) const {
+	map<int, Spans>::const_iterator it = rows.find(y);
+	if(it == rows.end()) return false;
+	// Last span starting at or before x
+	Spans::const_iterator span = upper_bound(it->second.begin(), it->second.end(), make_pair(x, INT_MAX));
+	if(span == it->second.begin()) return false;
+	--span;
+	return x <= span->second;
+}
+
+void Coverage::bounds(int *ibounds) const {
+	ibounds[0] = INT_MAX;
+	ibounds[1] = INT_MIN;
+	ibounds[2] = rows.empty() ? 0 : rows.begin()->first;
+	ibounds[3] = rows.empty() ? -1 : rows.rbegin()->first;
+	for(map<int, Spans>::const_iterator it = rows.begin(); it != rows.end(); it++) {
+		ibounds[0] = min(ibounds[0], it->second.front().first);
+		ibounds[1] = max(ibounds[1], it->second.back().second);
+	}
+	if(rows.empty()) {
+		ibounds[0] = 0;
+		ibounds[1] = -1;
+	}
+}
+
+Coverage Coverage::at_zoom(int zoom) const {
+	if(zoom >= level) return *this;
+	const int shift = level - zoom;
+	Coverage coverage(zoom);
+	for(int i = 0; i < 4; i++) coverage.box[i] = ldexp(box[i], -shift);
+	for(map<int, Spans>::const_iterator it = rows.begin(); it != rows.end(); it++)
+		for(size_t i = 0; i < it->second.size(); i++)
+			coverage.add(it->first >> shift, it->second[i].first >> shift, it->second[i].second >> shift);
+	coverage.normalize();
+	return coverage;
+}
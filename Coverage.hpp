@@ -0,0 +1,63 @@
+/* Coverage.hpp
+ * Tiles intersecting polygons and buffered tracks
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#ifndef _OSMPNG_COVERAGE_HPP_
+#define _OSMPNG_COVERAGE_HPP_
+
+#include <vector>
+#include <map>
+#include <utility>
+
+#include "Geometry.hpp"
+#include "Projection.hpp"
+
+
+/* Set of tiles on one zoom level, kept as sorted, disjoint column spans per
+ * tile row. Shapes are rasterized in fractional tile coordinates: the tiles
+ * crossed by an edge are traced along the edge, the tiles in between are
+ * filled by a scanline through the tile centers of every row */
+class Coverage {
+public:
+	Coverage(int zoom = 0);
+
+	/* Tiles intersecting the polygons and the lines of geometry at zoom.
+	 * Lines and points are widened by buffer meters to each side. Positions
+	 * are clamped to the Web Mercator latitude range. Throws a message if a
+	 * position is out of range */
+	static Coverage rasterize(const Geometry &geometry, int zoom, REAL buffer);
+
+	int zoom() const { return level; }
+	bool empty() const { return rows.empty(); }
+	// Number of tiles
+	size_t size() const;
+	bool contains(int x, int y) const;
+	// Tiles x from-to and y from-to, inclusive
+	void bounds(int *ibounds) const;
+	// Fractional tile coordinates of the rasterized shapes, x from-to and y from-to
+	const REAL* extent() const { return box; }
+
+	// Parents of the tiles on a lower zoom level
+	Coverage at_zoom(int zoom) const;
+
+private:
+	typedef std::vector< std::pair<int, int> > Spans;
+	// Points in fractional tile coordinates, x and y
+	typedef std::vector< std::pair<REAL, REAL> > Ring;
+
+	int level;
+	REAL box[4];
+	std::map<int, Spans> rows;
+
+	void add(int y, int x0, int x1);
+	// Even-odd fill of rings in fractional tile coordinates, closed implicitly
+	void add_polygon(const std::vector<Ring> &rings);
+	// Tiles along an edge from a to b
+	void trace(const std::pair<REAL, REAL> &a, const std::pair<REAL, REAL> &b);
+	// Sort and join the spans of every row
+	void normalize();
+};
+
+#endif
@@ -0,0 +1,573 @@
+/* Fetcher.cpp
+ * Concurrent slippy map tile fetcher based on the curl multi interface
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "Fetcher.hpp"
+
+using namespace std;
+
+// The OpenStreetMap tile servers, used if no source is given
+#define DEFAULT_SOURCE "http://{s}.tile.openstreetmap.org"
+// Lowest request rate per host a throttling server can push us to
+#define MIN_RATE 0.1
+// Backoff before the first retry and the upper limit for later retries
+#define BACKOFF_MILLIS 500
+#define MAX_BACKOFF_MILLIS 60000
+// Stalled transfers are aborted and retried: connecting takes at most
+// CONNECT_TIMEOUT seconds, less than LOW_SPEED_LIMIT bytes per second for
+// LOW_SPEED_TIME seconds count as stalled
+#define CONNECT_TIMEOUT 15L
+#define LOW_SPEED_LIMIT 64L
+#define LOW_SPEED_TIME 30L
+// Every PROBE_INTERVAL-th request measures the mirror with the oldest sample
+#define PROBE_INTERVAL 32
+// Mirrors failing more often are avoided
+#define MAX_ERROR_RATE 0.5
+// Weight of a new sample in the moving averages of the mirror health
+#define HEALTH_WEIGHT 0.2
+
+
+// Callback for receiving http data
+static size_t write_http(void *ptr, size_t size, size_t nmemb, string *buffer) {
+	buffer->append((const char*)ptr, size * nmemb);
+	return size * nmemb;
+}
+
+// Trim whitespaces and line breaks
+static string trim(const string &str) {
+	size_t first = str.find_first_not_of(" \t\r\n");
+	if(first == string::npos) return "";
+	size_t last = str.find_last_not_of(" \t\r\n");
+	return str.substr(first, last - first + 1);
+}
+
+// Callback for receiving http headers. Extracts cache related headers
+size_t Fetcher::header_http(char *buffer, size_t size, size_t nitems, void *userdata) {
+	Fetcher::Transfer *transfer = (Fetcher::Transfer*)userdata;
+	const size_t len = size * nitems;
+	string line(buffer, len);
+
+	// A new response (e.g. after a redirect) starts with the status line
+	if(line.compare(0, 5, "HTTP/") == 0) {
+		transfer->etag.clear();
+		transfer->last_modified.clear();
+		transfer->expires = 0;
+		transfer->max_age = -1;
+		transfer->no_cache = false;
+		transfer->retry_after = -1;
+		return len;
+	}
+
+	size_t colon = line.find(':');
+	if(colon == string::npos) return len;
+	string name = line.substr(0, colon);
+	string value = trim(line.substr(colon + 1));
+	transform(name.begin(), name.end(), name.begin(), ::tolower);
+
+	if(name == "etag") {
+		transfer->etag = value;
+	} else if(name == "last-modified") {
+		transfer->last_modified = value;
+	} else if(name == "expires") {
+		time_t expires = curl_getdate(value.c_str(), NULL);
+		transfer->expires = expires < 0 ? 0 : expires;
+	} else if(name == "cache-control") {
+		string directives = value;
+		transform(directives.begin(), directives.end(), directives.begin(), ::tolower);
+		if(directives.find("no-cache") != string::npos || directives.find("no-store") != string::npos)
+			transfer->no_cache = true;
+		size_t pos = directives.find("max-age=");
+		if(pos != string::npos)
+			transfer->max_age = atol(directives.c_str() + pos + 8);
+	} else if(name == "retry-after") {
+		// Either delay-seconds or a HTTP date
+		if(!value.empty() && isdigit((unsigned char)value[0])) {
+			transfer->retry_after = atol(value.c_str());
+		} else {
+			time_t date = curl_getdate(value.c_str(), NULL);
+			if(date >= 0) transfer->retry_after = max(0L, (long)(date - time(NULL)));
+		}
+		// A server must not pause us for longer than our own backoff would
+		transfer->retry_after = min(transfer->retry_after, (long)(MAX_BACKOFF_MILLIS / 1000));
+	}
+	return len;
+}
+
+vector<string> expand_source(const string &source) {
+	string url = source;
+	// A base URL may still carry a subdomain placeholder
+	if(url.find("{z}") == string::npos && url.find("{x}") == string::npos && url.find("{y}") == string::npos) {
+		if(!url.empty() && url[url.size()-1] == '/') url.erase(url.size()-1);
+		url += "/{z}/{x}/{y}.png";
+	}
+	if(url.find("{z}") == string::npos || url.find("{x}") == string::npos || url.find("{y}") == string::npos)
+		throw "Tile source needs {z}, {x} and {y}: " + source;
+
+	vector<string> result;
+	size_t pos = url.find("{s");
+	if(pos == string::npos) {
+		result.push_back(url);
+		return result;
+	}
+	size_t end = url.find('}', pos);
+	string list = "a,b,c";
+	if(url.compare(pos, 3, "{s:") == 0) list = url.substr(pos + 3, end - pos - 3);
+	else if(end != pos + 2) throw "Invalid subdomain placeholder in " + source;
+	stringstream ss(list);
+	string subdomain;
+	while(getline(ss, subdomain, ','))
+		if(!subdomain.empty()) result.push_back(url.substr(0, pos) + subdomain + url.substr(end + 1));
+	if(result.empty()) throw "Empty subdomain list in " + source;
+	return result;
+}
+
+string source_id(const vector<string> &sources) {
+	vector<string> urls, standard = expand_source(DEFAULT_SOURCE);
+	for(size_t i = 0; i < sources.size(); i++) {
+		// Invalid sources are rejected elsewhere, here they only need a name
+		try {
+			vector<string> mirrors = expand_source(sources[i]);
+			urls.insert(urls.end(), mirrors.begin(), mirrors.end());
+		} catch (...) {
+			urls.push_back(sources[i]);
+		}
+	}
+	if(urls.empty()) return "";
+	sort(urls.begin(), urls.end());
+	urls.erase(unique(urls.begin(), urls.end()), urls.end());
+	sort(standard.begin(), standard.end());
+	if(urls == standard) return "";
+
+	// 64-bit FNV-1a over the templates, each terminated by a newline
+	uint64_t hash = 14695981039346656037ULL;
+	for(size_t i = 0; i < urls.size(); i++) {
+		const string url = urls[i] + '\n';
+		for(size_t k = 0; k < url.size(); k++) {
+			hash ^= (unsigned char)url[k];
+			hash *= 1099511628211ULL;
+		}
+	}
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash);
+	return name;
+}
+
+// Replace all occurrences of a placeholder
+static void replace_all(string &str, const string &placeholder, int value) {
+	const string replacement = to_string(value);
+	for(size_t pos = str.find(placeholder); pos != string::npos; pos = str.find(placeholder, pos + replacement.size()))
+		str.replace(pos, placeholder.size(), replacement);
+}
+
+Fetcher::Fetcher(const FetchOptions &options) {
+	this->options = options;
+	if(this->options.jobs < 1) this->options.jobs = 1;
+	if(this->options.rate < 0.0) this->options.rate = 0.0;
+	this->next_host = 0;
+	this->stopped = false;
+	this->selections = 0;
+	// curl_global_init is not thread safe, so it runs only for the first Fetcher
+	static once_flag curl_initialized;
+	call_once(curl_initialized, []() { curl_global_init(CURL_GLOBAL_DEFAULT); });
+
+	// Validate the sources before any resources are taken
+	vector<string> urls;
+	for(size_t i = 0; i < options.sources.size(); i++) {
+		vector<string> mirrors = expand_source(options.sources[i]);
+		urls.insert(urls.end(), mirrors.begin(), mirrors.end());
+	}
+	if(urls.empty()) urls = expand_source(DEFAULT_SOURCE);
+
+	this->multi = curl_multi_init();
+	if(this->multi == NULL) throw "Error setting up curl";
+	this->share = curl_share_init();
+	if(this->share == NULL) {
+		curl_multi_cleanup(multi);
+		throw "Error setting up curl";
+	}
+	// Share DNS cache, TLS sessions and the connection pool over all handles
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+	if(options.http2)
+		curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+	// Every host starts at the limits and only backs off, if the server asks to
+	for(size_t i = 0; i < urls.size(); i++) {
+		Host host;
+		host.url = urls[i];
+		host.local = host.url.compare(0, 7, "file://") == 0;
+		host.health.url = host.url;
+		host.sampled = clock::time_point();
+		host.paused_until = clock::time_point();
+		host.decreased = clock::time_point();
+		host.window = this->options.jobs;
+		host.rate = host.local ? 0.0 : this->options.rate;
+		host.active = 0;
+		hosts.push_back(host);
+	}
+	random.seed(random_device()());
+}
+
+Fetcher::~Fetcher() {
+	for(map<CURL*, Transfer*>::iterator it = active.begin(); it != active.end(); it++) {
+		Transfer *transfer = it->second;
+		curl_multi_remove_handle(multi, transfer->curl);
+		curl_easy_cleanup(transfer->curl);
+		curl_slist_free_all(transfer->headers);
+		delete transfer;
+	}
+	for(size_t i = 0; i < idle.size(); i++)
+		curl_easy_cleanup(idle[i]);
+	curl_multi_cleanup(multi);
+	curl_share_cleanup(share);
+}
+
+void Fetcher::add(int x, int y, int zoom) {
+	TileJob job;
+	job.x = x;
+	job.y = y;
+	job.zoom = zoom;
+	queue.push_back(job);
+}
+
+void Fetcher::add(const TileJob &job) {
+	queue.push_back(job);
+}
+
+Fetcher::clock::time_point Fetcher::next_slot(const Host &host) {
+	// Computed from the current rate, so an increase takes effect immediately
+	if(host.rate <= 0.0 || host.started.empty()) return host.paused_until;
+	return max(host.paused_until, host.started.back() + chrono::microseconds((long)(1e6 / host.rate)));
+}
+
+int Fetcher::free_host(clock::time_point now) {
+	const bool probe = ++selections % PROBE_INTERVAL == 0;
+	int best = -1;
+	// Ties go round robin, so unmeasured mirrors are tried in turn
+	for(size_t i = 0; i < hosts.size(); i++) {
+		const size_t index = (next_host + i) % hosts.size();
+		const Host &host = hosts[index];
+		if(next_slot(host) > now || host.active >= (int)host.window) continue;
+		if(best < 0) {
+			best = (int)index;
+			continue;
+		}
+		const Host &other = hosts[best];
+		bool better;
+		if(probe) {
+			better = host.sampled < other.sampled;
+		} else {
+			const bool healthy = host.health.error_rate < MAX_ERROR_RATE;
+			if(healthy != (other.health.error_rate < MAX_ERROR_RATE)) better = healthy;
+			else better = host.health.latency < other.health.latency;
+		}
+		if(better) best = (int)index;
+	}
+	if(best >= 0) next_host = best + 1;
+	else selections--;
+	return best;
+}
+
+void Fetcher::sample(Host &host, bool failed, unsigned long millis, clock::time_point now) {
+	MirrorStats &health = host.health;
+	// The first sample replaces the initial guess
+	const double weight = health.requests == 0 ? 1.0 : HEALTH_WEIGHT;
+	health.requests++;
+	if(failed) health.failures++;
+	else health.latency += weight * ((double)millis - health.latency);
+	health.error_rate += weight * ((failed ? 1.0 : 0.0) - health.error_rate);
+	host.sampled = now;
+}
+
+vector<MirrorStats> Fetcher::mirrors() const {
+	vector<MirrorStats> result;
+	for(size_t i = 0; i < hosts.size(); i++)
+		result.push_back(hosts[i].health);
+	return result;
+}
+
+long Fetcher::millis_to_slot(clock::time_point now) const {
+	// Hosts with a full window wait for a transfer to complete instead
+	clock::time_point earliest = now + chrono::seconds(1);
+	if(!queue.empty() && (int)active.size() < options.jobs) {
+		for(size_t i = 0; i < hosts.size(); i++)
+			if(hosts[i].active < (int)hosts[i].window && next_slot(hosts[i]) < earliest)
+				earliest = next_slot(hosts[i]);
+	}
+	if(!delayed.empty() && delayed.begin()->first < earliest)
+		earliest = delayed.begin()->first;
+	if(earliest <= now) return 0;
+	return (long)chrono::duration_cast<chrono::milliseconds>(earliest - now).count() + 1;
+}
+
+void Fetcher::increase(Host &host) {
+	// One more transfer per window and one more request per second every second
+	host.window = min((double)options.jobs, host.window + 1.0 / host.window);
+	if(host.rate > 0.0) {
+		host.rate += 1.0 / host.rate;
+		if(options.rate > 0.0) host.rate = min(options.rate, host.rate);
+	}
+}
+
+void Fetcher::decrease(Host &host, const Transfer &transfer, clock::time_point now) {
+	// Transfers started before the last decrease belong to the same congestion
+	// event and must not halve the limits again
+	if(transfer.started < host.decreased) return;
+	host.decreased = now;
+	host.window = max(1.0, host.window / 2.0);
+	// Without a rate limit so far, start from the rate in the second before
+	// the throttled request
+	double rate = host.rate;
+	if(rate <= 0.0) {
+		rate = 0.0;
+		for(size_t i = 0; i < host.started.size(); i++)
+			if(host.started[i] > transfer.started - chrono::seconds(1) && host.started[i] <= transfer.started) rate++;
+		rate = max(1.0, rate);
+	}
+	host.rate = max(MIN_RATE, rate / 2.0);
+}
+
+Fetcher::clock::duration Fetcher::backoff(const Transfer &transfer) {
+	if(transfer.retry_after >= 0)
+		return chrono::seconds(transfer.retry_after);
+	// Exponential backoff with jitter in [delay/2, delay], so retries of tiles
+	// that failed together do not hit the server together again
+	long delay = BACKOFF_MILLIS;
+	for(int i = 1; i < transfer.job.attempts && delay < MAX_BACKOFF_MILLIS; i++) delay *= 2;
+	delay = min(delay, (long)MAX_BACKOFF_MILLIS);
+	return chrono::milliseconds(uniform_int_distribution<long>(delay / 2, delay)(random));
+}
+
+CURL* Fetcher::acquire() {
+	if(!idle.empty()) {
+		CURL *curl = idle.back();
+		idle.pop_back();
+		return curl;
+	}
+	CURL *curl = curl_easy_init();
+	if(curl == NULL) return NULL;
+	curl_easy_setopt(curl, CURLOPT_SHARE, share);
+	curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, CONNECT_TIMEOUT);
+	curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, LOW_SPEED_LIMIT);
+	curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, LOW_SPEED_TIME);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_http);
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, Fetcher::header_http);
+	if(options.http2) {
+		curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+		// Rather wait for a multiplexed stream than opening a new connection
+		curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+	}
+	return curl;
+}
+
+void Fetcher::release(CURL *curl) {
+	idle.push_back(curl);
+}
+
+bool Fetcher::start(const TileJob &job, size_t host) {
+	string url = hosts[host].url;
+	replace_all(url, "{z}", job.zoom);
+	replace_all(url, "{x}", job.x);
+	replace_all(url, "{y}", job.y);
+
+	CURL *curl = acquire();
+	if(curl == NULL) return false;
+
+	Transfer *transfer = new Transfer();
+	transfer->job = job;
+	transfer->host = host;
+	transfer->curl = curl;
+	transfer->headers = NULL;
+	transfer->expires = 0;
+	transfer->max_age = -1;
+	transfer->no_cache = false;
+	transfer->retry_after = -1;
+	transfer->errbuf[0] = '\0';
+	transfer->started = clock::now();
+
+	// Conditional request, if we have a cached copy
+	if(!job.etag.empty())
+		transfer->headers = curl_slist_append(transfer->headers, ("If-None-Match: " + job.etag).c_str());
+	if(!job.last_modified.empty())
+		transfer->headers = curl_slist_append(transfer->headers, ("If-Modified-Since: " + job.last_modified).c_str());
+
+	curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &transfer->data);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, transfer);
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, transfer->headers);
+	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, transfer->errbuf);
+	curl_easy_setopt(curl, CURLOPT_PRIVATE, transfer);
+	curl_multi_add_handle(multi, curl);
+	active[curl] = transfer;
+	return true;
+}
+
+void Fetcher::start_transfers() {
+	// Retries that are due go first
+	clock::time_point now = clock::now();
+	while(!delayed.empty() && delayed.begin()->first <= now) {
+		queue.push_front(delayed.begin()->second);
+		delayed.erase(delayed.begin());
+	}
+
+	while(!queue.empty() && (int)active.size() < options.jobs) {
+		now = clock::now();
+		int index = free_host(now);
+		if(index < 0) return;
+
+		Host &host = hosts[index];
+		TileJob job = queue.front();
+		if(!start(job, index)) throw "Error setting up curl";
+		queue.pop_front();
+		host.active++;
+		host.started.push_back(now);
+		while(host.started.front() < now - chrono::seconds(10))
+			host.started.pop_front();
+	}
+}
+
+void Fetcher::finish_transfers(TileCallback &callback) {
+	CURLMsg *msg;
+	int left;
+	while((msg = curl_multi_info_read(multi, &left)) != NULL) {
+		if(msg->msg != CURLMSG_DONE) continue;
+		CURL *curl = msg->easy_handle;
+		Transfer *transfer = active[curl];
+		active.erase(curl);
+
+		TileResult result;
+		result.x = transfer->job.x;
+		result.y = transfer->job.y;
+		result.zoom = transfer->job.zoom;
+		result.attempts = transfer->job.attempts + 1;
+		result.size = transfer->data.size();
+		result.millis = (unsigned long)chrono::duration_cast<chrono::milliseconds>(clock::now() - transfer->started).count();
+		result.response_code = 0;
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &result.response_code);
+		curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME, &result.times.namelookup);
+		curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &result.times.connect);
+		curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME, &result.times.appconnect);
+		curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME, &result.times.pretransfer);
+		curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &result.times.starttransfer);
+		curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &result.times.total);
+		result.not_modified = false;
+		result.etag = transfer->etag;
+		result.last_modified = transfer->last_modified;
+		// Cache-Control takes precedence over Expires
+		result.expires = transfer->expires;
+		if(transfer->max_age >= 0) result.expires = time(NULL) + transfer->max_age;
+		if(transfer->no_cache) result.expires = 0;
+
+		CURLcode code = msg->data.result;
+		const clock::time_point now = clock::now();
+		Host &host = hosts[transfer->host];
+		host.active--;
+		// Local files have no status code
+		if(host.local && code == CURLE_OK) result.response_code = 200;
+		// The server asks us to slow down
+		const bool throttled = code == CURLE_OK && (result.response_code == 429 || result.response_code == 503);
+		// Failures that might go away on their own
+		const bool transient = throttled
+			|| code == CURLE_COULDNT_CONNECT || code == CURLE_OPERATION_TIMEDOUT
+			|| code == CURLE_GOT_NOTHING || code == CURLE_SEND_ERROR || code == CURLE_RECV_ERROR
+			|| code == CURLE_PARTIAL_FILE
+			|| (code == CURLE_OK && result.response_code >= 500);
+		if(throttled) {
+			statistics.throttled++;
+			decrease(host, *transfer, now);
+			// Retry-After applies to the whole host
+			if(transfer->retry_after >= 0)
+				host.paused_until = max(host.paused_until, now + chrono::seconds(transfer->retry_after));
+		}
+		const bool succeeded = code == CURLE_OK && (result.response_code == 200 || result.response_code == 304);
+		if(succeeded) increase(host);
+		sample(host, !succeeded, result.millis, now);
+
+		if(code != CURLE_OK) {
+			stringstream ss;
+			ss << "CURL returned error code " << code;
+			if(strlen(transfer->errbuf) > 0) ss << " (" << transfer->errbuf << ")";
+			result.error = ss.str();
+		} else if(result.response_code == 304) {
+			result.not_modified = true;
+		} else if(throttled) {
+			result.error = result.response_code == 429 ? "Too many requests" : "Service unavailable";
+		} else if(result.response_code != 200) {
+			stringstream ss;
+			ss << "Invalid http response code " << result.response_code;
+			result.error = ss.str();
+		}
+		result.ok = result.error.empty();
+		if(result.ok) result.data.swap(transfer->data);
+
+		// Connection statistics
+		long connects = 0, version = 0;
+		curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+		curl_easy_getinfo(curl, CURLINFO_HTTP_VERSION, &version);
+		statistics.transfers++;
+		if(connects > 0) statistics.connections++;
+		else if(code == CURLE_OK && !host.local) statistics.reused++;
+		if(version == CURL_HTTP_VERSION_2_0) statistics.http2++;
+
+		// Try again later instead of giving up
+		const bool retry = transient && transfer->job.attempts < options.retries;
+		if(retry) {
+			statistics.retries++;
+			transfer->job.attempts++;
+			delayed.insert(make_pair(now + backoff(*transfer), transfer->job));
+		}
+
+		curl_multi_remove_handle(multi, curl);
+		release(curl);
+		curl_slist_free_all(transfer->headers);
+		delete transfer;
+
+		if(!retry) callback(result);
+	}
+}
+
+void Fetcher::run(TileCallback callback) {
+	while(!stopped && (!queue.empty() || !active.empty() || !delayed.empty())) {
+		start_transfers();
+
+		int running;
+		curl_multi_perform(multi, &running);
+		finish_transfers(callback);
+
+		if(queue.empty() && active.empty() && delayed.empty()) break;
+
+		// Wait for network activity, the next free request slot or a due retry
+		long timeout = millis_to_slot(clock::now());
+		if(active.empty())
+			this_thread::sleep_for(chrono::milliseconds(timeout));
+		else if(timeout > 0)
+			curl_multi_wait(multi, NULL, 0, (int)timeout, NULL);
+	}
+	if(!stopped) return;
+	// Drop the tiles of a stopped run, the connections stay for the next one
+	queue.clear();
+	delayed.clear();
+	for(map<CURL*, Transfer*>::iterator it = active.begin(); it != active.end(); it++) {
+		Transfer *transfer = it->second;
+		hosts[transfer->host].active--;
+		curl_multi_remove_handle(multi, transfer->curl);
+		release(transfer->curl);
+		curl_slist_free_all(transfer->headers);
+		delete transfer;
+	}
+	active.clear();
+}
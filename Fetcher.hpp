@@ -0,0 +1,224 @@
+/* Fetcher.hpp
+ * Concurrent slippy map tile fetcher based on the curl multi interface
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#ifndef _OSMPNG_FETCHER_HPP_
+#define _OSMPNG_FETCHER_HPP_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <chrono>
+#include <random>
+#include <functional>
+#include <atomic>
+
+#include <curl/curl.h>
+
+
+// A single tile to be fetched
+struct TileJob {
+	int x, y, zoom;
+	// Validators of a cached copy for a conditional request, if not empty
+	std::string etag;
+	std::string last_modified;
+	// Failed attempts so far, maintained by the Fetcher
+	int attempts;
+
+	TileJob() : x(0), y(0), zoom(0), attempts(0) {}
+};
+
+// Phases of a transfer in seconds since its start, as reported by curl
+struct TransferTimes {
+	double namelookup;		// Name resolved
+	double connect;			// TCP connection established
+	double appconnect;		// TLS handshake done, 0 without TLS
+	double pretransfer;		// Request about to be sent
+	double starttransfer;	// First response byte received
+	double total;			// Transfer done
+	TransferTimes() : namelookup(0), connect(0), appconnect(0), pretransfer(0), starttransfer(0), total(0) {}
+};
+
+// Result of a single tile fetch, reported once per tile
+struct TileResult {
+	int x, y, zoom;
+	std::string data;		// Received tile
+	bool ok;
+	bool not_modified;		// Cached copy is still valid (304), data is empty
+	size_t size;			// Bytes received
+	long response_code;		// HTTP response code of the last attempt
+	int attempts;			// Number of requests made for this tile
+	// Cache metadata from the response headers
+	std::string etag;
+	std::string last_modified;
+	time_t expires;			// Time until the tile is fresh, 0 if unknown
+	unsigned long millis;	// Transfer time in milliseconds
+	TransferTimes times;
+	std::string error;		// Error message, if not ok
+};
+
+typedef std::function<void(const TileResult&)> TileCallback;
+
+// Fetcher settings
+struct FetchOptions {
+	int jobs;				// Maximum number of concurrent transfers
+	double rate;			// Maximum requests per second and host, 0 for unlimited
+	int retries;			// Retries per tile after throttling or transient errors
+	bool http2;				// Negotiate HTTP/2 and multiplex transfers per host
+	// Tile sources, see expand_source. Empty for the OpenStreetMap tile servers
+	std::vector<std::string> sources;
+
+	FetchOptions() : jobs(2), rate(1.0), retries(4), http2(false) {}
+};
+
+/* Expand a tile source into the URL templates of its mirrors. A source is
+ * either a template with {z}, {x} and {y} placeholders or a base URL, to
+ * which /{z}/{x}/{y}.png is appended. {s} stands for the subdomains a, b
+ * and c, {s:LIST} for a comma separated list, each becoming a mirror.
+ * file:// sources read tiles from a local directory tree.
+ * Throws a message if the source is invalid */
+std::vector<std::string> expand_source(const std::string &source);
+/* Name of the tiles served by sources, so that tiles of different sources
+ * are cached apart: empty for the OpenStreetMap tile servers, otherwise a
+ * hash of the URL templates of all mirrors, in any order */
+std::string source_id(const std::vector<std::string> &sources);
+
+// Health of a tile server mirror
+struct MirrorStats {
+	std::string url;		// URL template
+	size_t requests;
+	size_t failures;		// Failed and throttled requests
+	double latency;			// Moving average of the transfer time in milliseconds
+	double error_rate;		// Moving average of the failure ratio
+
+	MirrorStats() : requests(0), failures(0), latency(0.0), error_rate(0.0) {}
+};
+
+// Transfer statistics, accumulated over all runs of a Fetcher
+struct FetchStats {
+	size_t transfers;		// Completed transfers
+	size_t connections;		// Transfers that had to open a new connection
+	size_t reused;			// Transfers on an already established connection
+	size_t http2;			// Transfers done via HTTP/2
+	size_t throttled;		// Responses 429 or 503 of a server asking to slow down
+	size_t retries;			// Transfers repeated after throttling or transient errors
+
+	FetchStats() : transfers(0), connections(0), reused(0), http2(0), throttled(0), retries(0) {}
+};
+
+/* Fetches tiles with a bounded number of transfers in flight.
+ * Every request goes to the fastest healthy mirror with a free slot, where
+ * mirrors are ranked by the moving average of their transfer times and
+ * those failing too often are only used when no other is free. Every
+ * PROBE_INTERVAL-th request goes to the mirror measured least recently, so
+ * that recovered mirrors are noticed. Every host gets at most `rate` new
+ * requests per second.
+ * Concurrency and request rate of every host adapt to the server with
+ * additive increase/multiplicative decrease: Each success raises them
+ * towards the configured limits, each throttling response (429, 503) halves
+ * them. Throttled and transiently failed tiles are retried after the
+ * Retry-After of the server or a jittered exponential backoff, both at
+ * most a minute. Stalled connections time out and count as transient.
+ * Easy handles, DNS entries, TLS sessions and connections are kept between
+ * transfers and runs, so a long living Fetcher pays the handshake only once
+ * per host */
+class Fetcher {
+public:
+	Fetcher(const FetchOptions &options = FetchOptions());
+	virtual ~Fetcher();
+
+	// Queue a tile for download
+	void add(int x, int y, int zoom);
+	void add(const TileJob &job);
+	// Number of queued tiles
+	size_t pending() const { return queue.size() + delayed.size(); }
+
+	// Download all queued tiles. callback is invoked once per tile
+	void run(TileCallback callback);
+	// Make run return within a second, dropping the tiles not fetched yet. Only
+	// sets a flag, so it may be called from a signal handler. Later runs return at once
+	void stop() { stopped = true; }
+
+	const FetchStats& stats() const { return statistics; }
+	// Health of all mirrors
+	std::vector<MirrorStats> mirrors() const;
+
+private:
+	typedef std::chrono::steady_clock clock;
+
+	// A transfer in flight
+	struct Transfer {
+		TileJob job;
+		size_t host;
+		CURL *curl;
+		std::string data;
+		struct curl_slist *headers;
+		// Parsed response headers
+		std::string etag;
+		std::string last_modified;
+		time_t expires;
+		long max_age;			// Cache-Control max-age or -1
+		bool no_cache;
+		long retry_after;		// Retry-After in seconds or -1
+		char errbuf[CURL_ERROR_SIZE];
+		clock::time_point started;
+	};
+
+	CURLM *multi;
+	CURLSH *share;
+	FetchOptions options;
+	FetchStats statistics;
+	std::deque<TileJob> queue;
+	// Tiles waiting for their retry
+	std::multimap<clock::time_point, TileJob> delayed;
+	std::map<CURL*, Transfer*> active;
+	std::atomic<bool> stopped;
+	// Idle easy handles for reuse
+	std::vector<CURL*> idle;
+	std::mt19937 random;
+
+	// A tile server with its adaptive limits and health
+	struct Host {
+		std::string url;				// URL template
+		bool local;						// file:// source, not rate limited
+		MirrorStats health;
+		clock::time_point sampled;		// Last completed request
+		clock::time_point paused_until;	// Retry-After of the server
+		clock::time_point decreased;	// Last multiplicative decrease
+		double window;					// Allowed concurrent transfers
+		double rate;					// Requests per second, 0 for unlimited
+		int active;						// Transfers in flight
+		std::deque<clock::time_point> started;	// Recent requests, oldest first
+	};
+	std::vector<Host> hosts;
+	size_t next_host;
+	size_t selections;
+
+	static size_t header_http(char *buffer, size_t size, size_t nitems, void *userdata);
+	// Earliest time, a next request to the host is allowed
+	static clock::time_point next_slot(const Host &host);
+	// Update the health of a host after a completed request
+	static void sample(Host &host, bool failed, unsigned long millis, clock::time_point now);
+	// Index of the best host with a free request slot or -1
+	int free_host(clock::time_point now);
+	// Milliseconds until the next host slot becomes free or a delayed tile is due
+	long millis_to_slot(clock::time_point now) const;
+	// AIMD adjustment of a host after a successful or throttled transfer
+	void increase(Host &host);
+	void decrease(Host &host, const Transfer &transfer, clock::time_point now);
+	// Delay before the next attempt of a tile
+	clock::duration backoff(const Transfer &transfer);
+	// Take an idle easy handle or create a new one
+	CURL* acquire();
+	void release(CURL *curl);
+	// Start as many transfers as allowed
+	void start_transfers();
+	bool start(const TileJob &job, size_t host);
+	// Collect completed transfers
+	void finish_transfers(TileCallback &callback);
+};
+
+#endif
@@ -0,0 +1,328 @@
+/* Geometry.cpp
+ * Polygons and tracks read from GeoJSON and GPX files
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#include <fstream>
+#include <sstream>
+#include <stdlib.h>
+#include <ctype.h>
+
+#include "Geometry.hpp"
+
+using namespace std;
+
+// Deepest accepted nesting of JSON arrays and objects
+#define MAX_JSON_DEPTH 64
+
+
+void Geometry::add(const Geometry &other) {
+	polygons.insert(polygons.end(), other.polygons.begin(), other.polygons.end());
+	lines.insert(lines.end(), other.lines.begin(), other.lines.end());
+}
+
+static string read_file(const string &filename) {
+	ifstream in(filename.c_str(), ios::in | ios::binary);
+	if(!in) throw "Cannot open " + filename;
+	stringstream ss;
+	ss << in.rdbuf();
+	return ss.str();
+}
+
+
+// Parsed JSON value. Members of an object are kept in order as keys and items
+struct JsonValue {
+	enum Type { NUL, BOOLEAN, NUMBER, STRING, ARRAY, OBJECT } type;
+	double number;
+	string text;
+	vector<string> keys;
+	vector<JsonValue> items;
+
+	JsonValue() : type(NUL), number(0.0) {}
+
+	const JsonValue* member(const string &key) const {
+		for(size_t i = 0; i < keys.size(); i++)
+			if(keys[i] == key) return &items[i];
+		return NULL;
+	}
+};
+
+// Recursive descent parser for the JSON of a whole file
+class JsonParser {
+public:
+	JsonParser(const string &text, const string &filename) : text(text), filename(filename), pos(0) {}
+
+	JsonValue parse() {
+		JsonValue value = parse_value(0);
+		skip_space();
+		if(pos < text.size()) fail("Unexpected data");
+		return value;
+	}
+
+private:
+	const string &text;
+	const string &filename;
+	size_t pos;
+
+	void fail(const string &reason) const {
+		stringstream ss;
+		ss << filename << ": " << reason << " at offset " << pos;
+		throw ss.str();
+	}
+
+	void skip_space() {
+		while(pos < text.size() && isspace((unsigned char)text[pos])) pos++;
+	}
+
+	void expect(char c) {
+		skip_space();
+		if(pos >= text.size() || text[pos] != c) fail(string("Expected '") + c + "'");
+		pos++;
+	}
+
+	// Skip a separating comma, false if there is none
+	bool next() {
+		skip_space();
+		if(pos >= text.size() || text[pos] != ',') return false;
+		pos++;
+		return true;
+	}
+
+	JsonValue parse_value(int depth) {
+		if(depth > MAX_JSON_DEPTH) fail("Nested too deeply");
+		skip_space();
+		if(pos >= text.size()) fail("Unexpected end");
+		JsonValue value;
+		const char c = text[pos];
+		if(c == '{') {
+			value.type = JsonValue::OBJECT;
+			pos++;
+			skip_space();
+			if(pos < text.size() && text[pos] == '}') {
+				pos++;
+				return value;
+			}
+			for(;;) {
+				skip_space();
+				value.keys.push_back(parse_string());
+				expect(':');
+				value.items.push_back(parse_value(depth + 1));
+				if(!next()) break;
+			}
+			expect('}');
+		} else if(c == '[') {
+			value.type = JsonValue::ARRAY;
+			pos++;
+			skip_space();
+			if(pos < text.size() && text[pos] == ']') {
+				pos++;
+				return value;
+			}
+			for(;;) {
+				value.items.push_back(parse_value(depth + 1));
+				if(!next()) break;
+			}
+			expect(']');
+		} else if(c == '"') {
+			value.type = JsonValue::STRING;
+			value.text = parse_string();
+		} else if(c == '-' || isdigit((unsigned char)c)) {
+			value.type = JsonValue::NUMBER;
+			const char *begin = text.c_str() + pos;
+			char *end;
+			value.number = strtod(begin, &end);
+			if(end == begin) fail("Invalid number");
+			pos += end - begin;
+		} else if(text.compare(pos, 4, "true") == 0 || text.compare(pos, 5, "false") == 0) {
+			value.type = JsonValue::BOOLEAN;
+			value.number = c == 't' ? 1.0 : 0.0;
+			pos += c == 't' ? 4 : 5;
+		} else if(text.compare(pos, 4, "null") == 0) {
+			pos += 4;
+		} else {
+			fail("Unexpected character");
+		}
+		return value;
+	}
+
+	// Strings are only compared against keys and type names, escapes
+	// outside of ASCII are kept as they are
+	string parse_string() {
+		if(pos >= text.size() || text[pos] != '"') fail("Expected string");
+		pos++;
+		string result;
+		while(pos < text.size() && text[pos] != '"') {
+			char c = text[pos++];
+			if(c == '\\' && pos < text.size()) {
+				c = text[pos++];
+				switch(c) {
+				case 'n': result += '\n'; break;
+				case 't': result += '\t'; break;
+				case 'r': result += '\r'; break;
+				case 'b': result += '\b'; break;
+				case 'f': result += '\f'; break;
+				case 'u':
+					if(pos + 4 > text.size()) fail("Invalid escape");
+					if(text.compare(pos, 2, "00") == 0) result += (char)strtol(text.substr(pos + 2, 2).c_str(), NULL, 16);
+					else result += "\\u" + text.substr(pos, 4);
+					pos += 4;
+					break;
+				default: result += c;
+				}
+			} else {
+				result += c;
+			}
+		}
+		if(pos >= text.size()) fail("Unterminated string");
+		pos++;
+		return result;
+	}
+};
+
+// [lon, lat] or [lon, lat, elevation]
+static GeoPoint json_position(const JsonValue &value) {
+	if(value.type != JsonValue::ARRAY || value.items.size() < 2 ||
+			value.items[0].type != JsonValue::NUMBER || value.items[1].type != JsonValue::NUMBER)
+		throw "Invalid GeoJSON position";
+	return GeoPoint(value.items[0].number, value.items[1].number);
+}
+
+static GeoPath json_path(const JsonValue &value) {
+	if(value.type != JsonValue::ARRAY) throw "Invalid GeoJSON coordinates";
+	GeoPath path;
+	for(size_t i = 0; i < value.items.size(); i++) path.push_back(json_position(value.items[i]));
+	return path;
+}
+
+static vector<GeoPath> json_rings(const JsonValue &value) {
+	if(value.type != JsonValue::ARRAY) throw "Invalid GeoJSON coordinates";
+	vector<GeoPath> rings;
+	for(size_t i = 0; i < value.items.size(); i++) {
+		GeoPath ring = json_path(value.items[i]);
+		if(ring.size() < 3) throw "GeoJSON polygon ring with less than 3 positions";
+		rings.push_back(ring);
+	}
+	return rings;
+}
+
+// Collect the shapes of a GeoJSON object and of the objects within
+static void json_geometry(const JsonValue &value, Geometry &geometry) {
+	if(value.type == JsonValue::NUL) return;		// Feature without geometry
+	if(value.type != JsonValue::OBJECT) throw "GeoJSON object expected";
+	const JsonValue *type = value.member("type");
+	if(type == NULL || type->type != JsonValue::STRING) throw "GeoJSON object without type";
+	const string &name = type->text;
+
+	if(name == "FeatureCollection" || name == "GeometryCollection") {
+		const JsonValue *members = value.member(name == "FeatureCollection" ? "features" : "geometries");
+		if(members == NULL || members->type != JsonValue::ARRAY) throw "Invalid GeoJSON " + name;
+		for(size_t i = 0; i < members->items.size(); i++) json_geometry(members->items[i], geometry);
+		return;
+	}
+	if(name == "Feature") {
+		const JsonValue *member = value.member("geometry");
+		if(member != NULL) json_geometry(*member, geometry);
+		return;
+	}
+
+	const JsonValue *coordinates = value.member("coordinates");
+	if(coordinates == NULL || coordinates->type != JsonValue::ARRAY) throw "GeoJSON " + name + " without coordinates";
+	const vector<JsonValue> &items = coordinates->items;
+	if(name == "Polygon") {
+		geometry.polygons.push_back(json_rings(*coordinates));
+	} else if(name == "MultiPolygon") {
+		for(size_t i = 0; i < items.size(); i++) geometry.polygons.push_back(json_rings(items[i]));
+	} else if(name == "LineString") {
+		geometry.lines.push_back(json_path(*coordinates));
+	} else if(name == "MultiLineString") {
+		for(size_t i = 0; i < items.size(); i++) geometry.lines.push_back(json_path(items[i]));
+	} else if(name == "Point") {
+		geometry.lines.push_back(GeoPath(1, json_position(*coordinates)));
+	} else if(name == "MultiPoint") {
+		for(size_t i = 0; i < items.size(); i++) geometry.lines.push_back(GeoPath(1, json_position(items[i])));
+	} else {
+		throw "Unknown GeoJSON type " + name;
+	}
+}
+
+Geometry read_geojson(const string &filename) {
+	const string text = read_file(filename);
+	JsonParser parser(text, filename);
+	const JsonValue root = parser.parse();
+	Geometry geometry;
+	try {
+		json_geometry(root, geometry);
+	} catch (const char *msg) {
+		throw filename + ": " + msg;
+	} catch (string &msg) {
+		throw filename + ": " + msg;
+	}
+	if(geometry.empty()) throw filename + ": No geometry";
+	return geometry;
+}
+
+
+// Value of an attribute of the tag text[begin..end), empty if not present
+static string xml_attribute(const string &text, size_t begin, size_t end, const string &name) {
+	size_t pos = begin;
+	while((pos = text.find(name, pos)) < end) {
+		const size_t after = pos + name.size();
+		const bool separate = isspace((unsigned char)text[pos - 1]);
+		pos = after;
+		size_t eq = after;
+		while(eq < end && isspace((unsigned char)text[eq])) eq++;
+		if(!separate || eq >= end || text[eq] != '=') continue;
+		size_t quote = eq + 1;
+		while(quote < end && isspace((unsigned char)text[quote])) quote++;
+		if(quote >= end || (text[quote] != '"' && text[quote] != '\'')) continue;
+		const size_t close = text.find(text[quote], quote + 1);
+		if(close >= end) break;
+		return text.substr(quote + 1, close - quote - 1);
+	}
+	return "";
+}
+
+Geometry read_gpx(const string &filename) {
+	const string text = read_file(filename);
+	Geometry geometry;
+	GeoPath line;
+	size_t pos = 0;
+	while((pos = text.find('<', pos)) != string::npos) {
+		if(text.compare(pos, 4, "<!--") == 0) {
+			pos = text.find("-->", pos);
+			if(pos == string::npos) break;
+			continue;
+		}
+		const size_t end = text.find('>', pos);
+		if(end == string::npos) throw filename + ": Unterminated tag";
+		// Closing tags end a segment just like opening ones
+		size_t name_begin = pos + 1;
+		const bool closing = name_begin < end && text[name_begin] == '/';
+		if(closing) name_begin++;
+		size_t name_end = name_begin;
+		while(name_end < end && !isspace((unsigned char)text[name_end]) && text[name_end] != '/') name_end++;
+		string name = text.substr(name_begin, name_end - name_begin);
+		// Namespace prefixes as in <gpx:trkpt> are dropped
+		const size_t colon = name.find(':');
+		if(colon != string::npos) name = name.substr(colon + 1);
+
+		if((name == "trkpt" || name == "rtept") && !closing) {
+			const string lat = xml_attribute(text, name_end, end, "lat");
+			const string lon = xml_attribute(text, name_end, end, "lon");
+			char *lat_end, *lon_end;
+			const REAL latitude = strtod(lat.c_str(), &lat_end);
+			const REAL longitude = strtod(lon.c_str(), &lon_end);
+			if(lat.empty() || lon.empty() || *lat_end != '\0' || *lon_end != '\0')
+				throw filename + ": " + name + " without valid lat and lon";
+			line.push_back(GeoPoint(longitude, latitude));
+		} else if(name == "trkseg" || name == "rte") {
+			if(!line.empty()) geometry.lines.push_back(line);
+			line.clear();
+		}
+		pos = end + 1;
+	}
+	if(!line.empty()) geometry.lines.push_back(line);
+	if(geometry.empty()) throw filename + ": No track or route points";
+	return geometry;
+}
@@ -0,0 +1,48 @@
+/* Geometry.hpp
+ * Polygons and tracks read from GeoJSON and GPX files
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#ifndef _OSMPNG_GEOMETRY_HPP_
+#define _OSMPNG_GEOMETRY_HPP_
+
+#include <string>
+#include <vector>
+
+#include "Projection.hpp"
+
+
+// Geographic position in degrees
+struct GeoPoint {
+	REAL lon, lat;
+
+	GeoPoint() : lon(0.0), lat(0.0) {}
+	GeoPoint(REAL lon, REAL lat) : lon(lon), lat(lat) {}
+};
+
+// Polygon ring or line, rings are closed implicitly
+typedef std::vector<GeoPoint> GeoPath;
+
+// Areas and tracks of an input file
+struct Geometry {
+	// Outer ring first, then the holes
+	std::vector< std::vector<GeoPath> > polygons;
+	// Tracks and points, covered with a buffer around them
+	std::vector<GeoPath> lines;
+
+	bool empty() const { return polygons.empty() && lines.empty(); }
+	// Append the shapes of another geometry
+	void add(const Geometry &other);
+};
+
+/* Read the Polygon, MultiPolygon, LineString, MultiLineString, Point and
+ * MultiPoint geometries of a GeoJSON file, also within Features,
+ * FeatureCollections and GeometryCollections. Throws a message on error */
+Geometry read_geojson(const std::string &filename);
+
+/* Read the tracks (every trkseg) and routes of a GPX file as lines.
+ * Waypoints are ignored. Throws a message on error */
+Geometry read_gpx(const std::string &filename);
+
+#endif
@@ -0,0 +1,237 @@
+/* Image.cpp
+ * Output image formats
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#include <string.h>
+#include <ctype.h>
+#include <sstream>
+#include <vector>
+
+#include "Image.hpp"
+#include "Png.hpp"
+
+using namespace std;
+
+// Longest run of equal pixels in a single QOI chunk
+#define QOI_MAX_RUN 62
+
+
+bool parse_image_format(const string &name, ImageFormat &format) {
+	if(name == "png") format = FORMAT_PNG;
+	else if(name == "ppm") format = FORMAT_PPM;
+	else if(name == "raw" || name == "rgb") format = FORMAT_RAW;
+	else if(name == "qoi") format = FORMAT_QOI;
+	else return false;
+	return true;
+}
+
+ImageFormat image_format(const string &filename, ImageFormat def) {
+	const size_t dot = filename.find_last_of("./");
+	if(dot == string::npos || filename[dot] != '.') return def;
+	string extension = filename.substr(dot + 1);
+	for(size_t i = 0; i < extension.size(); i++) extension[i] = tolower(extension[i]);
+	ImageFormat format;
+	return parse_image_format(extension, format) ? format : def;
+}
+
+FILE* open_output(const string &filename) {
+	if(filename == "-") return stdout;
+	FILE *fp = fopen(filename.c_str(), "wb");
+	if(fp == NULL) throw "Cannot open " + filename + " for writing";
+	return fp;
+}
+
+bool close_output(FILE *fp) {
+	if(fp == stdout) return fflush(fp) == 0;
+	return fclose(fp) == 0;
+}
+
+static void put_uint32(unsigned char *dest, size_t value) {
+	dest[0] = (unsigned char)(value >> 24);
+	dest[1] = (unsigned char)(value >> 16);
+	dest[2] = (unsigned char)(value >> 8);
+	dest[3] = (unsigned char)value;
+}
+
+// Writer of the formats without compression between rows, into a file or a buffer
+class StreamWriter : public ImageWriter {
+public:
+	StreamWriter(FILE *fp, string *buffer, size_t width, size_t height) {
+		this->fp = fp;
+		this->buffer = buffer;
+		this->width = width;
+		this->height = height;
+		this->written = 0;
+	}
+	virtual ~StreamWriter() {
+		if(fp != NULL) close_output(fp);
+	}
+
+	virtual void finish() {
+		if(written != height) throw "Incomplete image";
+		if(fp != NULL && !close_output(fp)) {
+			fp = NULL;
+			throw "Error writing image";
+		}
+		fp = NULL;
+	}
+
+protected:
+	size_t width, height;
+	size_t written;
+
+	void write(const void *data, size_t len) {
+		if(buffer != NULL) buffer->append((const char*)data, len);
+		else if(fp == NULL || fwrite(data, 1, len, fp) != len) throw "Error writing image";
+	}
+	// Rows beyond the image height are an error
+	void count_rows(size_t count) {
+		if(written + count > height) throw "Too many image rows";
+		written += count;
+	}
+
+private:
+	FILE *fp;
+	string *buffer;
+};
+
+// PPM and raw RGB: a header and the rows as they are
+class PlainWriter : public StreamWriter {
+public:
+	PlainWriter(FILE *fp, string *buffer, size_t width, size_t height, const string &header)
+			: StreamWriter(fp, buffer, width, height) {
+		write(header.data(), header.size());
+	}
+
+	virtual void write_rows(const unsigned char *rows, size_t count) {
+		count_rows(count);
+		write(rows, count * width * 3);
+	}
+};
+
+/* QOI encoder. Every pixel becomes a run, an index into the recently seen
+ * colors, a small difference to the previous pixel or the plain color. The
+ * state carries over from row to row, so rows are encoded as they come */
+class QoiWriter : public StreamWriter {
+public:
+	QoiWriter(FILE *fp, string *buffer, size_t width, size_t height) : StreamWriter(fp, buffer, width, height) {
+		unsigned char header[14] = { 'q', 'o', 'i', 'f' };
+		put_uint32(header + 4, width);
+		put_uint32(header + 8, height);
+		header[12] = 3;		// RGB
+		header[13] = 0;		// sRGB with linear alpha
+		write(header, sizeof(header));
+		memset(index, 0, sizeof(index));
+		memset(indexed, 0, sizeof(indexed));
+		previous[0] = previous[1] = previous[2] = 0;
+		run = 0;
+	}
+
+	virtual void write_rows(const unsigned char *rows, size_t count) {
+		count_rows(count);
+		const size_t pixels = count * width;
+		// At most one tag and three color bytes per pixel
+		chunk.resize(pixels * 4);
+		unsigned char *out = &chunk[0];
+		for(size_t i = 0; i < pixels; i++) {
+			const unsigned char *px = rows + i * 3;
+			if(px[0] == previous[0] && px[1] == previous[1] && px[2] == previous[2]) {
+				if(++run == QOI_MAX_RUN) {
+					*out++ = (unsigned char)(0xc0 | (run - 1));
+					run = 0;
+				}
+				continue;
+			}
+			if(run > 0) {
+				*out++ = (unsigned char)(0xc0 | (run - 1));
+				run = 0;
+			}
+			// Hash of the color, alpha is always 255
+			const int slot = (px[0] * 3 + px[1] * 5 + px[2] * 7 + 255 * 11) % 64;
+			if(indexed[slot] && index[slot][0] == px[0] && index[slot][1] == px[1] && index[slot][2] == px[2]) {
+				*out++ = (unsigned char)slot;
+			} else {
+				indexed[slot] = true;
+				index[slot][0] = px[0];
+				index[slot][1] = px[1];
+				index[slot][2] = px[2];
+				const signed char dr = (signed char)(px[0] - previous[0]);
+				const signed char dg = (signed char)(px[1] - previous[1]);
+				const signed char db = (signed char)(px[2] - previous[2]);
+				const int dr_dg = dr - dg, db_dg = db - dg;
+				if(dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+					*out++ = (unsigned char)(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+				} else if(dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+					*out++ = (unsigned char)(0x80 | (dg + 32));
+					*out++ = (unsigned char)((dr_dg + 8) << 4 | (db_dg + 8));
+				} else {
+					*out++ = 0xfe;
+					*out++ = px[0];
+					*out++ = px[1];
+					*out++ = px[2];
+				}
+			}
+			previous[0] = px[0];
+			previous[1] = px[1];
+			previous[2] = px[2];
+		}
+		write(&chunk[0], out - &chunk[0]);
+	}
+
+	virtual void finish() {
+		if(written == height && run > 0) {
+			const unsigned char tag = (unsigned char)(0xc0 | (run - 1));
+			write(&tag, 1);
+			run = 0;
+		}
+		static const unsigned char end[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+		if(written == height) write(end, sizeof(end));
+		StreamWriter::finish();
+	}
+
+private:
+	unsigned char index[64][3];
+	// Decoders start with a transparent black index, so slots are only used once written
+	bool indexed[64];
+	unsigned char previous[3];
+	int run;
+	vector<unsigned char> chunk;
+};
+
+// Header of a PPM or raw RGB image
+static string plain_header(ImageFormat format, size_t width, size_t height) {
+	if(format == FORMAT_PPM) {
+		stringstream ss;
+		ss << "P6\n" << width << " " << height << "\n255\n";
+		return ss.str();
+	}
+	unsigned char header[12] = { 'O', 'R', 'G', 'B' };
+	put_uint32(header + 4, width);
+	put_uint32(header + 8, height);
+	return string((const char*)header, sizeof(header));
+}
+
+static ImageWriter* open_stream(ImageFormat format, FILE *fp, string *buffer, size_t width, size_t height) {
+	if(format == FORMAT_QOI) return new QoiWriter(fp, buffer, width, height);
+	return new PlainWriter(fp, buffer, width, height, plain_header(format, width, height));
+}
+
+ImageWriter* open_image(ImageFormat format, const string &filename, size_t width, size_t height,
+		const PngOptions &options, ThreadPool *pool) {
+	if(format == FORMAT_PNG) return new PngWriter(filename, width, height, options, pool);
+	FILE *fp = open_output(filename);
+	try {
+		return open_stream(format, fp, NULL, width, height);
+	} catch (...) {
+		close_output(fp);
+		throw;
+	}
+}
+
+ImageWriter* open_image(ImageFormat format, string *buffer, size_t width, size_t height,
+		const PngOptions &options, ThreadPool *pool) {
+	if(format == FORMAT_PNG) return new PngWriter(buffer, width, height, options, pool);
+	return open_stream(format, NULL, buffer, width, height);
+}
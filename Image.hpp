@@ -0,0 +1,55 @@
+/* Image.hpp
+ * Output image formats
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#ifndef _OSMPNG_IMAGE_HPP_
+#define _OSMPNG_IMAGE_HPP_
+
+#include <string>
+#include <stdio.h>
+
+#include "ThreadPool.hpp"
+
+
+struct PngOptions;
+
+// Formats of merged images
+enum ImageFormat {
+	FORMAT_PNG,
+	FORMAT_PPM,		// Binary PPM (P6)
+	FORMAT_RAW,		// "ORGB", width and height as 32-bit big endian, then the RGB rows
+	FORMAT_QOI		// Quite OK Image format, see https://qoiformat.org
+};
+
+// Parse a format name (png, ppm, raw, qoi). Returns false if unknown
+bool parse_image_format(const std::string &name, ImageFormat &format);
+// Format by the extension of filename (.png, .ppm, .rgb or .raw, .qoi), def if unknown
+ImageFormat image_format(const std::string &filename, ImageFormat def = FORMAT_PNG);
+
+// Open a file for writing, "-" is stdout. Throws a message on error
+FILE* open_output(const std::string &filename);
+// Close a file of open_output, stdout is only flushed. Returns false on error
+bool close_output(FILE *fp);
+
+// Writes an 8-bit RGB image row by row
+class ImageWriter {
+public:
+	virtual ~ImageWriter() {}
+
+	// Write count rows of width*3 bytes each, stored consecutively in rows
+	virtual void write_rows(const unsigned char *rows, size_t count) = 0;
+	// Write the image end. All rows must have been written
+	virtual void finish() = 0;
+};
+
+/* Writer for an image of the given format into filename ("-" for stdout)
+ * or appended to buffer. options and pool are used by the PNG encoder, the
+ * other formats are written as the rows come in. Throws a message on error */
+ImageWriter* open_image(ImageFormat format, const std::string &filename, size_t width, size_t height,
+	const PngOptions &options, ThreadPool *pool = NULL);
+ImageWriter* open_image(ImageFormat format, std::string *buffer, size_t width, size_t height,
+	const PngOptions &options, ThreadPool *pool = NULL);
+
+#endif
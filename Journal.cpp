@@ -0,0 +1,77 @@
+/* Journal.cpp
+ * On-disk progress journal of the tiles completed by a run
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#include <fstream>
+#include <sstream>
+#include <zlib.h>
+
+#include "Journal.hpp"
+
+using namespace std;
+
+
+Journal::Journal(const string &filename) {
+	this->filename = filename;
+	this->fp = NULL;
+}
+
+Journal::~Journal() {
+	if(fp != NULL) fclose(fp);
+}
+
+JournalEntry Journal::entry(const string &data) {
+	JournalEntry result;
+	result.size = data.size();
+	result.crc = (uint32_t)crc32(crc32(0L, Z_NULL, 0), (const Bytef*)data.data(), (uInt)data.size());
+	return result;
+}
+
+size_t Journal::load() {
+	entries.clear();
+	ifstream in(filename.c_str());
+	string line;
+	while(getline(in, line)) {
+		// A line cut off by the interruption lacks the newline and fails here
+		if(in.eof()) break;
+		stringstream ss(line);
+		TileKey key;
+		JournalEntry record;
+		if(!(ss >> key.zoom >> key.x >> key.y >> record.size >> hex >> record.crc)) continue;
+		entries[key] = record;
+	}
+	return entries.size();
+}
+
+void Journal::open(bool append) {
+	if(fp != NULL) fclose(fp);
+	if(!append) entries.clear();
+	fp = fopen(filename.c_str(), append ? "ab" : "wb");
+	if(fp == NULL) throw "Cannot open journal " + filename;
+}
+
+void Journal::record(const TileKey &key, const string &data) {
+	JournalEntry record = entry(data);
+	map<TileKey, JournalEntry>::const_iterator it = entries.find(key);
+	if(it != entries.end() && it->second.size == record.size && it->second.crc == record.crc) return;
+	entries[key] = record;
+	if(fp == NULL) return;
+	fprintf(fp, "%d %d %d %zu %08x\n", key.zoom, key.x, key.y, record.size, record.crc);
+	fflush(fp);
+}
+
+bool Journal::verify(const TileKey &key, const string &data) const {
+	map<TileKey, JournalEntry>::const_iterator it = entries.find(key);
+	if(it == entries.end()) return false;
+	JournalEntry actual = entry(data);
+	return it->second.size == actual.size && it->second.crc == actual.crc;
+}
+
+void Journal::remove() {
+	if(fp != NULL) fclose(fp);
+	fp = NULL;
+	entries.clear();
+	::remove(filename.c_str());
+}
@@ -0,0 +1,60 @@
+/* Journal.hpp
+ * On-disk progress journal of the tiles completed by a run
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#ifndef _OSMPNG_JOURNAL_HPP_
+#define _OSMPNG_JOURNAL_HPP_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <map>
+
+#include "TileStore.hpp"
+
+
+// Size and checksum of a completed tile
+struct JournalEntry {
+	size_t size;
+	uint32_t crc;
+
+	JournalEntry() : size(0), crc(0) {}
+};
+
+/* Append-only list of completed tiles, one `zoom x y size crc32` line per tile.
+ * Every record is flushed immediately, so an interrupted run loses at most
+ * the line being written. Tiles are recorded when fetched, before their
+ * asynchronous cache write, so a journaled tile may be missing or outdated
+ * in the cache. Only the size and checksum check of verify on resume makes
+ * the journal correct, it must not be dropped */
+class Journal {
+public:
+	Journal(const std::string &filename);
+	virtual ~Journal();
+
+	// Read the records of an earlier run. Incomplete lines are ignored.
+	// Returns the number of tiles recorded
+	size_t load();
+	// Open the journal for recording. Unless append, the journal is started anew
+	void open(bool append);
+	// Record a completed tile, if not yet recorded with the same contents
+	void record(const TileKey &key, const std::string &data);
+	// True if data is the tile recorded for key
+	bool verify(const TileKey &key, const std::string &data) const;
+	// Close and delete the journal, e.g. once all tiles are done
+	void remove();
+
+	size_t size() const { return entries.size(); }
+	const std::string& file() const { return filename; }
+
+private:
+	std::string filename;
+	FILE *fp;
+	std::map<TileKey, JournalEntry> entries;
+
+	static JournalEntry entry(const std::string &data);
+};
+
+#endif
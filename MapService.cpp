@@ -0,0 +1,527 @@
+/* MapService.cpp
+ * Library interface: fetch tiles and build maps from them
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#include <sstream>
+#include <set>
+#include <exception>
+#include <algorithm>
+#include <math.h>
+#include <time.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "MapService.hpp"
+#include "PMTiles.hpp"
+
+using namespace std;
+
+
+const char* error_name(ErrorCode code) {
+	switch(code) {
+	case OSMPNG_OK: return "ok";
+	case OSMPNG_INVALID_ARGUMENT: return "invalid argument";
+	case OSMPNG_AREA_TOO_LARGE: return "area too large";
+	case OSMPNG_FETCH_FAILED: return "fetch failed";
+	case OSMPNG_RENDER_FAILED: return "render failed";
+	case OSMPNG_IO_ERROR: return "i/o error";
+	}
+	return "unknown error";
+}
+
+/* Call fn and turn the messages thrown by the lower layers into a status
+ * with the given code */
+template<typename Function> static Status guard(ErrorCode code, Function fn) {
+	try {
+		fn();
+	} catch (string &msg) {
+		return Status(code, msg);
+	} catch (const char *msg) {
+		return Status(code, msg);
+	} catch (exception &e) {
+		return Status(code, e.what());
+	}
+	return Status();
+}
+
+// Create a directory and its parents. Returns false on error
+static bool make_directories(const string &path) {
+	for(size_t i = 1; i <= path.size(); i++) {
+		if(i < path.size() && path[i] != '/') continue;
+		const string dir = path.substr(0, i);
+		if(mkdir(dir.c_str(), S_IRWXU) != 0 && errno != EEXIST) return false;
+	}
+	return true;
+}
+
+
+void observe_transfer(Metrics *metrics, const TransferTimes &t) {
+	if(metrics == NULL) return;
+	metrics->observe("fetch_dns_seconds", t.namelookup);
+	metrics->observe("fetch_connect_seconds", max(0.0, t.connect - t.namelookup));
+	if(t.appconnect > 0.0)
+		metrics->observe("fetch_tls_seconds", max(0.0, t.appconnect - t.connect));
+	metrics->observe("fetch_ttfb_seconds", max(0.0, t.starttransfer - t.pretransfer));
+	metrics->observe("fetch_body_seconds", max(0.0, t.total - t.starttransfer));
+	metrics->observe("fetch_total_seconds", t.total);
+}
+
+
+MapArea::MapArea() {
+	zoom = 0;
+	for(int i = 0; i < 4; i++) {
+		bounds[i] = 0.0;
+		ibounds[i] = 0;
+	}
+}
+
+// Tiles covering a rectangle in fractional tile coordinates. n is the number of tiles per axis
+static void cover(const REAL *bounds, int *ibounds, REAL n) {
+	// A rectangle ending exactly on a tile border does not need the next tile.
+	// Edges on the border of the grid stay within its tiles
+	const int last = (int)n - 1;
+	for (int i=0;i<4;i+=2) {
+		ibounds[i] = max(0, min((int)floor(bounds[i]), last));
+		ibounds[i+1] = max(ibounds[i], min((int)ceil(bounds[i+1]) - 1, last));
+	}
+}
+
+Status MapArea::from_degrees(REAL lon0, REAL lon1, REAL lat0, REAL lat1, int zoom, MapArea &area) {
+	if(zoom < 0 || zoom > 24) return Status(OSMPNG_INVALID_ARGUMENT, "Zoom must be between 0 and 24");
+	const REAL lon[2] = { lon0, lon1 };
+	const REAL lat[2] = { lat0, lat1 };
+	for(int i=0;i<2;i++) {
+		// Negated comparisons also reject NaN
+		if(!(lon[i] >= -180.0)) return Status(OSMPNG_INVALID_ARGUMENT, "Longitude < -180 degree");
+		if(!(lon[i] <= 180.0)) return Status(OSMPNG_INVALID_ARGUMENT, "Longitude > 180 degree");
+		if(!(lat[i] >= -90.0)) return Status(OSMPNG_INVALID_ARGUMENT, "Latitude < -90 degree");
+		if(!(lat[i] <= 90.0)) return Status(OSMPNG_INVALID_ARGUMENT, "Latitude > 90 degree");
+	}
+
+	// Calculate tile coordinates. The grid ends short of the poles
+	lat0 = max(-MAX_LATITUDE, min(lat0, MAX_LATITUDE));
+	lat1 = max(-MAX_LATITUDE, min(lat1, MAX_LATITUDE));
+	const REAL n = pow(2.0, zoom);
+	REAL *bounds = area.bounds;
+	bounds[0] = getTileX(min(lon0, lon1), n);
+	bounds[1] = getTileX(max(lon0, lon1), n);
+	bounds[2] = getTileY(max(lat0, lat1), n);
+	bounds[3] = getTileY(min(lat0, lat1), n);
+	area.zoom = zoom;
+	cover(bounds, area.ibounds, n);
+	return Status();
+}
+
+Status MapArea::from_geometry(const Geometry &geometry, int zoom, REAL buffer, MapArea &area) {
+	if(zoom < 0 || zoom > 24) return Status(OSMPNG_INVALID_ARGUMENT, "Zoom must be between 0 and 24");
+	if(!(buffer >= 0.0)) return Status(OSMPNG_INVALID_ARGUMENT, "Buffer must not be negative");
+	Coverage *coverage = NULL;
+	Status status = guard(OSMPNG_INVALID_ARGUMENT, [&]() {
+		coverage = new Coverage(Coverage::rasterize(geometry, zoom, buffer));
+	});
+	if(!status.ok()) return status;
+	area.coverage.reset(coverage);
+	if(coverage->empty()) return Status(OSMPNG_INVALID_ARGUMENT, "Geometry covers no tiles");
+
+	area.zoom = zoom;
+	coverage->bounds(area.ibounds);
+	// Crop to the shapes, but never beyond the covered tiles
+	for(int i=0;i<4;i++)
+		area.bounds[i] = max((REAL)area.ibounds[i & 2], min(coverage->extent()[i], (REAL)(area.ibounds[i | 1] + 1)));
+	return Status();
+}
+
+MapArea MapArea::at_zoom(int zoom) const {
+	MapArea area;
+	const REAL scale = pow(2.0, this->zoom - zoom);
+	for(int k=0;k<4;k++) area.bounds[k] = bounds[k] / scale;
+	area.zoom = zoom;
+	cover(area.bounds, area.ibounds, pow(2.0, zoom));
+	if(coverage) area.coverage = make_shared<Coverage>(coverage->at_zoom(zoom));
+	return area;
+}
+
+bool MapArea::covers(int x, int y) const {
+	if(x < ibounds[0] || x > ibounds[1] || y < ibounds[2] || y > ibounds[3]) return false;
+	return !coverage || coverage->contains(x, y);
+}
+
+size_t MapArea::tiles() const {
+	if(coverage) return coverage->size();
+	return (size_t)(ibounds[1] - ibounds[0] + 1) * (size_t)(ibounds[3] - ibounds[2] + 1);
+}
+
+
+MapOptions::MapOptions() {
+	cache_dir = "/tmp/.osmpng_cache";
+	keep_tiles = true;
+	cache_max_size = 0;
+	threads = 0;
+	decoded_cache = 0;
+	blend = false;
+	background[0] = background[1] = background[2] = 255;
+	whole_tiles = false;
+	max_tiles = 0;
+	metrics = NULL;
+}
+
+Status MapOptions::validate() const {
+	if(fetch.jobs < 1) return Status(OSMPNG_INVALID_ARGUMENT, "At least one concurrent download is needed");
+	if(fetch.rate < 0.0) return Status(OSMPNG_INVALID_ARGUMENT, "Rate must not be negative");
+	if(fetch.retries < 0) return Status(OSMPNG_INVALID_ARGUMENT, "Retries must not be negative");
+	if(png.level < 0 || png.level > 9)
+		return Status(OSMPNG_INVALID_ARGUMENT, "Compression level must be between 0 and 9");
+	if(threads < 0) return Status(OSMPNG_INVALID_ARGUMENT, "Threads must not be negative");
+	return guard(OSMPNG_INVALID_ARGUMENT, [&]() {
+		for(size_t i = 0; i < fetch.sources.size(); i++) expand_source(fetch.sources[i]);
+	});
+}
+
+
+string MapOptions::tile_dir() const {
+	string dir = cache_dir;
+	if(!dir.empty() && dir[dir.size()-1] != '/') dir += '/';
+	const string id = source_id(fetch.sources);
+	if(!id.empty()) dir += "source-" + id + "/";
+	return dir;
+}
+
+
+TileProvider::TileProvider(const MapOptions &options)
+		: cache(options.tile_dir(), options.cache_max_size, options.keep_tiles) {
+	this->fetcher = NULL;
+	this->keep = options.keep_tiles;
+	this->metrics = options.metrics;
+	state = options.validate();
+	if(!state.ok()) return;
+	if(keep && !make_directories(options.tile_dir())) {
+		state = Status(OSMPNG_IO_ERROR, "Cannot create " + options.tile_dir() + ": " + strerror(errno));
+		return;
+	}
+	state = guard(OSMPNG_INVALID_ARGUMENT, [&]() {
+		fetcher = new Fetcher(options.fetch);
+	});
+}
+
+TileProvider::~TileProvider() {
+	cache.flush();
+	delete fetcher;
+}
+
+size_t TileProvider::lookup(const vector<TileKey> &keys, TileStore &store, const TileHooks &hooks,
+		vector<TileJob> &missing, map<TileKey, CacheEntry> &stale, vector<TileKey> *absent) {
+	const time_t now = time(NULL);
+	size_t trusted = 0;
+	for(size_t i = 0; i < keys.size(); i++) {
+		const TileKey &key = keys[i];
+		TileJob job;
+		job.x = key.x;
+		job.y = key.y;
+		job.zoom = key.zoom;
+
+		CacheEntry entry;
+		if(cache.load(key, entry)) {
+			const bool trust = hooks.trusted && hooks.trusted(key, entry.data);
+			if(trust || entry.fresh(now)) {
+				if(trust) trusted++;
+				store.put(key, entry.data);
+				if(hooks.completed) hooks.completed(key, entry.data);
+				continue;
+			}
+			if(entry.validatable()) {
+				job.etag = entry.etag;
+				job.last_modified = entry.last_modified;
+				store.put(key, entry.data);
+				entry.data.clear();
+				stale[key] = entry;
+			}
+		} else if(absent != NULL) {
+			absent->push_back(key);
+		}
+		missing.push_back(job);
+	}
+	return trusted;
+}
+
+Status TileProvider::get(const MapArea &area, TileStore &store, const TileHooks &hooks) {
+	vector<TileKey> keys;
+	for(int y=area.ibounds[2];y<=area.ibounds[3];y++)
+		for(int x=area.ibounds[0];x<=area.ibounds[1];x++)
+			if(area.covers(x, y)) keys.push_back(TileKey(x, y, area.zoom));
+	return get(keys, store, hooks);
+}
+
+Status TileProvider::get(const vector<TileKey> &keys, TileStore &store, const TileHooks &hooks) {
+	if(!state.ok()) return state;
+	vector<TileJob> missing;
+	map<TileKey, CacheEntry> stale;
+	vector<TileKey> absent;
+	const size_t trusted = lookup(keys, store, hooks, missing, stale, &absent);
+	if(metrics != NULL) {
+		metrics->add("tiles_requested_total", keys.size());
+		metrics->add("tiles_cache_fresh_total", keys.size() - missing.size() - trusted);
+		metrics->add("tiles_resumed_total", trusted);
+	}
+
+	unique_lock<mutex> lock(fetching, defer_lock);
+	if(!missing.empty()) {
+		lock.lock();
+		// Another caller may have fetched the tiles, that were not cached at all, in the
+		// meantime. Cached ones are not read again
+		vector<TileJob> rechecked;
+		lookup(absent, store, hooks, rechecked, stale, NULL);
+		map<TileKey, TileJob> still;
+		for(size_t i = 0; i < rechecked.size(); i++)
+			still[TileKey(rechecked[i].x, rechecked[i].y, rechecked[i].zoom)] = rechecked[i];
+		const set<TileKey> checked(absent.begin(), absent.end());
+		vector<TileJob> remaining;
+		for(size_t i = 0; i < missing.size(); i++) {
+			const TileKey key(missing[i].x, missing[i].y, missing[i].zoom);
+			if(checked.count(key) == 0) remaining.push_back(missing[i]);
+			else if(still.count(key) > 0) remaining.push_back(still[key]);
+		}
+		missing.swap(remaining);
+	}
+	if(hooks.fetching) hooks.fetching(missing);
+
+	size_t failed = 0, revalidated = 0, downloaded = 0, bytes = 0;
+	string error;
+	for(size_t i = 0; i < missing.size(); i++) fetcher->add(missing[i]);
+	Status status = guard(OSMPNG_FETCH_FAILED, [&]() {
+		if(missing.empty()) return;
+		fetcher->run([&](const TileResult &result) {
+			if(result.response_code > 0) observe_transfer(metrics, result.times);
+			if(!result.ok) {
+				if(failed++ == 0) error = result.error;
+				if(hooks.fetched) hooks.fetched(result);
+				return;
+			}
+			TileKey key(result.x, result.y, result.zoom);
+			if(result.not_modified) {
+				revalidated++;
+				CacheEntry &entry = stale[key];
+				if(!result.etag.empty()) entry.etag = result.etag;
+				if(!result.last_modified.empty()) entry.last_modified = result.last_modified;
+				entry.expires = result.expires;
+				if(keep) cache.store_meta(key, entry);
+				if(hooks.completed) hooks.completed(key, *store.get(key));
+			} else {
+				downloaded++;
+				bytes += result.size;
+				store.put(key, result.data);
+				if(keep) {
+					CacheEntry entry;
+					entry.data = result.data;
+					entry.etag = result.etag;
+					entry.last_modified = result.last_modified;
+					entry.expires = result.expires;
+					cache.store(key, entry);
+				}
+				if(hooks.completed) hooks.completed(key, result.data);
+			}
+			if(hooks.fetched) hooks.fetched(result);
+		});
+	});
+	if(metrics != NULL) {
+		metrics->add("tiles_revalidated_total", revalidated);
+		metrics->add("tiles_downloaded_total", downloaded);
+		metrics->add("bytes_downloaded_total", bytes);
+		metrics->add("tiles_failed_total", failed);
+	}
+	if(!status.ok()) return status;
+	if(failed > 0) {
+		stringstream ss;
+		ss << failed << " of " << missing.size() << " tiles could not be downloaded (" << error << ")";
+		return Status(OSMPNG_FETCH_FAILED, ss.str());
+	}
+	return Status();
+}
+
+size_t TileProvider::flush() {
+	return cache.flush();
+}
+
+FetchStats TileProvider::stats() {
+	lock_guard<mutex> lock(fetching);
+	return fetcher == NULL ? FetchStats() : fetcher->stats();
+}
+
+vector<MirrorStats> TileProvider::mirrors() {
+	lock_guard<mutex> lock(fetching);
+	return fetcher == NULL ? vector<MirrorStats>() : fetcher->mirrors();
+}
+
+
+MosaicBuilder::MosaicBuilder(const MapOptions &options) : options(options), pool(options.threads) {
+	this->slab = NULL;
+	if(options.decoded_cache == 0) return;
+	slab_state = guard(OSMPNG_IO_ERROR, [&]() {
+		const string dir = options.tile_dir();
+		if(!make_directories(dir)) throw "Cannot create " + dir + ": " + strerror(errno);
+		slab = new SlabCache(dir + "decoded.slab", options.decoded_cache);
+	});
+}
+
+MosaicBuilder::~MosaicBuilder() {
+	delete slab;
+}
+
+Status MosaicBuilder::merge(const TileStore &tiles, const MapArea &area, const string *filename, string *buffer,
+		ImageFormat format) {
+	return guard(OSMPNG_RENDER_FAILED, [&]() {
+		Span span(options.metrics, "stage_merge_seconds");
+		const double *crop = options.whole_tiles ? NULL : area.bounds;
+		if(buffer != NULL)
+			merge_tiles(tiles, area.ibounds, area.zoom, buffer, options.png, background(), pool,
+				options.metrics, crop, slab, format);
+		else
+			merge_tiles(tiles, area.ibounds, area.zoom, *filename, options.png, background(), pool,
+				options.metrics, crop, slab, format);
+	});
+}
+
+Status MosaicBuilder::render(const TileStore &tiles, const MapArea &area, const string &filename,
+		ImageFormat format) {
+	return merge(tiles, area, &filename, NULL, format);
+}
+
+Status MosaicBuilder::render(const TileStore &tiles, const MapArea &area, string *buffer, ImageFormat format) {
+	return merge(tiles, area, NULL, buffer, format);
+}
+
+Status MosaicBuilder::write_archive(const TileStore &tiles, const MapArea &area, int min_zoom,
+		const string &name, string *buffer) {
+	// Lower levels cover the same area
+	vector<ArchiveTile> archived;
+	for(int z=area.zoom;z>=min_zoom;z--) {
+		const int shift = area.zoom - z;
+		const Coverage level = area.coverage ? area.coverage->at_zoom(z) : Coverage();
+		for(int x=area.ibounds[0]>>shift;x<=area.ibounds[1]>>shift;x++) {
+			for(int y=area.ibounds[2]>>shift;y<=area.ibounds[3]>>shift;y++) {
+				if(area.coverage && !level.contains(x, y)) continue;
+				TileKey key(x, y, z);
+				const string *data = tiles.get(key);
+				if(data == NULL) return Status(OSMPNG_INVALID_ARGUMENT, "Missing tile");
+				archived.push_back(ArchiveTile(key, data));
+			}
+		}
+	}
+
+	const REAL n = pow(2.0, area.zoom);
+	ArchiveInfo info;
+	info.name = name;
+	info.attribution = "\xc2\xa9 OpenStreetMap contributors";
+	info.min_lon = getLongitude(area.ibounds[0], n);
+	info.max_lon = getLongitude(area.ibounds[1] + 1, n);
+	info.min_lat = getLatitude(area.ibounds[3] + 1, n);
+	info.max_lat = getLatitude(area.ibounds[2], n);
+	return guard(buffer != NULL ? OSMPNG_RENDER_FAILED : OSMPNG_IO_ERROR, [&]() {
+		Span span(options.metrics, "stage_archive_seconds");
+		if(buffer != NULL) write_pmtiles(buffer, archived, info);
+		else write_pmtiles(name, archived, info);
+	});
+}
+
+Status MosaicBuilder::archive(const TileStore &tiles, const MapArea &area, int min_zoom, const string &filename) {
+	return write_archive(tiles, area, min_zoom, filename, NULL);
+}
+
+Status MosaicBuilder::archive(const TileStore &tiles, const MapArea &area, int min_zoom, string *buffer) {
+	return write_archive(tiles, area, min_zoom, "osmpng", buffer);
+}
+
+const unsigned char* MosaicBuilder::fill_color() const {
+	static const unsigned char white[3] = { 255, 255, 255 };
+	return options.blend ? options.background : white;
+}
+
+string MosaicBuilder::blank_tile(const string &like) {
+	size_t width, height;
+	if(!png_dimensions(like, width, height)) throw "Invalid tile";
+	const unsigned char *color = fill_color();
+	vector<unsigned char> row(width * 3);
+	for(size_t x = 0; x < width; x++)
+		for(int c = 0; c < 3; c++) row[x * 3 + c] = color[c];
+	string png;
+	PngWriter writer(&png, width, height, options.png);
+	for(size_t y = 0; y < height; y++) writer.write_rows(&row[0], 1);
+	writer.finish();
+	return png;
+}
+
+Status MosaicBuilder::fill_uncovered(TileStore &tiles, const MapArea &area) {
+	if(!area.coverage) return Status();
+	const string *like = NULL;
+	for(int y=area.ibounds[2];y<=area.ibounds[3] && like == NULL;y++)
+		for(int x=area.ibounds[0];x<=area.ibounds[1] && like == NULL;x++)
+			if(area.covers(x, y)) like = tiles.get(TileKey(x, y, area.zoom));
+	if(like == NULL) return Status(OSMPNG_INVALID_ARGUMENT, "Missing tile");
+	string blank;
+	Status status = guard(OSMPNG_RENDER_FAILED, [&]() {
+		blank = blank_tile(*like);
+	});
+	if(!status.ok()) return status;
+	// The store keeps the blank tile once, so it is decoded only once as well
+	for(int y=area.ibounds[2];y<=area.ibounds[3];y++)
+		for(int x=area.ibounds[0];x<=area.ibounds[1];x++)
+			if(!area.covers(x, y) && tiles.get(TileKey(x, y, area.zoom)) == NULL)
+				tiles.put(TileKey(x, y, area.zoom), blank);
+	return Status();
+}
+
+Merger* MosaicBuilder::merger(const MapArea &area, const string &first, const string &filename,
+		ImageFormat format) {
+	return new Merger(area.ibounds, area.zoom, first, filename, options.png, background(), pool,
+		options.metrics, options.whole_tiles ? NULL : area.bounds, slab, format);
+}
+
+
+MapService::MapService(const MapOptions &options) : options(options), provider(options), builder(options) {
+}
+
+Status MapService::status() const {
+	return provider.status();
+}
+
+Status MapService::prepare(const MapArea &area, TileStore &store) {
+	if(options.max_tiles > 0 && area.tiles() > options.max_tiles) {
+		stringstream ss;
+		ss << "Area too large: " << area.tiles() << " tiles, at most " << options.max_tiles << " are allowed";
+		return Status(OSMPNG_AREA_TOO_LARGE, ss.str());
+	}
+	return provider.get(area, store);
+}
+
+static ImageFormat image_format(MapFormat format) {
+	switch(format) {
+	case MAP_PPM: return FORMAT_PPM;
+	case MAP_RAW: return FORMAT_RAW;
+	case MAP_QOI: return FORMAT_QOI;
+	default: return FORMAT_PNG;
+	}
+}
+
+Status MapService::render(const MapArea &area, MapFormat format, string *buffer) {
+	TileStore store;
+	Status status = prepare(area, store);
+	if(!status.ok()) return status;
+	if(format == MAP_PMTILES) return builder.archive(store, area, area.zoom, buffer);
+	status = builder.fill_uncovered(store, area);
+	if(!status.ok()) return status;
+	return builder.render(store, area, buffer, image_format(format));
+}
+
+Status MapService::render(const MapArea &area, MapFormat format, const string &filename) {
+	TileStore store;
+	Status status = prepare(area, store);
+	if(!status.ok()) return status;
+	if(format == MAP_PMTILES) return builder.archive(store, area, area.zoom, filename);
+	status = builder.fill_uncovered(store, area);
+	if(!status.ok()) return status;
+	return builder.render(store, area, filename, image_format(format));
+}
@@ -0,0 +1,230 @@
+/* MapService.hpp
+ * Library interface: fetch tiles and build maps from them
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#ifndef _OSMPNG_MAPSERVICE_HPP_
+#define _OSMPNG_MAPSERVICE_HPP_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <memory>
+#include <functional>
+
+#include "Status.hpp"
+#include "TileStore.hpp"
+#include "TileCache.hpp"
+#include "Fetcher.hpp"
+#include "ThreadPool.hpp"
+#include "Png.hpp"
+#include "Image.hpp"
+#include "Merge.hpp"
+#include "Metrics.hpp"
+#include "SlabCache.hpp"
+#include "Projection.hpp"
+#include "Geometry.hpp"
+#include "Coverage.hpp"
+
+
+/* A map: rectangle on a zoom level and the tiles covering it. If coverage
+ * is set, only its tiles are used, the others within ibounds are blank */
+struct MapArea {
+	int zoom;
+	REAL bounds[4];			// Fractional tile coordinates, x from-to and y from-to
+	int ibounds[4];			// Tiles covering the rectangle, inclusive
+	std::shared_ptr<const Coverage> coverage;
+
+	MapArea();
+	// Area between two longitudes and two latitudes in degrees, each pair in any order
+	static Status from_degrees(REAL lon0, REAL lon1, REAL lat0, REAL lat1, int zoom, MapArea &area);
+	// Tiles intersecting the shapes of geometry, lines widened by buffer meters to each side
+	static Status from_geometry(const Geometry &geometry, int zoom, REAL buffer, MapArea &area);
+	// The same rectangle on a lower zoom level
+	MapArea at_zoom(int zoom) const;
+	// Whether the tile is part of the area
+	bool covers(int x, int y) const;
+	// Number of tiles of the area
+	size_t tiles() const;
+};
+
+// Observe the phases of a transfer in the fetch_*_seconds histograms, if metrics is not NULL
+void observe_transfer(Metrics *metrics, const TransferTimes &times);
+
+// Settings of the library classes
+struct MapOptions {
+	std::string cache_dir;		// Tile cache, created if needed
+	bool keep_tiles;			// Store fetched tiles in the cache
+	size_t cache_max_size;		// Bytes of cached tiles, least recently used ones are evicted. 0 for no limit
+	FetchOptions fetch;
+	PngOptions png;
+	int threads;				// Threads for merging, 0 for one per core
+	size_t decoded_cache;		// Bytes of decoded tiles kept in the cache directory, 0 for none
+	bool blend;					// Composite transparent pixels onto background, drop alpha otherwise
+	unsigned char background[3];
+	bool whole_tiles;			// Do not crop maps to the requested area
+	size_t max_tiles;			// Largest map in tiles, 0 for no limit
+	Metrics *metrics;			// Timings and counters are recorded here, if not NULL
+
+	MapOptions();
+	// Check the settings, OSMPNG_INVALID_ARGUMENT if one is out of range
+	Status validate() const;
+	// Directory of the tiles of fetch.sources, ending in '/': cache_dir for the
+	// OpenStreetMap tile servers, a subdirectory source-ID of it for others
+	std::string tile_dir() const;
+};
+
+/* Optional callbacks of TileProvider::get, to follow a fetch and to record
+ * its progress. All are called on the thread calling get */
+struct TileHooks {
+	// Whether a cached tile is used as it is, even if stale. E.g. tiles an
+	// interrupted run has already completed
+	std::function<bool(const TileKey &key, const std::string &data)> trusted;
+	// The cached tiles are looked up and jobs are about to be fetched
+	std::function<void(const std::vector<TileJob> &jobs)> fetching;
+	// A tile is in the store for good: fresh or trusted from the cache, revalidated or downloaded
+	std::function<void(const TileKey &key, const std::string &data)> completed;
+	// A transfer has finished, successfully or not. Its tile is completed already
+	std::function<void(const TileResult &result)> fetched;
+};
+
+/* Tiles from the cache, missing and stale ones from the tile servers.
+ * Safe for concurrent use: cached tiles are looked up in parallel, while
+ * downloads go through a single Fetcher one batch at a time, so that all
+ * callers share its connections and no tile is fetched twice. Fetched
+ * tiles are written to the cache in the background, callers do not wait
+ * for each other's disk writes */
+class TileProvider {
+public:
+	TileProvider(const MapOptions &options);
+	virtual ~TileProvider();
+
+	// OSMPNG_OK or the reason, why the provider cannot be used
+	const Status& status() const { return state; }
+
+	// Put all tiles of the area into store
+	Status get(const MapArea &area, TileStore &store, const TileHooks &hooks = TileHooks());
+	Status get(const std::vector<TileKey> &keys, TileStore &store, const TileHooks &hooks = TileHooks());
+
+	// Stop fetching, e.g. on a signal: get returns soon, without the tiles not
+	// fetched yet, and later calls fetch nothing. Safe in a signal handler
+	void cancel() { if(fetcher != NULL) fetcher->stop(); }
+	// Wait until fetched tiles are written to the cache. Returns the number of
+	// writes failed since the last call
+	size_t flush();
+	// Number of tiles evicted from the cache to stay within cache_max_size
+	size_t evicted() { return cache.evicted(); }
+	// Number of cached tiles, that were linked to an existing object
+	size_t deduplicated() { return cache.deduplicated(); }
+	FetchStats stats();
+	std::vector<MirrorStats> mirrors();
+
+private:
+	Status state;
+	TileCache cache;
+	Fetcher *fetcher;
+	std::mutex fetching;
+	bool keep;
+	Metrics *metrics;
+
+	// Put the fresh and trusted cached tiles of keys into store, the others are queued
+	// in missing. Stale tiles with validators are put into store as well and revalidated.
+	// Tiles not cached at all are also added to absent, if not NULL. Returns the number
+	// of trusted tiles
+	size_t lookup(const std::vector<TileKey> &keys, TileStore &store, const TileHooks &hooks,
+		std::vector<TileJob> &missing, std::map<TileKey, CacheEntry> &stale, std::vector<TileKey> *absent);
+};
+
+/* Builds maps from tiles, as image or PMTiles archive, into a file or
+ * memory. Safe for concurrent use: all maps share one thread pool, whose
+ * loops run one after another */
+class MosaicBuilder {
+public:
+	MosaicBuilder(const MapOptions &options);
+	virtual ~MosaicBuilder();
+
+	// Why the decoded tile cache is disabled, OSMPNG_OK if it works or is not requested
+	const Status& decoded_cache_status() const { return slab_state; }
+
+	// Merge the tiles of the area into an image. The buffer variant appends to buffer
+	Status render(const TileStore &tiles, const MapArea &area, const std::string &filename,
+		ImageFormat format = FORMAT_PNG);
+	Status render(const TileStore &tiles, const MapArea &area, std::string *buffer,
+		ImageFormat format = FORMAT_PNG);
+	// Store the tiles of the area and of the lower zoom levels down to min_zoom as they are
+	Status archive(const TileStore &tiles, const MapArea &area, int min_zoom, const std::string &filename);
+	Status archive(const TileStore &tiles, const MapArea &area, int min_zoom, std::string *buffer);
+
+	// Streaming merge of the area into filename, see Merger. first is one of
+	// its tiles. Throws a message on error, the caller deletes the Merger
+	Merger* merger(const MapArea &area, const std::string &first, const std::string &filename,
+		ImageFormat format = FORMAT_PNG);
+
+	// Put a blank tile into tiles for every tile within the bounds of the area, that
+	// it does not cover and that is not in tiles yet, so the area can be rendered
+	// as a rectangle
+	Status fill_uncovered(TileStore &tiles, const MapArea &area);
+	// Encoded tile of the size of like, filled with fill_color. Throws a message on error
+	std::string blank_tile(const std::string &like);
+
+	ThreadPool& thread_pool() { return pool; }
+	// NULL if disabled
+	SlabCache* decoded_cache() { return slab; }
+	// Color to composite transparent pixels onto or NULL
+	const unsigned char* background() const { return options.blend ? options.background : NULL; }
+	// Color of blank tiles: the background or white
+	const unsigned char* fill_color() const;
+
+private:
+	MapOptions options;
+	ThreadPool pool;
+	SlabCache *slab;
+	Status slab_state;
+
+	Status merge(const TileStore &tiles, const MapArea &area, const std::string *filename, std::string *buffer,
+		ImageFormat format);
+	Status write_archive(const TileStore &tiles, const MapArea &area, int min_zoom,
+		const std::string &name, std::string *buffer);
+};
+
+// Output formats of MapService
+enum MapFormat {
+	MAP_PNG,
+	MAP_PMTILES,
+	MAP_PPM,
+	MAP_RAW,
+	MAP_QOI
+};
+
+/* Fetches and renders maps on request, combining a TileProvider and a
+ * MosaicBuilder. Safe for concurrent use. A long living service keeps its
+ * connections and decoded tiles warm between maps */
+class MapService {
+public:
+	MapService(const MapOptions &options);
+	virtual ~MapService() {}
+
+	// OSMPNG_OK or the reason, why the service cannot be used
+	Status status() const;
+
+	/* Fetch the tiles of the area and build the map into buffer (appended) or a
+	 * file. Tiles outside of the coverage of an area are blank in images and
+	 * left out of archives */
+	Status render(const MapArea &area, MapFormat format, std::string *buffer);
+	Status render(const MapArea &area, MapFormat format, const std::string &filename);
+
+	TileProvider& tiles() { return provider; }
+	MosaicBuilder& mosaic() { return builder; }
+
+private:
+	MapOptions options;
+	TileProvider provider;
+	MosaicBuilder builder;
+
+	// Check the area and fetch its tiles into store
+	Status prepare(const MapArea &area, TileStore &store);
+};
+
+#endif
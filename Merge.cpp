@@ -0,0 +1,212 @@
+/* Merge.cpp
+ * Merge tiles into a single PNG map
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+
+#include "Merge.hpp"
+
+using namespace std;
+
+// Most repeated tiles kept decoded during a merge, 192 kiB each for 256x256 tiles
+#define MAX_SHARED_TILES 64
+
+
+// Pixel range [first, first+count) of an axis spanning tiles tiles of size pixels,
+// cropped to the fractional tile coordinates from..to relative to the first tile
+static void crop_axis(double from, double to, size_t tiles, size_t size, size_t &first, size_t &count) {
+	const double total = (double)(tiles * size);
+	const double begin = max(0.0, min(total, floor(from * size)));
+	const double end = max(0.0, min(total, ceil(to * size)));
+	if(end - begin < 1.0) {
+		first = 0;
+		count = tiles * size;
+	} else {
+		first = (size_t)begin;
+		count = (size_t)(end - begin);
+	}
+}
+
+/* The mosaic is assembled one tile row (strip) at a time and each strip is
+ * handed to the image writer before the next one is built. Peak memory is
+ * thus total_width * tile_height * 3 bytes, independent of the height.
+ * The tiles of a strip are decoded in parallel from memory, each worker
+ * writing the rows of its tile directly into a disjoint region of the strip.
+ * Edge tiles are cropped while they are copied, pixels outside of the image
+ * are never converted. Tiles that appear several times (open sea, empty
+ * land) are decoded once and copied to all of their positions */
+Merger::Merger(const int *bounds, int zoom, const string &first, const string &destination,
+		const PngOptions &options, const unsigned char *background, ThreadPool &pool, Metrics *metrics,
+		const double *crop, SlabCache *slab, ImageFormat format) : pool(pool) {
+	begin(bounds, zoom, first, background, metrics, crop, slab);
+	writer = open_image(format, destination, total_width, total_height, options, &pool);
+}
+
+Merger::Merger(const int *bounds, int zoom, const string &first, string *buffer,
+		const PngOptions &options, const unsigned char *background, ThreadPool &pool, Metrics *metrics,
+		const double *crop, SlabCache *slab, ImageFormat format) : pool(pool) {
+	begin(bounds, zoom, first, background, metrics, crop, slab);
+	writer = open_image(format, buffer, total_width, total_height, options, &pool);
+}
+
+void Merger::begin(const int *bounds, int zoom, const string &first, const unsigned char *background,
+		Metrics *metrics, const double *crop, SlabCache *slab) {
+	for(int i = 0; i < 4; i++) this->bounds[i] = bounds[i];
+	this->zoom = zoom;
+	this->background = background;
+	this->metrics = metrics;
+	this->slab = slab;
+	this->next_row = 0;
+	this->reused = 0;
+	if(!png_dimensions(first, width, height)) throw "Invalid tile";
+	column_count = bounds[1]-bounds[0]+1;
+	row_count = bounds[3]-bounds[2]+1;
+
+	left = 0;
+	top = 0;
+	total_width = width * column_count;
+	total_height = height * row_count;
+	if(crop != NULL) {
+		crop_axis(crop[0] - bounds[0], crop[1] - bounds[0], column_count, width, left, total_width);
+		crop_axis(crop[2] - bounds[2], crop[3] - bounds[2], row_count, height, top, total_height);
+	}
+	counted.resize(row_count, false);
+	strip.resize(total_width * 3 * height);
+}
+
+Merger::~Merger() {
+	delete writer;
+}
+
+void Merger::row_range(size_t row, size_t &first, size_t &last) const {
+	first = max(top, row * height);
+	last = min(top + total_height, (row + 1) * height);
+	if(last < first) last = first;
+}
+
+void Merger::column_range(size_t column, size_t &from, size_t &to) const {
+	from = max(left, column * width);
+	to = min(left + total_width, (column + 1) * width);
+	if(to < from) to = from;
+}
+
+void Merger::count(size_t row, const TileRow &tiles) {
+	if(row >= row_count || counted[row]) return;
+	counted[row] = true;
+	size_t first, last, from, to;
+	row_range(row, first, last);
+	if(last == first) return;
+	for(size_t column = 0; column < column_count && column < tiles.size(); column++) {
+		column_range(column, from, to);
+		if(to > from && tiles[column] != NULL) occurrences[tiles[column]]++;
+	}
+}
+
+void Merger::write(const TileRow &tiles) {
+	if(next_row >= row_count) throw "Too many tile rows";
+	if(tiles.size() != column_count) throw "Tile row does not match the mosaic";
+	const size_t row = next_row++;
+	count(row, tiles);
+	// Rows of this tile row within the image
+	size_t first, last;
+	row_range(row, first, last);
+	if(last == first) return;
+	const size_t stride = total_width * 3;
+	const int y = bounds[2] + (int)row;
+
+	// Repeated tiles seen for the first time are decoded up front
+	vector< pair<const string*, size_t> > fresh;
+	for(size_t column = 0; column < column_count; column++) {
+		size_t from, to;
+		column_range(column, from, to);
+		if(to == from) continue;
+		const string *data = tiles[column];
+		if(data == NULL) throw "Missing tile";
+		if(shared.count(data) > 0) {
+			reused++;
+		} else if(occurrences[data] > 1 && shared.size() < MAX_SHARED_TILES) {
+			shared[data] = decoded.size();
+			fresh.push_back(make_pair(data, decoded.size()));
+			decoded.push_back(vector<unsigned char>(width * height * 3));
+		}
+	}
+	if(!fresh.empty()) {
+		Span span(metrics, "merge_shared_decode_seconds");
+		pool.parallel_for(fresh.size(), [&](size_t i) {
+			const string *data = fresh[i].first;
+			decode_png((const unsigned char*)data->data(), data->size(), &decoded[fresh[i].second][0],
+				width * 3, width, height, background);
+		});
+	}
+
+	{
+		Span span(metrics, "merge_strip_decode_seconds");
+		pool.parallel_for(column_count, [&](size_t column) {
+			// Columns of this tile within the image
+			size_t from, to;
+			column_range(column, from, to);
+			if(to == from) return;
+			Span span(metrics, "merge_tile_decode_seconds");
+			const string *data = tiles[column];
+			unsigned char *dest = &strip[(from - left) * 3];
+			const size_t x0 = from - column * width, y0 = first - row * height;
+			map<const string*, size_t>::const_iterator it = shared.find(data);
+			if(it != shared.end()) {
+				const unsigned char *pixels = &decoded[it->second][0];
+				for(size_t j = 0; j < last - first; j++)
+					memcpy(dest + j * stride, pixels + ((y0 + j) * width + x0) * 3, (to - from) * 3);
+			} else if(slab != NULL) {
+				slab->read_region(TileKey(bounds[0] + (int)column, y, zoom), *data, background, dest, stride,
+					x0, y0, to - from, last - first);
+			} else {
+				decode_png_region((const unsigned char*)data->data(), data->size(), dest, stride,
+					width, height, x0, y0, to - from, last - first, background);
+			}
+		});
+	}
+	Span span(metrics, "merge_strip_encode_seconds");
+	writer->write_rows(&strip[0], last - first);
+}
+
+void Merger::finish() {
+	Span span(metrics, "merge_finish_seconds");
+	writer->finish();
+	if(metrics != NULL && reused > 0) metrics->add("merge_tiles_shared_total", reused);
+}
+
+// Merge all tiles of the store, repeated tiles are counted before the first row
+static void merge_rows(const TileStore &tiles, const int *bounds, int zoom, Merger &merger) {
+	vector<TileRow> rows(merger.rows(), TileRow(merger.columns()));
+	for(size_t row = 0; row < merger.rows(); row++) {
+		for(size_t column = 0; column < merger.columns(); column++)
+			rows[row][column] = tiles.get(TileKey(bounds[0] + (int)column, bounds[2] + (int)row, zoom));
+		merger.count(row, rows[row]);
+	}
+	for(size_t row = 0; row < merger.rows(); row++)
+		merger.write(rows[row]);
+	merger.finish();
+}
+
+void merge_tiles(const TileStore &tiles, const int *bounds, int zoom, const string &destination,
+		const PngOptions &options, const unsigned char *background, ThreadPool &pool, Metrics *metrics,
+		const double *crop, SlabCache *slab, ImageFormat format) {
+	const string *data = tiles.get(TileKey(bounds[0],bounds[2], zoom));
+	if(data == NULL) throw "Missing tile";
+	Merger merger(bounds, zoom, *data, destination, options, background, pool, metrics, crop, slab, format);
+	merge_rows(tiles, bounds, zoom, merger);
+}
+
+void merge_tiles(const TileStore &tiles, const int *bounds, int zoom, string *buffer,
+		const PngOptions &options, const unsigned char *background, ThreadPool &pool, Metrics *metrics,
+		const double *crop, SlabCache *slab, ImageFormat format) {
+	const string *data = tiles.get(TileKey(bounds[0],bounds[2], zoom));
+	if(data == NULL) throw "Missing tile";
+	Merger merger(bounds, zoom, *data, buffer, options, background, pool, metrics, crop, slab, format);
+	merge_rows(tiles, bounds, zoom, merger);
+}
@@ -0,0 +1,101 @@
+/* Merge.hpp
+ * Merge tiles into a single PNG map
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#ifndef _OSMPNG_MERGE_HPP_
+#define _OSMPNG_MERGE_HPP_
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include "TileStore.hpp"
+#include "ThreadPool.hpp"
+#include "Png.hpp"
+#include "Image.hpp"
+#include "Metrics.hpp"
+#include "SlabCache.hpp"
+
+
+/* Merge the tiles bounds[0]..bounds[1] x bounds[2]..bounds[3] of the given
+ * zoom level into an image of format, a PNG file by default. If crop is not NULL, the image is cropped to
+ * the fractional tile coordinates crop[0]..crop[1] x crop[2]..crop[3], so
+ * that it covers exactly the requested area. An axis of less than a pixel
+ * is not cropped. Transparent pixels are composited onto background, if not
+ * NULL. The time spent decoding and encoding is observed in metrics, if not
+ * NULL. Decoded tiles are taken from and added to slab, if not NULL.
+ * Throws a message on error */
+void merge_tiles(const TileStore &tiles, const int *bounds, int zoom, const std::string &destination,
+	const PngOptions &options, const unsigned char *background, ThreadPool &pool, Metrics *metrics = NULL,
+	const double *crop = NULL, SlabCache *slab = NULL, ImageFormat format = FORMAT_PNG);
+// Merge into memory, the image is appended to buffer
+void merge_tiles(const TileStore &tiles, const int *bounds, int zoom, std::string *buffer,
+	const PngOptions &options, const unsigned char *background, ThreadPool &pool, Metrics *metrics = NULL,
+	const double *crop = NULL, SlabCache *slab = NULL, ImageFormat format = FORMAT_PNG);
+
+// The tiles of a row, one per column from left to right
+typedef std::vector<const std::string*> TileRow;
+
+/* Streaming form of merge_tiles, for tiles that arrive over time. The tile
+ * rows are handed over from top to bottom and every row is decoded, placed
+ * and encoded right away. Throws a message on error */
+class Merger {
+public:
+	// first is a tile of the mosaic, it defines the tile size
+	Merger(const int *bounds, int zoom, const std::string &first, const std::string &destination,
+		const PngOptions &options, const unsigned char *background, ThreadPool &pool,
+		Metrics *metrics = NULL, const double *crop = NULL, SlabCache *slab = NULL,
+		ImageFormat format = FORMAT_PNG);
+	// Encode into memory, the image is appended to buffer
+	Merger(const int *bounds, int zoom, const std::string &first, std::string *buffer,
+		const PngOptions &options, const unsigned char *background, ThreadPool &pool,
+		Metrics *metrics = NULL, const double *crop = NULL, SlabCache *slab = NULL,
+		ImageFormat format = FORMAT_PNG);
+	virtual ~Merger();
+
+	// Count the tiles of a row in advance, so that tiles repeated in later rows
+	// are decoded only once. Optional, rows are counted when written otherwise
+	void count(size_t row, const TileRow &tiles);
+	// Decode, place and encode the next row
+	void write(const TileRow &tiles);
+	// Finish the image after the last row
+	void finish();
+
+	size_t rows() const { return row_count; }
+	size_t columns() const { return column_count; }
+
+private:
+	int bounds[4];
+	int zoom;
+	size_t width, height;
+	size_t column_count, row_count;
+	// Image area in pixels, relative to the top left tile
+	size_t left, top, total_width, total_height;
+	const unsigned char *background;
+	ThreadPool &pool;
+	Metrics *metrics;
+	SlabCache *slab;
+	ImageWriter *writer;
+	std::vector<unsigned char> strip;
+	size_t next_row;
+
+	// Positions of every distinct tile within the image. The store keeps
+	// identical tiles once, so duplicates share the same address
+	std::vector<bool> counted;
+	std::map<const std::string*, size_t> occurrences;
+	// Repeated tiles, decoded once
+	std::map<const std::string*, size_t> shared;
+	std::vector< std::vector<unsigned char> > decoded;
+	size_t reused;
+
+	// Image size and crop, the writer is created by the constructors
+	void begin(const int *bounds, int zoom, const std::string &first, const unsigned char *background,
+		Metrics *metrics, const double *crop, SlabCache *slab);
+	// Pixel range of a tile row or column within the image, empty if outside
+	void row_range(size_t row, size_t &first, size_t &last) const;
+	void column_range(size_t column, size_t &from, size_t &to) const;
+};
+
+#endif
@@ -0,0 +1,123 @@
+/* Metrics.cpp
+ * Timing and transfer metrics of a run, exported as JSON or Prometheus text
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#include <fstream>
+#include <sstream>
+#include <limits>
+
+#include "Metrics.hpp"
+
+using namespace std;
+
+
+// Prefix of all exported Prometheus metric names
+static const char *PREFIX = "osmpng_";
+
+Histogram::Histogram() : counts(bounds().size() + 1, 0), count(0), sum(0.0),
+	min(numeric_limits<double>::infinity()), max(-numeric_limits<double>::infinity()) {}
+
+const vector<double>& Histogram::bounds() {
+	// 100 us up to about 100 s, doubling
+	static vector<double> bounds;
+	static once_flag once;
+	call_once(once, []() {
+		for(double b = 0.0001; b < 120.0; b *= 2.0) bounds.push_back(b);
+	});
+	return bounds;
+}
+
+void Histogram::observe(double value) {
+	const vector<double> &upper = bounds();
+	size_t i = 0;
+	while(i < upper.size() && value > upper[i]) i++;
+	counts[i]++;
+	count++;
+	sum += value;
+	if(value < min) min = value;
+	if(value > max) max = value;
+}
+
+void Metrics::observe(const string &name, double value) {
+	lock_guard<std::mutex> lock(mtx);
+	histograms[name].observe(value);
+}
+
+void Metrics::add(const string &name, double value) {
+	lock_guard<std::mutex> lock(mtx);
+	counters[name] += value;
+}
+
+static void write_file(const string &filename, const string &contents) {
+	ofstream out(filename.c_str());
+	if(!out.is_open()) throw "Cannot open " + filename + " for writing";
+	out << contents;
+	out.close();
+	if(out.fail()) throw "Error writing " + filename;
+}
+
+void Metrics::write_json(const string &filename) const {
+	lock_guard<std::mutex> lock(mtx);
+	const vector<double> &upper = Histogram::bounds();
+	stringstream ss;
+	ss.precision(9);
+	ss << "{\n  \"counters\": {";
+	for(map<string, double>::const_iterator it = counters.begin(); it != counters.end(); it++)
+		ss << (it == counters.begin() ? "\n" : ",\n") << "    \"" << it->first << "\": " << it->second;
+	ss << "\n  },\n  \"histograms\": {";
+	for(map<string, Histogram>::const_iterator it = histograms.begin(); it != histograms.end(); it++) {
+		const Histogram &h = it->second;
+		ss << (it == histograms.begin() ? "\n" : ",\n") << "    \"" << it->first << "\": {"
+			<< "\"count\": " << h.count << ", \"sum\": " << h.sum
+			<< ", \"min\": " << h.min << ", \"max\": " << h.max
+			<< ", \"mean\": " << h.sum / h.count << ", \"buckets\": [";
+		// Only non-empty buckets, with their upper bound (null for +Inf)
+		bool first = true;
+		for(size_t i = 0; i < h.counts.size(); i++) {
+			if(h.counts[i] == 0) continue;
+			ss << (first ? "" : ", ") << "{\"le\": ";
+			if(i < upper.size()) ss << upper[i];
+			else ss << "null";
+			ss << ", \"count\": " << h.counts[i] << "}";
+			first = false;
+		}
+		ss << "]}";
+	}
+	ss << "\n  }\n}\n";
+	write_file(filename, ss.str());
+}
+
+void Metrics::write_prometheus(const string &filename) const {
+	lock_guard<std::mutex> lock(mtx);
+	const vector<double> &upper = Histogram::bounds();
+	stringstream ss;
+	ss.precision(9);
+	for(map<string, double>::const_iterator it = counters.begin(); it != counters.end(); it++) {
+		ss << "# TYPE " << PREFIX << it->first << " counter\n";
+		ss << PREFIX << it->first << ' ' << it->second << '\n';
+	}
+	for(map<string, Histogram>::const_iterator it = histograms.begin(); it != histograms.end(); it++) {
+		const Histogram &h = it->second;
+		const string name = PREFIX + it->first;
+		ss << "# TYPE " << name << " histogram\n";
+		size_t cumulative = 0;
+		for(size_t i = 0; i < upper.size(); i++) {
+			cumulative += h.counts[i];
+			ss << name << "_bucket{le=\"" << upper[i] << "\"} " << cumulative << '\n';
+		}
+		ss << name << "_bucket{le=\"+Inf\"} " << h.count << '\n';
+		ss << name << "_sum " << h.sum << '\n';
+		ss << name << "_count " << h.count << '\n';
+	}
+	write_file(filename, ss.str());
+}
+
+void Metrics::write(const string &filename) const {
+	const string suffix = ".prom";
+	if(filename.size() >= suffix.size() && filename.compare(filename.size() - suffix.size(), suffix.size(), suffix) == 0)
+		write_prometheus(filename);
+	else
+		write_json(filename);
+}
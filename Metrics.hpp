@@ -0,0 +1,68 @@
+/* Metrics.hpp
+ * Timing and transfer metrics of a run, exported as JSON or Prometheus text
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#ifndef _OSMPNG_METRICS_HPP_
+#define _OSMPNG_METRICS_HPP_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <chrono>
+
+
+// Distribution of observed values in fixed, exponentially growing buckets
+struct Histogram {
+	std::vector<size_t> counts;		// Per bucket, not cumulative
+	size_t count;
+	double sum, min, max;
+
+	Histogram();
+	void observe(double value);
+	// Upper bounds of the buckets. The last bucket is unbounded
+	static const std::vector<double>& bounds();
+};
+
+/* Collects counters and histograms by name. All methods are thread safe.
+ * Names follow the Prometheus conventions, e.g. fetch_ttfb_seconds */
+class Metrics {
+public:
+	void observe(const std::string &name, double value);
+	void add(const std::string &name, double value = 1.0);
+
+	// Write all metrics to a file. Throws a string on error
+	void write_json(const std::string &filename) const;
+	void write_prometheus(const std::string &filename) const;
+	// Prometheus text format for files ending in .prom, JSON otherwise
+	void write(const std::string &filename) const;
+
+private:
+	mutable std::mutex mtx;
+	std::map<std::string, Histogram> histograms;
+	std::map<std::string, double> counters;
+};
+
+/* Measures the time from its construction to its destruction (or stop())
+ * on the monotonic clock and observes it in seconds. Does nothing without metrics */
+class Span {
+public:
+	Span(Metrics *metrics, const char *name) : metrics(metrics), name(name), start(clock::now()) {}
+	~Span() { stop(); }
+	// End the span early
+	void stop() {
+		if(metrics != NULL)
+			metrics->observe(name, std::chrono::duration<double>(clock::now() - start).count());
+		metrics = NULL;
+	}
+
+private:
+	typedef std::chrono::steady_clock clock;
+	Metrics *metrics;
+	const char *name;
+	clock::time_point start;
+};
+
+#endif
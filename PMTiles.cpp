@@ -0,0 +1,255 @@
+/* PMTiles.cpp
+ * Writer for PMTiles (version 3) tile archives
+ *
+ * See https://github.com/protomaps/PMTiles/blob/main/spec/v3/spec.md
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#include <algorithm>
+#include <map>
+#include <sstream>
+#include <stdio.h>
+#include <math.h>
+
+#include "PMTiles.hpp"
+
+using namespace std;
+
+
+// Size of the fixed header
+static const size_t HEADER_SIZE = 127;
+// Header and root directory must fit into the first 16 KiB
+static const size_t ROOT_LIMIT = 16384;
+
+// Directory entry
+struct Entry {
+	uint64_t tile_id;
+	uint64_t offset;
+	uint32_t length;
+	uint32_t run_length;	// 0 for pointers to leaf directories
+};
+
+uint64_t pmtiles_tile_id(int zoom, int x, int y) {
+	// Number of tiles on all lower zoom levels: (4^zoom - 1) / 3
+	uint64_t acc = (((uint64_t)1 << (2 * zoom)) - 1) / 3;
+	const uint64_t n = (uint64_t)1 << zoom;
+	uint64_t tx = (uint64_t)x, ty = (uint64_t)y;
+	uint64_t d = 0;
+	for(uint64_t s = n / 2; s > 0; s /= 2) {
+		const uint64_t rx = (tx & s) > 0 ? 1 : 0;
+		const uint64_t ry = (ty & s) > 0 ? 1 : 0;
+		d += s * s * ((3 * rx) ^ ry);
+		// Rotate the quadrant
+		if(ry == 0) {
+			if(rx == 1) {
+				tx = n - 1 - tx;
+				ty = n - 1 - ty;
+			}
+			swap(tx, ty);
+		}
+	}
+	return acc + d;
+}
+
+static void put_varint(string &out, uint64_t value) {
+	while(value >= 0x80) {
+		out += (char)((value & 0x7f) | 0x80);
+		value >>= 7;
+	}
+	out += (char)value;
+}
+
+static void put_uint64(string &out, uint64_t value) {
+	for(int i = 0; i < 8; i++) out += (char)((value >> (8 * i)) & 0xff);
+}
+
+static void put_int32(string &out, int32_t value) {
+	uint32_t v = (uint32_t)value;
+	for(int i = 0; i < 4; i++) out += (char)((v >> (8 * i)) & 0xff);
+}
+
+// Serialize directory entries (without internal compression)
+static string serialize_directory(const vector<Entry> &entries, size_t first, size_t last) {
+	string out;
+	put_varint(out, last - first);
+	uint64_t previous = 0;
+	for(size_t i = first; i < last; i++) {
+		put_varint(out, entries[i].tile_id - previous);
+		previous = entries[i].tile_id;
+	}
+	for(size_t i = first; i < last; i++) put_varint(out, entries[i].run_length);
+	for(size_t i = first; i < last; i++) put_varint(out, entries[i].length);
+	for(size_t i = first; i < last; i++) {
+		// 0 means: directly after the previous entry
+		if(i > first && entries[i].offset == entries[i-1].offset + entries[i-1].length)
+			put_varint(out, 0);
+		else
+			put_varint(out, entries[i].offset + 1);
+	}
+	return out;
+}
+
+// Build root and leaf directories, so that the root fits into the first 16 KiB
+static void build_directories(const vector<Entry> &entries, string &root, string &leaves) {
+	root = serialize_directory(entries, 0, entries.size());
+	leaves.clear();
+	if(HEADER_SIZE + root.size() <= ROOT_LIMIT) return;
+
+	for(size_t leaf_size = 4096; ; leaf_size *= 2) {
+		vector<Entry> pointers;
+		leaves.clear();
+		for(size_t first = 0; first < entries.size(); first += leaf_size) {
+			size_t last = min(first + leaf_size, entries.size());
+			string leaf = serialize_directory(entries, first, last);
+			Entry pointer;
+			pointer.tile_id = entries[first].tile_id;
+			pointer.offset = leaves.size();
+			pointer.length = (uint32_t)leaf.size();
+			pointer.run_length = 0;
+			pointers.push_back(pointer);
+			leaves += leaf;
+		}
+		root = serialize_directory(pointers, 0, pointers.size());
+		if(HEADER_SIZE + root.size() <= ROOT_LIMIT) return;
+	}
+}
+
+static bool tile_id_less(const pair<uint64_t, const string*> &a, const pair<uint64_t, const string*> &b) {
+	return a.first < b.first;
+}
+
+static int32_t e7(double degree) {
+	return (int32_t)lround(degree * 1e7);
+}
+
+// Escape a string for JSON
+static string json_string(const string &str) {
+	stringstream ss;
+	ss << '"';
+	for(size_t i = 0; i < str.size(); i++) {
+		const char c = str[i];
+		if(c == '"' || c == '\\') ss << '\\' << c;
+		else if((unsigned char)c < 0x20) ss << ' ';
+		else ss << c;
+	}
+	ss << '"';
+	return ss.str();
+}
+
+/* Lay out an archive: head holds header, root directory, metadata and leaf
+ * directories, followed by the distinct tile contents in this order */
+static void build_archive(vector<ArchiveTile> &tiles, const ArchiveInfo &info, string &head,
+		vector<const string*> &contents) {
+	if(tiles.empty()) throw "No tiles to archive";
+
+	// Cluster tiles by tile id
+	vector< pair<uint64_t, const string*> > sorted;
+	int min_zoom = tiles[0].first.zoom, max_zoom = min_zoom;
+	for(size_t i = 0; i < tiles.size(); i++) {
+		const TileKey &key = tiles[i].first;
+		sorted.push_back(make_pair(pmtiles_tile_id(key.zoom, key.x, key.y), tiles[i].second));
+		min_zoom = min(min_zoom, key.zoom);
+		max_zoom = max(max_zoom, key.zoom);
+	}
+	sort(sorted.begin(), sorted.end(), tile_id_less);
+
+	// Assign data offsets. Repeated contents are stored once and consecutive
+	// tiles with the same contents become a single run
+	vector<Entry> entries;
+	map<string, uint64_t> offsets;
+	uint64_t data_length = 0;
+	for(size_t i = 0; i < sorted.size(); i++) {
+		const string &data = *sorted[i].second;
+		if(!entries.empty() && entries.back().tile_id + entries.back().run_length == sorted[i].first &&
+				*sorted[i-1].second == data) {
+			entries.back().run_length++;
+			continue;
+		}
+		Entry entry;
+		entry.tile_id = sorted[i].first;
+		entry.length = (uint32_t)data.size();
+		entry.run_length = 1;
+		map<string, uint64_t>::iterator it = offsets.find(data);
+		if(it != offsets.end()) {
+			entry.offset = it->second;
+		} else {
+			entry.offset = data_length;
+			offsets[data] = data_length;
+			contents.push_back(&data);
+			data_length += data.size();
+		}
+		entries.push_back(entry);
+	}
+
+	string root, leaves;
+	build_directories(entries, root, leaves);
+
+	stringstream meta;
+	meta.precision(10);
+	meta << "{\"name\":" << json_string(info.name)
+		<< ",\"format\":\"png\""
+		<< ",\"type\":\"baselayer\""
+		<< ",\"attribution\":" << json_string(info.attribution)
+		<< ",\"minzoom\":" << min_zoom << ",\"maxzoom\":" << max_zoom
+		<< ",\"bounds\":[" << info.min_lon << ',' << info.min_lat << ',' << info.max_lon << ',' << info.max_lat << "]}";
+	string metadata = meta.str();
+
+	// Layout: header, root directory, metadata, leaf directories, tile data
+	const uint64_t root_offset = HEADER_SIZE;
+	const uint64_t meta_offset = root_offset + root.size();
+	const uint64_t leaves_offset = meta_offset + metadata.size();
+	const uint64_t data_offset = leaves_offset + leaves.size();
+
+	string header = "PMTiles";
+	header += (char)3;
+	put_uint64(header, root_offset);
+	put_uint64(header, root.size());
+	put_uint64(header, meta_offset);
+	put_uint64(header, metadata.size());
+	put_uint64(header, leaves_offset);
+	put_uint64(header, leaves.size());
+	put_uint64(header, data_offset);
+	put_uint64(header, data_length);
+	put_uint64(header, sorted.size());		// Addressed tiles
+	put_uint64(header, entries.size());	// Tile entries
+	put_uint64(header, contents.size());	// Tile contents
+	header += (char)1;		// Clustered
+	header += (char)1;		// Internal compression: none
+	header += (char)1;		// Tile compression: none
+	header += (char)2;		// Tile type: png
+	header += (char)min_zoom;
+	header += (char)max_zoom;
+	put_int32(header, e7(info.min_lon));
+	put_int32(header, e7(info.min_lat));
+	put_int32(header, e7(info.max_lon));
+	put_int32(header, e7(info.max_lat));
+	header += (char)((min_zoom + max_zoom) / 2);
+	put_int32(header, e7((info.min_lon + info.max_lon) / 2.0));
+	put_int32(header, e7((info.min_lat + info.max_lat) / 2.0));
+
+	head = header + root + metadata + leaves;
+}
+
+void write_pmtiles(const string &filename, vector<ArchiveTile> tiles, const ArchiveInfo &info) {
+	string head;
+	vector<const string*> contents;
+	build_archive(tiles, info, head, contents);
+
+	FILE *fp = fopen(filename.c_str(), "wb");
+	if(fp == NULL) throw "Cannot open " + filename + " for writing";
+	bool ok = fwrite(head.data(), 1, head.size(), fp) == head.size();
+	for(size_t i = 0; ok && i < contents.size(); i++)
+		ok = fwrite(contents[i]->data(), 1, contents[i]->size(), fp) == contents[i]->size();
+	if(fclose(fp) != 0) ok = false;
+	if(!ok) throw "Error writing " + filename;
+}
+
+void write_pmtiles(string *buffer, vector<ArchiveTile> tiles, const ArchiveInfo &info) {
+	string head;
+	vector<const string*> contents;
+	build_archive(tiles, info, head, contents);
+	*buffer += head;
+	for(size_t i = 0; i < contents.size(); i++)
+		*buffer += *contents[i];
+}
@@ -0,0 +1,40 @@
+/* PMTiles.hpp
+ * Writer for PMTiles (version 3) tile archives
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#ifndef _OSMPNG_PMTILES_HPP_
+#define _OSMPNG_PMTILES_HPP_
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "TileStore.hpp"
+
+
+// Descriptive data of an archive
+struct ArchiveInfo {
+	std::string name;
+	std::string attribution;
+	double min_lon, min_lat, max_lon, max_lat;
+
+	ArchiveInfo() : min_lon(-180.0), min_lat(-85.0511), max_lon(180.0), max_lat(85.0511) {}
+};
+
+// A tile to be archived. The data is referenced, not copied
+typedef std::pair<TileKey, const std::string*> ArchiveTile;
+
+// PMTiles tile id: Position of the tile on the Hilbert curve of its zoom level,
+// offset by the number of tiles of all lower zoom levels
+uint64_t pmtiles_tile_id(int zoom, int x, int y);
+
+/* Write PNG tiles to a single file PMTiles archive. The tiles are stored
+ * as they are, clustered in tile id order. Identical tiles are stored once.
+ * Throws a string on error */
+void write_pmtiles(const std::string &filename, std::vector<ArchiveTile> tiles, const ArchiveInfo &info);
+// Write the archive into memory, it is appended to buffer
+void write_pmtiles(std::string *buffer, std::vector<ArchiveTile> tiles, const ArchiveInfo &info);
+
+#endif
@@ -0,0 +1,433 @@
+/* Png.cpp
+ * Thin wrappers around libpng for row based PNG I/O
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+
+#include <png.h>
+#include <zlib.h>
+
+#include "Png.hpp"
+#include "Convert.hpp"
+
+using namespace std;
+
+
+// libpng error callback. Errors are forwarded as exception
+static void png_error_fn(png_structp, png_const_charp msg) {
+	throw string("png error: ") + msg;
+}
+
+static void png_warning_fn(png_structp, png_const_charp) {}
+
+// Memory source for the libpng reader
+struct MemorySource {
+	const unsigned char *data;
+	size_t len;
+	size_t pos;
+};
+
+static void png_read_memory(png_structp png, png_bytep out, png_size_t count) {
+	MemorySource *source = (MemorySource*)png_get_io_ptr(png);
+	if(source->pos + count > source->len) png_error(png, "Unexpected end of data");
+	memcpy(out, source->data + source->pos, count);
+	source->pos += count;
+}
+
+bool png_dimensions(const unsigned char *data, size_t len, size_t &width, size_t &height) {
+	// Signature followed by the IHDR chunk
+	if(len < 24 || png_sig_cmp((png_const_bytep)data, 0, 8) != 0) return false;
+	if(memcmp(data + 12, "IHDR", 4) != 0) return false;
+	width = png_get_uint_32((png_const_bytep)(data + 16));
+	height = png_get_uint_32((png_const_bytep)(data + 20));
+	return true;
+}
+
+// Read palette and transparency of an image into 256 RGBA entries
+static void read_palette(png_structp png, png_infop info, uint32_t *entries) {
+	png_colorp colors = NULL;
+	int num_colors = 0;
+	png_bytep trans = NULL;
+	int num_trans = 0;
+	png_get_PLTE(png, info, &colors, &num_colors);
+	if(png_get_valid(png, info, PNG_INFO_tRNS))
+		png_get_tRNS(png, info, &trans, &num_trans, NULL);
+
+	unsigned char *entry = (unsigned char*)entries;
+	for(int i = 0; i < 256; i++, entry += 4) {
+		if(i < num_colors) {
+			entry[0] = colors[i].red;
+			entry[1] = colors[i].green;
+			entry[2] = colors[i].blue;
+		} else
+			entry[0] = entry[1] = entry[2] = 0;
+		entry[3] = i < num_trans ? trans[i] : 255;
+	}
+}
+
+void decode_png_region(const unsigned char *data, size_t len, unsigned char *dest, size_t stride,
+		size_t width, size_t height, size_t left, size_t top, size_t columns, size_t count,
+		const unsigned char *background) {
+	if(len < 8 || png_sig_cmp((png_const_bytep)data, 0, 8) != 0) throw "Not a png image";
+	if(left + columns > width || top + count > height) throw "Region exceeds the tile";
+
+	png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, png_error_fn, png_warning_fn);
+	png_infop info = NULL;
+	if(png != NULL) info = png_create_info_struct(png);
+	if(png == NULL || info == NULL) {
+		png_destroy_read_struct(&png, &info, NULL);
+		throw "Error setting up libpng";
+	}
+
+	MemorySource source;
+	source.data = data;
+	source.len = len;
+	source.pos = 0;
+	try {
+		png_set_read_fn(png, &source, png_read_memory);
+		png_read_info(png, info);
+		if(png_get_image_width(png, info) != width) throw "Width of tile mismatch";
+		if(png_get_image_height(png, info) != height) throw "Height of tile mismatch";
+
+		/* Let libpng reduce everything to 8-bit RGB, RGBA or palette indices.
+		 * Palette lookup and alpha removal are done by the conversion kernels
+		 * while copying to the destination */
+		png_byte color_type = png_get_color_type(png, info);
+		png_byte bit_depth = png_get_bit_depth(png, info);
+		const bool palette = color_type == PNG_COLOR_TYPE_PALETTE;
+		const bool alpha = !palette &&
+			((color_type & PNG_COLOR_MASK_ALPHA) || png_get_valid(png, info, PNG_INFO_tRNS));
+		const bool interlaced = png_get_interlace_type(png, info) != PNG_INTERLACE_NONE;
+		if(bit_depth == 16) png_set_strip_16(png);
+		if(palette) {
+			if(bit_depth < 8) png_set_packing(png);
+		} else {
+			if(color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8) png_set_expand_gray_1_2_4_to_8(png);
+			if(color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA) png_set_gray_to_rgb(png);
+			if(png_get_valid(png, info, PNG_INFO_tRNS)) png_set_tRNS_to_alpha(png);
+		}
+		png_set_interlace_handling(png);
+		png_read_update_info(png, info);
+		const size_t channels = palette ? 1 : (alpha ? 4 : 3);
+		const size_t rowbytes = width * channels;
+		if(png_get_rowbytes(png, info) != rowbytes) png_error(png, "Unsupported pixel format");
+
+		uint32_t entries[256];
+		if(palette) {
+			read_palette(png, info, entries);
+			if(background != NULL) blend_palette(entries, background);
+		}
+		const ConvertKernels &kernels = convert_kernels();
+		// Copy the region of a decoded row to its destination
+		auto emit = [&](const unsigned char *row, unsigned char *out) {
+			if(palette)
+				kernels.palette_to_rgb(row + left, entries, out, columns);
+			else if(channels == 3) {
+				if(row + left * 3 != out) memcpy(out, row + left * 3, columns * 3);
+			} else if(background != NULL)
+				kernels.rgba_blend_rgb(row + left * 4, background, out, columns);
+			else
+				kernels.rgba_to_rgb(row + left * 4, out, columns);
+		};
+
+		static thread_local vector<unsigned char> buffer;
+		if(interlaced) {
+			// All passes are needed for any row, decode the whole image
+			buffer.resize(rowbytes * height);
+			vector<png_bytep> rows(height);
+			for(size_t y = 0; y < height; y++)
+				rows[y] = &buffer[y * rowbytes];
+			png_read_image(png, &rows[0]);
+			for(size_t y = 0; y < count; y++)
+				emit(rows[top + y], dest + y * stride);
+		} else {
+			/* Rows are decoded one by one and the rows after the region are
+			 * not inflated at all. Full width RGB rows are written by libpng
+			 * directly to their destination */
+			const bool direct = channels == 3 && left == 0 && columns == width;
+			buffer.resize(rowbytes);
+			for(size_t y = 0; y < top + count; y++) {
+				unsigned char *out = y >= top ? dest + (y - top) * stride : NULL;
+				png_bytep row = (direct && out != NULL) ? out : &buffer[0];
+				png_read_row(png, row, NULL);
+				if(out != NULL) emit(row, out);
+			}
+			if(top + count == height) png_read_end(png, NULL);
+		}
+	} catch (...) {
+		png_destroy_read_struct(&png, &info, NULL);
+		throw;
+	}
+	png_destroy_read_struct(&png, &info, NULL);
+}
+
+void decode_png(const unsigned char *data, size_t len, unsigned char *dest, size_t stride, size_t width, size_t height, const unsigned char *background) {
+	decode_png_region(data, len, dest, stride, width, height, 0, 0, width, height, background);
+}
+
+void decode_png(const unsigned char *data, size_t len, vector<unsigned char> &rgb, size_t &width, size_t &height, const unsigned char *background) {
+	if(!png_dimensions(data, len, width, height)) throw "Not a png image";
+	rgb.resize(width * height * 3);
+	decode_png(data, len, &rgb[0], width * 3, width, height, background);
+}
+
+
+bool parse_png_filter(const string &name, PngFilter &filter) {
+	if(name == "none") filter = FILTER_NONE;
+	else if(name == "sub") filter = FILTER_SUB;
+	else if(name == "up") filter = FILTER_UP;
+	else if(name == "average") filter = FILTER_AVERAGE;
+	else if(name == "paeth") filter = FILTER_PAETH;
+	else if(name == "adaptive") filter = FILTER_ADAPTIVE;
+	else return false;
+	return true;
+}
+
+static inline unsigned char paeth(int a, int b, int c) {
+	int p = a + b - c;
+	int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	if(pa <= pb && pa <= pc) return (unsigned char)a;
+	if(pb <= pc) return (unsigned char)b;
+	return (unsigned char)c;
+}
+
+// Apply filter type to row with the previous row prev (or NULL), bpp bytes per pixel
+static void filter_row(int type, const unsigned char *row, const unsigned char *prev, size_t len, size_t bpp, unsigned char *out) {
+	out[0] = (unsigned char)type;
+	out++;
+	for(size_t i = 0; i < len; i++) {
+		const int a = i >= bpp ? row[i - bpp] : 0;
+		const int b = prev != NULL ? prev[i] : 0;
+		const int c = (prev != NULL && i >= bpp) ? prev[i - bpp] : 0;
+		switch(type) {
+		case FILTER_SUB: out[i] = (unsigned char)(row[i] - a); break;
+		case FILTER_UP: out[i] = (unsigned char)(row[i] - b); break;
+		case FILTER_AVERAGE: out[i] = (unsigned char)(row[i] - ((a + b) >> 1)); break;
+		case FILTER_PAETH: out[i] = (unsigned char)(row[i] - paeth(a, b, c)); break;
+		default: out[i] = row[i]; break;
+		}
+	}
+}
+
+// Filter a row with the given strategy. out must hold len+1 bytes
+static void filter_row(PngFilter filter, const unsigned char *row, const unsigned char *prev, size_t len, unsigned char *out) {
+	if(filter != FILTER_ADAPTIVE) {
+		filter_row(filter, row, prev, len, 3, out);
+		return;
+	}
+	// Pick the filter with the minimum sum of absolute differences
+	static thread_local vector<unsigned char> candidate;
+	candidate.resize(len + 1);
+	unsigned long best = (unsigned long)-1;
+	for(int type = FILTER_NONE; type <= FILTER_PAETH; type++) {
+		filter_row(type, row, prev, len, 3, &candidate[0]);
+		unsigned long sum = 0;
+		for(size_t i = 1; i <= len; i++)
+			sum += candidate[i] < 128 ? candidate[i] : 256 - candidate[i];
+		if(sum < best) {
+			best = sum;
+			memcpy(out, &candidate[0], len + 1);
+		}
+	}
+}
+
+static void put_uint32(unsigned char *buf, unsigned long value) {
+	buf[0] = (unsigned char)(value >> 24);
+	buf[1] = (unsigned char)(value >> 16);
+	buf[2] = (unsigned char)(value >> 8);
+	buf[3] = (unsigned char)value;
+}
+
+// Maximum size of the deflate dictionary
+static const size_t DICTIONARY_SIZE = 32768;
+// Minimum number of rows per chunk, as smaller chunks compress worse
+static const size_t MIN_CHUNK_ROWS = 16;
+// Maximum size of a single IDAT chunk
+static const size_t MAX_IDAT_SIZE = 1 << 20;
+
+PngWriter::PngWriter(const string &filename, size_t width, size_t height, const PngOptions &options, ThreadPool *pool) {
+	fp = open_output(filename);
+	buffer = NULL;
+	try {
+		begin(width, height, options, pool);
+	} catch (...) {
+		close_output(fp);
+		fp = NULL;
+		throw;
+	}
+}
+
+PngWriter::PngWriter(string *buffer, size_t width, size_t height, const PngOptions &options, ThreadPool *pool) {
+	this->fp = NULL;
+	this->buffer = buffer;
+	begin(width, height, options, pool);
+}
+
+void PngWriter::begin(size_t width, size_t height, const PngOptions &options, ThreadPool *pool) {
+	this->width = width;
+	this->height = height;
+	this->options = options;
+	if(this->options.level < 0) this->options.level = 0;
+	if(this->options.level > 9) this->options.level = 9;
+	this->pool = pool;
+	this->written = 0;
+	this->finished = false;
+	this->adler = adler32(0L, Z_NULL, 0);
+
+	static const unsigned char signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+	write(signature, sizeof(signature));
+
+	// 8-bit RGB, no interlacing
+	unsigned char ihdr[13];
+	put_uint32(ihdr, width);
+	put_uint32(ihdr + 4, height);
+	ihdr[8] = 8;
+	ihdr[9] = 2;
+	ihdr[10] = ihdr[11] = ihdr[12] = 0;
+	write_chunk("IHDR", string((const char*)ihdr, sizeof(ihdr)));
+
+	// zlib header with compression level hint
+	static const unsigned char flags[4] = { 0x01, 0x5e, 0x9c, 0xda };
+	const int hint = this->options.level < 2 ? 0 : (this->options.level < 6 ? 1 : (this->options.level == 6 ? 2 : 3));
+	const unsigned char header[2] = { 0x78, flags[hint] };
+	write_chunk("IDAT", string((const char*)header, 2));
+}
+
+PngWriter::~PngWriter() {
+	if(fp != NULL) close_output(fp);
+}
+
+void PngWriter::write(const void *data, size_t len) {
+	if(buffer != NULL) buffer->append((const char*)data, len);
+	else if(fwrite(data, 1, len, fp) != len) throw "Error writing png file";
+}
+
+void PngWriter::write_chunk(const char *type, const string &data) {
+	unsigned char buf[4];
+	put_uint32(buf, data.size());
+	write(buf, 4);
+	write(type, 4);
+	write(data.data(), data.size());
+	unsigned long crc = crc32(0L, (const Bytef*)type, 4);
+	crc = crc32(crc, (const Bytef*)data.data(), (uInt)data.size());
+	put_uint32(buf, crc);
+	write(buf, 4);
+}
+
+void PngWriter::compress(Chunk &chunk, const string &dict, bool last) {
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	const int strategy = options.filter == FILTER_NONE ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+	// Raw deflate, the zlib header and trailer are written separately
+	if(deflateInit2(&stream, options.level, Z_DEFLATED, -15, 8, strategy) != Z_OK)
+		throw "Error setting up zlib";
+	if(!dict.empty())
+		deflateSetDictionary(&stream, (const Bytef*)dict.data(), (uInt)dict.size());
+
+	chunk.compressed.resize(deflateBound(&stream, chunk.filtered.size()) + 16);
+	stream.next_in = &chunk.filtered[0];
+	stream.avail_in = (uInt)chunk.filtered.size();
+	stream.next_out = (Bytef*)&chunk.compressed[0];
+	stream.avail_out = (uInt)chunk.compressed.size();
+	// A sync flush ends the chunk on a byte boundary without ending the stream
+	int ret = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+	const bool ok = last ? ret == Z_STREAM_END : (ret == Z_OK && stream.avail_in == 0);
+	chunk.compressed.resize(stream.total_out);
+	deflateEnd(&stream);
+	if(!ok) throw "Error compressing png data";
+
+	chunk.adler = adler32(0L, Z_NULL, 0);
+	chunk.adler = adler32(chunk.adler, &chunk.filtered[0], (uInt)chunk.filtered.size());
+}
+
+void PngWriter::write_rows(const unsigned char *rows, size_t count) {
+	if(count == 0) return;
+	if(written + count > height) throw "Too many rows written to png";
+	const size_t stride = width * 3;
+	const bool last = written + count == height;
+
+	// Split the rows into one chunk per thread, but not too small ones
+	size_t threads = pool != NULL ? (size_t)pool->size() : 1;
+	size_t per_chunk = (count + threads - 1) / threads;
+	if(per_chunk < MIN_CHUNK_ROWS) per_chunk = MIN_CHUNK_ROWS;
+	chunks.resize((count + per_chunk - 1) / per_chunk);
+	for(size_t i = 0; i < chunks.size(); i++) {
+		chunks[i].first = i * per_chunk;
+		chunks[i].count = min(per_chunk, count - chunks[i].first);
+	}
+
+	// Filter all chunks. The first row refers to the last row of the previous batch
+	const unsigned char *previous = last_row.empty() ? NULL : &last_row[0];
+	function<void(size_t)> filter = [&](size_t i) {
+		Chunk &chunk = chunks[i];
+		chunk.filtered.resize(chunk.count * (stride + 1));
+		for(size_t r = 0; r < chunk.count; r++) {
+			const size_t row = chunk.first + r;
+			const unsigned char *prev = row == 0 ? previous : rows + (row - 1) * stride;
+			filter_row(options.filter, rows + row * stride, prev, stride, &chunk.filtered[r * (stride + 1)]);
+		}
+	};
+	// Compress all chunks, each with the filtered data before it as dictionary
+	function<void(size_t)> deflate = [&](size_t i) {
+		string dict;
+		if(i == 0) {
+			dict = dictionary;
+		} else {
+			const vector<unsigned char> &before = chunks[i-1].filtered;
+			size_t len = min(before.size(), DICTIONARY_SIZE);
+			dict.assign((const char*)&before[before.size() - len], len);
+		}
+		compress(chunks[i], dict, last && i == chunks.size() - 1);
+	};
+	if(pool != NULL) {
+		pool->parallel_for(chunks.size(), filter);
+		pool->parallel_for(chunks.size(), deflate);
+	} else {
+		for(size_t i = 0; i < chunks.size(); i++) filter(i);
+		for(size_t i = 0; i < chunks.size(); i++) deflate(i);
+	}
+
+	// Join the chunks in order
+	for(size_t i = 0; i < chunks.size(); i++) {
+		const Chunk &chunk = chunks[i];
+		adler = adler32_combine(adler, chunk.adler, (z_off_t)chunk.filtered.size());
+		for(size_t pos = 0; pos < chunk.compressed.size(); pos += MAX_IDAT_SIZE)
+			write_chunk("IDAT", chunk.compressed.substr(pos, MAX_IDAT_SIZE));
+	}
+
+	// Keep the last 32 KiB of filtered data as dictionary for the next batch
+	string tail;
+	for(size_t i = chunks.size(); i-- > 0 && tail.size() < DICTIONARY_SIZE; ) {
+		const vector<unsigned char> &filtered = chunks[i].filtered;
+		size_t len = min(filtered.size(), DICTIONARY_SIZE - tail.size());
+		tail.insert(0, (const char*)&filtered[filtered.size() - len], len);
+	}
+	if(tail.size() < DICTIONARY_SIZE) {
+		size_t len = min(dictionary.size(), DICTIONARY_SIZE - tail.size());
+		tail.insert(0, dictionary, dictionary.size() - len, len);
+	}
+	dictionary.swap(tail);
+	last_row.assign(rows + (count - 1) * stride, rows + count * stride);
+	written += count;
+}
+
+void PngWriter::finish() {
+	if(finished) return;
+	if(written != height) throw "Incomplete png image";
+
+	// zlib trailer
+	unsigned char trailer[4];
+	put_uint32(trailer, adler);
+	write_chunk("IDAT", string((const char*)trailer, 4));
+	write_chunk("IEND", "");
+	finished = true;
+	if(fp != NULL && !close_output(fp)) {
+		fp = NULL;
+		throw "Error writing png file";
+	}
+	fp = NULL;
+}
@@ -0,0 +1,118 @@
+/* Png.hpp
+ * Thin wrappers around libpng for row based PNG I/O
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#ifndef _OSMPNG_PNG_HPP_
+#define _OSMPNG_PNG_HPP_
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+
+#include "ThreadPool.hpp"
+#include "Image.hpp"
+
+
+// Read the image dimensions from the PNG header. Returns false, if data is no PNG image
+bool png_dimensions(const unsigned char *data, size_t len, size_t &width, size_t &height);
+inline bool png_dimensions(const std::string &data, size_t &width, size_t &height) {
+	return png_dimensions((const unsigned char*)data.data(), data.size(), width, height);
+}
+
+/* Decode a PNG image of the given dimensions into 8-bit RGB rows, which
+ * start stride bytes apart at dest.
+ * Palette, grayscale and 16-bit images are converted. Transparent pixels
+ * are composited onto the RGB color background or, if NULL, the alpha
+ * channel is dropped. Throws a string on error */
+void decode_png(const unsigned char *data, size_t len, unsigned char *dest, size_t stride,
+	size_t width, size_t height, const unsigned char *background = NULL);
+
+/* Decode only the region of columns x rows pixels at left/top of a PNG
+ * image, see above. The region is written to dest. Rows below the region
+ * are not decompressed */
+void decode_png_region(const unsigned char *data, size_t len, unsigned char *dest, size_t stride,
+	size_t width, size_t height, size_t left, size_t top, size_t columns, size_t rows,
+	const unsigned char *background = NULL);
+
+// Decode a PNG image from memory into 8-bit RGB pixels, see above
+void decode_png(const unsigned char *data, size_t len, std::vector<unsigned char> &rgb,
+	size_t &width, size_t &height, const unsigned char *background = NULL);
+inline void decode_png(const std::string &data, std::vector<unsigned char> &rgb, size_t &width, size_t &height,
+	const unsigned char *background = NULL) {
+	decode_png((const unsigned char*)data.data(), data.size(), rgb, width, height, background);
+}
+
+// Row filter of the PNG encoder
+enum PngFilter {
+	FILTER_NONE = 0,
+	FILTER_SUB = 1,
+	FILTER_UP = 2,
+	FILTER_AVERAGE = 3,
+	FILTER_PAETH = 4,
+	FILTER_ADAPTIVE = 5		// Best filter per row by minimum sum of absolute differences
+};
+
+// PNG encoder settings
+struct PngOptions {
+	int level;				// zlib compression level 0-9
+	PngFilter filter;
+
+	PngOptions() : level(6), filter(FILTER_ADAPTIVE) {}
+};
+
+// Parse a filter name (none, sub, up, average, paeth, adaptive). Returns false if unknown
+bool parse_png_filter(const std::string &name, PngFilter &filter);
+
+/* Writes a 8-bit RGB PNG file row by row, so that the image never needs
+ * to be kept in memory as a whole.
+ * Every batch of rows is split into chunks, which are filtered and deflated
+ * on the threads of the given pool. Like pigz, each chunk is compressed with
+ * the preceding 32 KiB as dictionary and ends with a sync flush, so the
+ * chunks join to a single zlib stream */
+class PngWriter : public ImageWriter {
+public:
+	PngWriter(const std::string &filename, size_t width, size_t height,
+		const PngOptions &options = PngOptions(), ThreadPool *pool = NULL);
+	// Encode into memory, the PNG file is appended to buffer
+	PngWriter(std::string *buffer, size_t width, size_t height,
+		const PngOptions &options = PngOptions(), ThreadPool *pool = NULL);
+	virtual ~PngWriter();
+
+	virtual void write_rows(const unsigned char *rows, size_t count);
+	virtual void finish();
+
+	size_t get_width() const { return width; }
+	size_t get_height() const { return height; }
+
+private:
+	// A chunk of rows, compressed independently
+	struct Chunk {
+		size_t first, count;			// Rows of the batch
+		std::vector<unsigned char> filtered;
+		std::string compressed;
+		unsigned long adler;
+	};
+
+	FILE *fp;
+	std::string *buffer;			// Destination if not writing to fp
+	PngOptions options;
+	ThreadPool *pool;
+	size_t width, height;
+	size_t written;
+	bool finished;
+
+	std::vector<unsigned char> last_row;	// Last row of the previous batch
+	std::string dictionary;				// Last 32 KiB of filtered data
+	unsigned long adler;				// Adler-32 of all filtered data so far
+	std::vector<Chunk> chunks;
+
+	// Write signature and header
+	void begin(size_t width, size_t height, const PngOptions &options, ThreadPool *pool);
+	void write(const void *data, size_t len);
+	void write_chunk(const char *type, const std::string &data);
+	void compress(Chunk &chunk, const std::string &dict, bool last);
+};
+
+#endif
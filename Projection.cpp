@@ -0,0 +1,26 @@
+/* Projection.cpp
+ * Conversion between geographic and slippy map tile coordinates
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#include <math.h>
+
+#include "Projection.hpp"
+
+
+REAL getTileY(REAL latitude, REAL n) {
+	REAL rad_lat = latitude * M_PI / 180.0;
+	REAL sec = 1.0/cos(rad_lat);
+	return n * (1.0 - (log(tan(rad_lat) + sec) / M_PI)) / 2.0;
+}
+REAL getTileX(REAL longitude, REAL n) {
+	return n * ((longitude + 180.0) / 360.0);
+}
+
+REAL getLongitude(REAL x, REAL n) {
+	return x / n * 360.0 - 180.0;
+}
+REAL getLatitude(REAL y, REAL n) {
+	return atan(sinh(M_PI * (1.0 - 2.0 * y / n))) * 180.0 / M_PI;
+}
@@ -0,0 +1,26 @@
+/* Projection.hpp
+ * Conversion between geographic and slippy map tile coordinates
+ *
+ * See http://wiki.openstreetmap.org/wiki/Slippy_map_tilenames for details
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#ifndef _OSMPNG_PROJECTION_HPP_
+#define _OSMPNG_PROJECTION_HPP_
+
+// Use float or double precision. float is off by several pixels from zoom 17 on
+#define REAL double
+// Latitude of the top and bottom edges of the tile grid
+#define MAX_LATITUDE 85.0511287798
+
+
+// Tile coordinates of a geographic position. n is the number of tiles per axis (2^zoom)
+REAL getTileX(REAL longitude, REAL n);
+REAL getTileY(REAL latitude, REAL n);
+
+// Longitude and latitude of the north-west corner of a tile
+REAL getLongitude(REAL x, REAL n);
+REAL getLatitude(REAL y, REAL n);
+
+#endif
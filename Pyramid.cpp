@@ -0,0 +1,79 @@
+/* Pyramid.cpp
+ * Synthesize lower zoom levels from the tiles of a higher one
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#include <vector>
+#include <string>
+
+#include "Pyramid.hpp"
+#include "Convert.hpp"
+
+using namespace std;
+
+
+// Decode the four children of a tile into a buffer of 2x2 tiles and reduce it to one tile
+static string synthesize(const TileStore &tiles, const TileKey &parent, size_t width, size_t height,
+		const PngOptions &options, const unsigned char *fill, const unsigned char *background) {
+	static thread_local vector<unsigned char> children, rgb;
+	const size_t stride = 2 * width * 3;
+	children.resize(stride * 2 * height);
+	rgb.resize(width * height * 3);
+
+	for(int child = 0; child < 4; child++) {
+		const int dx = child & 1, dy = child >> 1;
+		unsigned char *dest = &children[dy * height * stride + dx * width * 3];
+		const string *data = tiles.get(TileKey(2 * parent.x + dx, 2 * parent.y + dy, parent.zoom + 1));
+		if(data != NULL) {
+			decode_png((const unsigned char*)data->data(), data->size(), dest, stride, width, height, background);
+		} else {
+			for(size_t y = 0; y < height; y++)
+				for(size_t x = 0; x < width; x++)
+					for(int c = 0; c < 3; c++) dest[y * stride + x * 3 + c] = fill[c];
+		}
+	}
+
+	const ConvertKernels &kernels = convert_kernels();
+	for(size_t y = 0; y < height; y++)
+		kernels.downsample_rgb(&children[2 * y * stride], &children[(2 * y + 1) * stride], &rgb[y * width * 3], width);
+
+	string png;
+	PngWriter writer(&png, width, height, options);
+	writer.write_rows(&rgb[0], height);
+	writer.finish();
+	return png;
+}
+
+size_t build_pyramid(TileStore &tiles, const int *bounds, int zoom, int min_zoom,
+		const PngOptions &options, const unsigned char *fill, ThreadPool &pool, const unsigned char *background) {
+	size_t width, height;
+	// The tile size is taken from the first tile there is
+	const string *data = NULL;
+	for(int y = bounds[2]; y <= bounds[3] && data == NULL; y++)
+		for(int x = bounds[0]; x <= bounds[1] && data == NULL; x++)
+			data = tiles.get(TileKey(x, y, zoom));
+	if(data == NULL) throw "Missing tile";
+	if(!png_dimensions(*data, width, height)) throw "Invalid tile";
+
+	size_t synthesized = 0;
+	int x0 = bounds[0], x1 = bounds[1], y0 = bounds[2], y1 = bounds[3];
+	for(int z = zoom - 1; z >= min_zoom; z--) {
+		x0 >>= 1; x1 >>= 1;
+		y0 >>= 1; y1 >>= 1;
+		vector<TileKey> missing;
+		for(int y = y0; y <= y1; y++)
+			for(int x = x0; x <= x1; x++)
+				if(tiles.get(TileKey(x, y, z)) == NULL) missing.push_back(TileKey(x, y, z));
+
+		// Tiles of a level are independent, the store is only read while they are built
+		vector<string> results(missing.size());
+		pool.parallel_for(missing.size(), [&](size_t i) {
+			results[i] = synthesize(tiles, missing[i], width, height, options, fill, background);
+		});
+		for(size_t i = 0; i < missing.size(); i++)
+			tiles.put(missing[i], results[i]);
+		synthesized += missing.size();
+	}
+	return synthesized;
+}
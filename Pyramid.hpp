@@ -0,0 +1,26 @@
+/* Pyramid.hpp
+ * Synthesize lower zoom levels from the tiles of a higher one
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#ifndef _OSMPNG_PYRAMID_HPP_
+#define _OSMPNG_PYRAMID_HPP_
+
+#include "TileStore.hpp"
+#include "ThreadPool.hpp"
+#include "Png.hpp"
+
+
+/* Build the tiles of the zoom levels zoom-1 down to min_zoom covering the
+ * tiles bounds[0]..bounds[1] x bounds[2]..bounds[3] of zoom. Every tile is
+ * a 2x2 box filtered copy of its four children. Children missing in tiles
+ * are filled with the RGB color fill. Transparent pixels are composited
+ * onto background, if not NULL, like in merged images. Tiles already in the
+ * store are kept. Returns the number of synthesized tiles, throws a message
+ * on error */
+size_t build_pyramid(TileStore &tiles, const int *bounds, int zoom, int min_zoom,
+	const PngOptions &options, const unsigned char *fill, ThreadPool &pool,
+	const unsigned char *background = NULL);
+
+#endif
@@ -0,0 +1,69 @@
+/* Queue.hpp
+ * Bounded blocking queue to hand work from one thread to another
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#ifndef _OSMPNG_QUEUE_HPP_
+#define _OSMPNG_QUEUE_HPP_
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+
+/* First in, first out queue of at most capacity items. A full queue blocks
+ * the producer, which throttles it to the pace of the consumer.
+ * All methods are thread safe */
+template<typename T> class BoundedQueue {
+public:
+	BoundedQueue(size_t capacity) : capacity(capacity), closed(false) {}
+
+	// Append an item, waits while the queue is full. Returns false if the queue is closed
+	bool push(const T &item) {
+		std::unique_lock<std::mutex> lock(mtx);
+		while(!closed && items.size() >= capacity) not_full.wait(lock);
+		if(closed) return false;
+		items.push_back(item);
+		not_empty.notify_one();
+		return true;
+	}
+
+	// Take the oldest item, waits while the queue is empty.
+	// Returns false once the queue is closed and all items are taken
+	bool pop(T &item) {
+		std::unique_lock<std::mutex> lock(mtx);
+		while(!closed && items.empty()) not_empty.wait(lock);
+		if(items.empty()) return false;
+		item = items.front();
+		items.pop_front();
+		not_full.notify_one();
+		return true;
+	}
+
+	// No more items are pushed. Wakes up all waiting threads
+	void close() {
+		std::lock_guard<std::mutex> lock(mtx);
+		closed = true;
+		not_full.notify_all();
+		not_empty.notify_all();
+	}
+
+	// Close the queue and drop the pending items, e.g. if the consumer failed
+	void abort() {
+		std::lock_guard<std::mutex> lock(mtx);
+		closed = true;
+		items.clear();
+		not_full.notify_all();
+		not_empty.notify_all();
+	}
+
+private:
+	size_t capacity;
+	bool closed;
+	std::deque<T> items;
+	std::mutex mtx;
+	std::condition_variable not_full, not_empty;
+};
+
+#endif
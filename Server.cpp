@@ -0,0 +1,296 @@
+/* Server.cpp
+ * Minimal HTTP/1.1 server for local clients
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#include <sstream>
+#include <thread>
+#include <exception>
+#include <string.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "Server.hpp"
+
+using namespace std;
+
+// Largest accepted request head
+#define MAX_REQUEST_HEAD 16384
+// Idle keep-alive connections are closed after this many seconds
+#define IDLE_TIMEOUT 30
+
+
+static string lowercase(string str) {
+	for(size_t i = 0; i < str.size(); i++)
+		if(str[i] >= 'A' && str[i] <= 'Z') str[i] = str[i] - 'A' + 'a';
+	return str;
+}
+
+// Decode %XX escapes and '+' of a query component
+static string url_decode(const string &str) {
+	string result;
+	for(size_t i = 0; i < str.size(); i++) {
+		if(str[i] == '+') {
+			result += ' ';
+		} else if(str[i] == '%' && i + 2 < str.size() && isxdigit(str[i+1]) && isxdigit(str[i+2])) {
+			result += (char)strtol(str.substr(i+1, 2).c_str(), NULL, 16);
+			i += 2;
+		} else {
+			result += str[i];
+		}
+	}
+	return result;
+}
+
+static const char* status_text(int status) {
+	switch(status) {
+	case 200: return "OK";
+	case 400: return "Bad Request";
+	case 404: return "Not Found";
+	case 405: return "Method Not Allowed";
+	case 413: return "Payload Too Large";
+	case 431: return "Request Header Fields Too Large";
+	case 502: return "Bad Gateway";
+	case 503: return "Service Unavailable";
+	default: return status < 500 ? "Error" : "Internal Server Error";
+	}
+}
+
+static bool send_all(int fd, const char *data, size_t len) {
+	while(len > 0) {
+		ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+		if(sent < 0) {
+			if(errno == EINTR) continue;
+			return false;
+		}
+		data += sent;
+		len -= (size_t)sent;
+	}
+	return true;
+}
+
+string HttpRequest::param(const string &name, const string &def) const {
+	map<string, string>::const_iterator it = query.find(name);
+	return it == query.end() ? def : it->second;
+}
+
+HttpServer::HttpServer(const string &address, int max_connections) {
+	this->name = address;
+	this->fd = -1;
+	this->max_connections = max_connections;
+	this->stopping = 0;
+	if(address.compare(0, 5, "unix:") == 0) {
+		listen_unix(address.substr(5));
+	} else {
+		const size_t colon = address.find_last_of(':');
+		if(colon == string::npos) listen_tcp("127.0.0.1", address);
+		else listen_tcp(address.substr(0, colon), address.substr(colon + 1));
+	}
+}
+
+HttpServer::~HttpServer() {
+	if(fd >= 0) close(fd);
+	if(!socket_path.empty()) unlink(socket_path.c_str());
+}
+
+void HttpServer::listen_tcp(const string &host, const string &port) {
+	struct addrinfo hints, *result;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	int ret = getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &result);
+	if(ret != 0) throw "Cannot resolve " + name + ": " + gai_strerror(ret);
+
+	string error = "No address";
+	for(struct addrinfo *ai = result; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if(fd < 0) {
+			error = strerror(errno);
+			continue;
+		}
+		int one = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if(bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0) break;
+		error = strerror(errno);
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(result);
+	if(fd < 0) throw "Cannot listen on " + name + ": " + error;
+}
+
+void HttpServer::listen_unix(const string &path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(path.empty() || path.size() >= sizeof(addr.sun_path)) throw "Invalid socket path " + path;
+	strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+	// Remove the socket of a previous run, but no other files
+	struct stat st;
+	if(stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path.c_str());
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0) throw "Cannot create socket: " + string(strerror(errno));
+	if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+		string error = strerror(errno);
+		close(fd);
+		fd = -1;
+		throw "Cannot listen on " + path + ": " + error;
+	}
+	socket_path = path;
+}
+
+void HttpServer::stop() {
+	stopping = 1;
+	// Wakes up the blocking accept
+	if(fd >= 0) shutdown(fd, SHUT_RDWR);
+}
+
+void HttpServer::run(HttpHandler handler) {
+	while(!stopping) {
+		{
+			unique_lock<mutex> lock(mtx);
+			while(!stopping && (int)clients.size() >= max_connections)
+				cond.wait_for(lock, chrono::milliseconds(100));
+		}
+		int client = accept(fd, NULL, NULL);
+		if(client < 0) {
+			if(errno == EINTR || errno == ECONNABORTED) continue;
+			if(stopping) break;
+			throw "Accept failed: " + string(strerror(errno));
+		}
+		int one = 1;
+		setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		struct timeval timeout;
+		timeout.tv_sec = IDLE_TIMEOUT;
+		timeout.tv_usec = 0;
+		setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+		lock_guard<mutex> lock(mtx);
+		clients.insert(client);
+		thread(&HttpServer::serve, this, client, handler).detach();
+	}
+
+	// Let the open connections finish their current request
+	unique_lock<mutex> lock(mtx);
+	for(set<int>::const_iterator it = clients.begin(); it != clients.end(); it++)
+		shutdown(*it, SHUT_RD);
+	while(!clients.empty()) cond.wait(lock);
+}
+
+void HttpServer::serve(int client, HttpHandler handler) {
+	string buffer;
+	char chunk[4096];
+	bool keep_alive = true;
+	while(keep_alive) {
+		// Read the request head
+		size_t end;
+		while((end = buffer.find("\r\n\r\n")) == string::npos && buffer.size() <= MAX_REQUEST_HEAD) {
+			ssize_t received = recv(client, chunk, sizeof(chunk), 0);
+			if(received < 0 && errno == EINTR) continue;
+			if(received <= 0) break;
+			buffer.append(chunk, (size_t)received);
+		}
+
+		HttpRequest request;
+		HttpResponse response;
+		if(end == string::npos) {
+			if(buffer.size() <= MAX_REQUEST_HEAD) break;		// Closed by the client
+			response.status = 431;
+			response.body = "Request too large\n";
+			keep_alive = false;
+		} else {
+			const string head = buffer.substr(0, end);
+			buffer.erase(0, end + 4);
+
+			string version;
+			stringstream lines(head);
+			string line;
+			getline(lines, line);
+			stringstream(line) >> request.method >> request.target >> version;
+			keep_alive = version == "HTTP/1.1";
+			bool body = false;
+			while(getline(lines, line)) {
+				const size_t colon = line.find(':');
+				if(colon == string::npos) continue;
+				const string field = lowercase(line.substr(0, colon));
+				string value = lowercase(line.substr(colon + 1));
+				value.erase(0, value.find_first_not_of(" \t"));
+				value.erase(value.find_last_not_of(" \t\r") + 1);
+				if(field == "connection") keep_alive = value == "keep-alive" || (keep_alive && value != "close");
+				else if(field == "transfer-encoding" || (field == "content-length" && value != "0")) body = true;
+			}
+
+			const size_t mark = request.target.find('?');
+			request.path = url_decode(request.target.substr(0, mark));
+			if(mark != string::npos) {
+				stringstream query(request.target.substr(mark + 1));
+				string pair;
+				while(getline(query, pair, '&')) {
+					if(pair.empty()) continue;
+					const size_t eq = pair.find('=');
+					if(eq == string::npos) request.query[url_decode(pair)] = "";
+					else request.query[url_decode(pair.substr(0, eq))] = url_decode(pair.substr(eq + 1));
+				}
+			}
+
+			if(version.compare(0, 5, "HTTP/") != 0 || request.path.empty()) {
+				response.status = 400;
+				response.body = "Malformed request\n";
+				keep_alive = false;
+			} else if(body) {
+				response.status = 413;
+				response.body = "Request bodies are not supported\n";
+				keep_alive = false;
+			} else if(request.method != "GET" && request.method != "HEAD") {
+				response.status = 405;
+				response.body = "Only GET and HEAD are supported\n";
+			} else {
+				try {
+					handler(request, response);
+				} catch (string &msg) {
+					response = HttpResponse();
+					response.status = 500;
+					response.body = msg + "\n";
+				} catch (const char *msg) {
+					response = HttpResponse();
+					response.status = 500;
+					response.body = string(msg) + "\n";
+				} catch (exception &e) {
+					response = HttpResponse();
+					response.status = 500;
+					response.body = string(e.what()) + "\n";
+				}
+			}
+		}
+		if(stopping) keep_alive = false;
+
+		stringstream ss;
+		ss << "HTTP/1.1 " << response.status << ' ' << status_text(response.status) << "\r\n"
+			<< "Content-Type: " << response.type << "\r\n"
+			<< "Content-Length: " << response.body.size() << "\r\n"
+			<< "Connection: " << (keep_alive ? "keep-alive" : "close") << "\r\n\r\n";
+		const string header = ss.str();
+		if(!send_all(client, header.data(), header.size())) break;
+		if(request.method != "HEAD" && !send_all(client, response.body.data(), response.body.size())) break;
+	}
+
+	// Closed under the lock, so that run() never shuts down a reused descriptor
+	lock_guard<mutex> lock(mtx);
+	clients.erase(client);
+	close(client);
+	cond.notify_all();
+}
@@ -0,0 +1,78 @@
+/* Server.hpp
+ * Minimal HTTP/1.1 server for local clients
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#ifndef _OSMPNG_SERVER_HPP_
+#define _OSMPNG_SERVER_HPP_
+
+#include <string>
+#include <map>
+#include <set>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <signal.h>
+
+
+// A parsed request
+struct HttpRequest {
+	std::string method;
+	std::string target;		// Path and query as sent
+	std::string path;		// Without the query
+	std::map<std::string, std::string> query;	// Decoded query parameters
+
+	// Value of a query parameter or def, if not given
+	std::string param(const std::string &name, const std::string &def = "") const;
+};
+
+// Response to a request
+struct HttpResponse {
+	int status;
+	std::string type;		// Content-Type
+	std::string body;
+
+	HttpResponse() : status(200), type("text/plain") {}
+};
+
+typedef std::function<void(const HttpRequest&, HttpResponse&)> HttpHandler;
+
+/* Serves GET and HEAD requests on a TCP port or a Unix socket. Every
+ * connection is served by its own thread, so the handler is called
+ * concurrently. Connections are kept alive between requests.
+ * Only what a local client needs is supported: no request bodies, no
+ * chunked encoding and no TLS */
+class HttpServer {
+public:
+	/* Listen on address: "PORT" or "HOST:PORT" for TCP, localhost if no host
+	 * is given, or "unix:PATH" for a Unix socket. Throws a string on error */
+	HttpServer(const std::string &address, int max_connections = 64);
+	virtual ~HttpServer();
+
+	// Serve requests until stop() is called. Returns when all connections are closed
+	void run(HttpHandler handler);
+	// Stop accepting connections. Safe to call from a signal handler
+	void stop();
+
+	const std::string& address() const { return name; }
+
+private:
+	std::string name;
+	std::string socket_path;		// Unix socket to remove at the end
+	int fd;
+	int max_connections;
+	volatile sig_atomic_t stopping;
+
+	// Open connections
+	std::mutex mtx;
+	std::condition_variable cond;
+	std::set<int> clients;
+
+	void listen_tcp(const std::string &host, const std::string &port);
+	void listen_unix(const std::string &path);
+	// Serve the requests of a connection until the client is done
+	void serve(int client, HttpHandler handler);
+};
+
+#endif
@@ -0,0 +1,241 @@
+/* SlabCache.cpp
+ * Memory-mapped cache of decoded tiles
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#include <string.h>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <zlib.h>
+
+#include "SlabCache.hpp"
+#include "Png.hpp"
+
+using namespace std;
+
+
+// Bytes of a decoded tile
+#define SLAB_TILE_BYTES (SLAB_TILE_SIZE * SLAB_TILE_SIZE * 3)
+
+// File layout: Header, index of all slots, then the tiles starting on a page
+struct SlabHeader {
+	char magic[8];
+	uint32_t tile_size;
+	uint32_t slots;
+};
+static const char SLAB_MAGIC[8] = { 'O', 'S', 'M', 'S', 'L', 'A', 'B', '1' };
+static const size_t INDEX_OFFSET = 64;
+
+static size_t tiles_offset(size_t slots, size_t entry) {
+	return (INDEX_OFFSET + slots * entry + 4095) & ~(size_t)4095;
+}
+
+SlabCache::SlabCache(const string &filename, size_t max_bytes) {
+	this->filename = filename;
+	this->fd = -1;
+	this->map = NULL;
+	this->length = 0;
+	this->uses = 0;
+	this->hit_count = 0;
+	this->miss_count = 0;
+	const size_t slots = max_bytes / SLAB_TILE_BYTES;
+	if(slots == 0) throw "Decoded tile cache is too small for a single tile";
+
+	// The slots are managed in memory, two processes would overwrite each other
+	fd = open(filename.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+	if(fd < 0) throw "Cannot create " + filename;
+	if(flock(fd, LOCK_EX | LOCK_NB) != 0) {
+		close(fd);
+		fd = -1;
+		throw filename + " is in use by another process";
+	}
+	try {
+		if(!open_existing(slots)) create(slots);
+	} catch (...) {
+		close(fd);
+		fd = -1;
+		throw;
+	}
+	index_base = (Slot*)(map + INDEX_OFFSET);
+	tiles = map + tiles_offset(slots, sizeof(Slot));
+	vector< pair<uint64_t, size_t> > order;
+	for(size_t i = 0; i < slots; i++) {
+		Slot *slot = &index_base[i];
+		index.push_back(slot);
+		order.push_back(make_pair(slot->used, i));
+		if(slot->used == 0) continue;
+		lookup[TileKey(slot->x, slot->y, slot->zoom)] = i;
+		if(slot->used > uses) uses = slot->used;
+	}
+	pins.resize(slots, 0);
+	pending.resize(slots, false);
+	prev.resize(slots, -1);
+	next.resize(slots, -1);
+	head = tail = -1;
+	// Empty slots have used 0 and end up last
+	sort(order.begin(), order.end());
+	for(size_t i = 0; i < order.size(); i++) link(order[i].second, true);
+}
+
+SlabCache::~SlabCache() {
+	// The mapping is shared, the kernel writes the pages back
+	if(map != NULL) munmap(map, length);
+	if(fd >= 0) close(fd);
+}
+
+bool SlabCache::open_existing(size_t slots) {
+	length = tiles_offset(slots, sizeof(Slot)) + slots * SLAB_TILE_BYTES;
+	struct stat st;
+	SlabHeader header;
+	if(fstat(fd, &st) != 0 || (size_t)st.st_size != length
+			|| pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)
+			|| memcmp(header.magic, SLAB_MAGIC, sizeof(SLAB_MAGIC)) != 0
+			|| header.tile_size != SLAB_TILE_SIZE || header.slots != slots)
+		return false;
+	void *addr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(addr == MAP_FAILED) return false;
+	map = (unsigned char*)addr;
+	return true;
+}
+
+void SlabCache::create(size_t slots) {
+	length = tiles_offset(slots, sizeof(Slot)) + slots * SLAB_TILE_BYTES;
+	// The file is sparse, tiles take disk space only once they are written
+	if(ftruncate(fd, 0) != 0 || ftruncate(fd, (off_t)length) != 0) throw "Cannot resize " + filename;
+	void *addr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(addr == MAP_FAILED) throw "Cannot map " + filename;
+	map = (unsigned char*)addr;
+	SlabHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SLAB_MAGIC, sizeof(SLAB_MAGIC));
+	header.tile_size = SLAB_TILE_SIZE;
+	header.slots = (uint32_t)slots;
+	memcpy(map, &header, sizeof(header));
+}
+
+void SlabCache::link(size_t slot, bool front) {
+	if(front) {
+		prev[slot] = -1;
+		next[slot] = head;
+		if(head >= 0) prev[head] = (long)slot;
+		head = (long)slot;
+		if(tail < 0) tail = (long)slot;
+	} else {
+		next[slot] = -1;
+		prev[slot] = tail;
+		if(tail >= 0) next[tail] = (long)slot;
+		tail = (long)slot;
+		if(head < 0) head = (long)slot;
+	}
+}
+
+void SlabCache::unlink(size_t slot) {
+	if(prev[slot] >= 0) next[prev[slot]] = next[slot];
+	else head = next[slot];
+	if(next[slot] >= 0) prev[next[slot]] = prev[slot];
+	else tail = prev[slot];
+	prev[slot] = next[slot] = -1;
+}
+
+void SlabCache::pin(size_t slot) {
+	if(pins[slot]++ == 0) unlink(slot);
+}
+
+void SlabCache::unpin(size_t slot) {
+	// Back as the most recently used, or to be reused first if it was emptied
+	if(--pins[slot] == 0) link(slot, index[slot]->used != 0);
+}
+
+void SlabCache::forget(size_t slot, const TileKey &key) {
+	std::map<TileKey, size_t>::iterator it = lookup.find(key);
+	if(it != lookup.end() && it->second == slot) lookup.erase(it);
+}
+
+void SlabCache::read_region(const TileKey &key, const string &data, const unsigned char *background,
+		unsigned char *dest, size_t stride, size_t left, size_t top, size_t columns, size_t rows) {
+	const unsigned char *png = (const unsigned char*)data.data();
+	size_t width, height;
+	if(!png_dimensions(data, width, height) || width != SLAB_TILE_SIZE || height != SLAB_TILE_SIZE) {
+		decode_png_region(png, data.size(), dest, stride, width, height, left, top, columns, rows, background);
+		return;
+	}
+	const uint32_t crc = (uint32_t)crc32(crc32(0L, Z_NULL, 0), (const Bytef*)png, (uInt)data.size());
+	const uint32_t variant = background == NULL ? 0 :
+		(1u << 24) | ((uint32_t)background[0] << 16) | ((uint32_t)background[1] << 8) | background[2];
+
+	// Pin the slot, so it is not evicted while we copy from or decode into it.
+	// A missing tile reserves its slot right away, so concurrent readers of
+	// the same tile never decode it into a second slot
+	long slot = -1;
+	bool hit = false;
+	{
+		lock_guard<std::mutex> lock(mtx);
+		std::map<TileKey, size_t>::iterator it = lookup.find(key);
+		bool busy = false;
+		if(it != lookup.end()) {
+			const Slot *entry = index[it->second];
+			busy = pending[it->second];
+			hit = !busy && entry->crc == crc && entry->size == data.size() && entry->variant == variant;
+			// An outdated copy is replaced in place
+			if(hit || pins[it->second] == 0) slot = (long)it->second;
+		}
+		if(hit) {
+			hit_count++;
+			index[slot]->used = ++uses;
+		} else {
+			miss_count++;
+			// Another reader decodes the tile or still copies the outdated one
+			if(it != lookup.end() && slot < 0) busy = true;
+			if(!busy) {
+				if(slot < 0) slot = victim();
+				if(slot >= 0) {
+					Slot *entry = index[slot];
+					if(entry->used != 0) forget(slot, TileKey(entry->x, entry->y, entry->zoom));
+					entry->used = 0;
+					lookup[key] = slot;
+					pending[slot] = true;
+				}
+			}
+		}
+		if(slot >= 0) pin(slot);
+	}
+	// Busy tile or all slots busy
+	if(slot < 0) {
+		decode_png_region(png, data.size(), dest, stride, width, height, left, top, columns, rows, background);
+		return;
+	}
+
+	unsigned char *pixels = tile(slot);
+	try {
+		if(!hit) decode_png(png, data.size(), pixels, SLAB_TILE_SIZE * 3, width, height, background);
+	} catch (...) {
+		lock_guard<std::mutex> lock(mtx);
+		forget(slot, key);
+		pending[slot] = false;
+		unpin(slot);
+		throw;
+	}
+	for(size_t row = 0; row < rows; row++)
+		memcpy(dest + row * stride, pixels + ((top + row) * SLAB_TILE_SIZE + left) * 3, columns * 3);
+
+	lock_guard<std::mutex> lock(mtx);
+	if(!hit) {
+		// Published only once decoded, so an interrupted run never leaves an index entry
+		// for a half written tile
+		Slot *entry = index[slot];
+		entry->zoom = key.zoom;
+		entry->x = key.x;
+		entry->y = key.y;
+		entry->variant = variant;
+		entry->crc = crc;
+		entry->size = (uint32_t)data.size();
+		entry->used = ++uses;
+		pending[slot] = false;
+	}
+	unpin(slot);
+}
@@ -0,0 +1,94 @@
+/* SlabCache.hpp
+ * Memory-mapped cache of decoded tiles
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#ifndef _OSMPNG_SLABCACHE_HPP_
+#define _OSMPNG_SLABCACHE_HPP_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+
+#include "TileStore.hpp"
+
+
+// Width and height of the tiles kept in a slab
+#define SLAB_TILE_SIZE 256
+
+/* Second level cache holding decoded 256x256 RGB tiles in fixed slots of a
+ * memory-mapped file, so repeated merges copy pixels from the page cache
+ * instead of inflating the PNG again.
+ * A slot is only used, if size and CRC-32 of the encoded tile and the
+ * background color match the ones it was decoded from. If the slab is full,
+ * the least recently used tile is evicted. Safe for concurrent use within a
+ * process. The slab file is locked, a second process cannot open it */
+class SlabCache {
+public:
+	// Open the slab file or create it with room for max_bytes of tiles.
+	// A slab of a different size is started anew. Throws a string on error,
+	// also if another process uses the file
+	SlabCache(const std::string &filename, size_t max_bytes);
+	virtual ~SlabCache();
+
+	/* Copy the region of columns x rows pixels at left/top of a tile to dest,
+	 * see decode_png_region. data is the encoded tile, it is decoded and
+	 * stored in the slab if not cached yet. Tiles of other sizes than
+	 * SLAB_TILE_SIZE are decoded without caching */
+	void read_region(const TileKey &key, const std::string &data, const unsigned char *background,
+		unsigned char *dest, size_t stride, size_t left, size_t top, size_t columns, size_t rows);
+
+	size_t slots() const { return index.size(); }
+	size_t hits() const { return hit_count; }
+	size_t misses() const { return miss_count; }
+
+private:
+	// Index entry of a slot, stored in front of the tiles
+	struct Slot {
+		int32_t zoom, x, y;
+		uint32_t variant;		// Background color the tile was decoded for
+		uint32_t crc;			// Checksum and size of the encoded tile
+		uint32_t size;
+		uint64_t used;			// Last use, 0 for an empty slot
+	};
+
+	std::string filename;
+	int fd;
+	unsigned char *map;
+	size_t length;
+	Slot *index_base;
+	unsigned char *tiles;
+	std::vector<Slot*> index;
+	std::map<TileKey, size_t> lookup;
+	std::vector<int> pins;		// Readers or writers of a slot in progress
+	// Unpinned slots from the most (head) to the least recently used (tail),
+	// empty slots last. Pinned slots are taken out, so the victim is the tail
+	std::vector<long> prev, next;
+	long head, tail;
+	// Slots reserved for a tile that is still being decoded. Other readers of
+	// the tile decode it on their own meanwhile
+	std::vector<bool> pending;
+	uint64_t uses;
+	size_t hit_count, miss_count;
+	std::mutex mtx;
+
+	// Map the opened file, if it is a slab of the given size
+	bool open_existing(size_t slots);
+	// Start an empty slab in the opened file
+	void create(size_t slots);
+	// Drop the tile of a slot from lookup, if the slot still holds it
+	void forget(size_t slot, const TileKey &key);
+	// Least recently used slot that is not pinned or -1
+	long victim() const { return tail; }
+	void link(size_t slot, bool front);
+	void unlink(size_t slot);
+	// Keep a slot from being evicted while it is read or written
+	void pin(size_t slot);
+	void unpin(size_t slot);
+	unsigned char* tile(size_t slot) const { return tiles + slot * SLAB_TILE_SIZE * SLAB_TILE_SIZE * 3; }
+};
+
+#endif
@@ -0,0 +1,36 @@
+/* Status.hpp
+ * Error codes of the library interface
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#ifndef _OSMPNG_STATUS_HPP_
+#define _OSMPNG_STATUS_HPP_
+
+#include <string>
+
+
+enum ErrorCode {
+	OSMPNG_OK = 0,
+	OSMPNG_INVALID_ARGUMENT,	// Bounds, zoom or options out of range
+	OSMPNG_AREA_TOO_LARGE,		// More tiles than allowed by MapOptions::max_tiles
+	OSMPNG_FETCH_FAILED,		// Tiles could not be downloaded
+	OSMPNG_RENDER_FAILED,		// Tiles could not be decoded or the map not be encoded
+	OSMPNG_IO_ERROR				// A file could not be read or written
+};
+
+// Outcome of a library call: a code and a message for humans
+struct Status {
+	ErrorCode code;
+	std::string message;
+
+	Status() : code(OSMPNG_OK) {}
+	Status(ErrorCode code, const std::string &message) : code(code), message(message) {}
+
+	bool ok() const { return code == OSMPNG_OK; }
+};
+
+// Short name of an error code, e.g. "fetch failed"
+const char* error_name(ErrorCode code);
+
+#endif
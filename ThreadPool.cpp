@@ -0,0 +1,88 @@
+/* ThreadPool.cpp
+ * Fixed size pool of worker threads for data parallel loops
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#include "ThreadPool.hpp"
+
+using namespace std;
+
+
+ThreadPool::ThreadPool(int threads) {
+	if(threads <= 0) threads = (int)thread::hardware_concurrency();
+	if(threads <= 0) threads = 1;
+	this->count = 0;
+	this->next = 0;
+	this->finished = 0;
+	this->generation = 0;
+	this->stopping = false;
+	for(int i = 1; i < threads; i++)
+		workers.push_back(thread(&ThreadPool::worker_loop, this));
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		unique_lock<mutex> lock(mtx);
+		stopping = true;
+	}
+	cond.notify_all();
+	for(size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
+}
+
+void ThreadPool::work(unique_lock<mutex> &lock) {
+	while(next < count) {
+		size_t i = next++;
+		lock.unlock();
+		try {
+			body(i);
+		} catch (...) {
+			lock.lock();
+			if(!error) error = current_exception();
+			// Skip the remaining iterations
+			finished += count - next;
+			next = count;
+			lock.unlock();
+		}
+		lock.lock();
+		if(++finished == count) done.notify_all();
+	}
+}
+
+void ThreadPool::worker_loop() {
+	unique_lock<mutex> lock(mtx);
+	unsigned long seen = generation;
+	while(true) {
+		while(!stopping && generation == seen)
+			cond.wait(lock);
+		if(stopping) return;
+		seen = generation;
+		work(lock);
+	}
+}
+
+void ThreadPool::parallel_for(size_t n, function<void(size_t)> fn) {
+	if(n == 0) return;
+	// Loops of other threads wait for the current one to finish
+	lock_guard<mutex> serial(loop);
+	unique_lock<mutex> lock(mtx);
+	body = fn;
+	count = n;
+	next = 0;
+	finished = 0;
+	error = exception_ptr();
+	generation++;
+	cond.notify_all();
+
+	work(lock);
+	while(finished < count)
+		done.wait(lock);
+
+	body = nullptr;
+	if(error) {
+		exception_ptr e = error;
+		error = exception_ptr();
+		rethrow_exception(e);
+	}
+}
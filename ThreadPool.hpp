@@ -0,0 +1,55 @@
+/* ThreadPool.hpp
+ * Fixed size pool of worker threads for data parallel loops
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#ifndef _OSMPNG_THREADPOOL_HPP_
+#define _OSMPNG_THREADPOOL_HPP_
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+
+
+/* Runs loop bodies on a set of worker threads. The calling thread takes
+ * part in the work as well, so a pool of size 1 runs everything inline */
+class ThreadPool {
+public:
+	// threads: Total number of threads including the caller, 0 for one per core
+	ThreadPool(int threads = 0);
+	virtual ~ThreadPool();
+
+	// Number of threads working on a loop
+	int size() const { return (int)workers.size() + 1; }
+
+	// Call fn(i) for every i in [0,n) and return when all calls are done.
+	// The first exception thrown by fn is rethrown here. Loops called from
+	// several threads run one after another, fn must not start a loop itself
+	void parallel_for(size_t n, std::function<void(size_t)> fn);
+
+private:
+	std::vector<std::thread> workers;
+	std::mutex mtx;
+	std::mutex loop;		// Held by the thread running the current loop
+	std::condition_variable cond;
+	std::condition_variable done;
+
+	// Current loop
+	std::function<void(size_t)> body;
+	size_t count;			// Number of iterations
+	size_t next;			// Next iteration to hand out
+	size_t finished;		// Number of completed iterations
+	unsigned long generation;	// Incremented for every loop
+	std::exception_ptr error;
+	bool stopping;
+
+	void worker_loop();
+	// Work on the current loop until no iterations are left
+	void work(std::unique_lock<std::mutex> &lock);
+};
+
+#endif
@@ -0,0 +1,428 @@
+/* TileCache.cpp
+ * Persistent tile cache with HTTP cache metadata
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+#include "TileCache.hpp"
+
+using namespace std;
+
+// Name of the index within the cache directory
+#define INDEX_FILE "tiles.index"
+
+
+// Write data to the given file. The file is replaced atomically, so readers
+// never see partial tiles. Returns true on success
+static bool write_file(const string &file, const string &data) {
+	string tmp = file + ".tmp";
+	FILE *fp = fopen(tmp.c_str(), "wb");
+	if(fp == NULL) return false;
+	bool ok = fwrite(data.data(), 1, data.size(), fp) == data.size();
+	if(fclose(fp) != 0) ok = false;
+	if(ok) ok = rename(tmp.c_str(), file.c_str()) == 0;
+	if(!ok) remove(tmp.c_str());
+	return ok;
+}
+
+// Read a whole file. Returns false, if the file cannot be read
+static bool read_file(const string &file, string &data) {
+	FILE *fp = fopen(file.c_str(), "rb");
+	if(fp == NULL) return false;
+	data.clear();
+	char buf[16384];
+	size_t len;
+	while((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+		data.append(buf, len);
+	bool ok = ferror(fp) == 0;
+	fclose(fp);
+	return ok;
+}
+
+// 64-bit FNV-1a hash of the contents, names the objects
+static uint64_t content_hash(const string &data) {
+	uint64_t hash = 14695981039346656037ULL;
+	for(size_t i = 0; i < data.size(); i++) {
+		hash ^= (unsigned char)data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+// Size of a file, 0 if it does not exist
+static size_t file_size(const string &file) {
+	struct stat st;
+	return stat(file.c_str(), &st) == 0 ? (size_t)st.st_size : 0;
+}
+
+// Object holding the contents of tiles, see write_shared
+static string object_filename(const string &directory, const string &data) {
+	char name[64];
+	snprintf(name, sizeof(name), "%016llx-%llu.png", (unsigned long long)content_hash(data),
+		(unsigned long long)data.size());
+	return directory + "objects/" + name;
+}
+
+TileCache::TileCache(const string &directory, size_t max_size, bool keep) {
+	this->directory = directory;
+	if(!this->directory.empty() && this->directory[this->directory.size()-1] != '/')
+		this->directory += '/';
+	this->max_size = max_size;
+	this->keep = keep;
+	this->total = 0;
+	this->indexed = false;
+	this->dirty = false;
+	this->removed = 0;
+	this->writing = false;
+	this->stopping = false;
+	this->failed = 0;
+	this->linked = 0;
+	this->sequence = 0;
+}
+
+TileCache::~TileCache() {
+	{
+		unique_lock<mutex> lock(mtx);
+		stopping = true;
+	}
+	cond.notify_all();
+	if(writer.joinable()) writer.join();
+	save_index();
+}
+
+string TileCache::filename(const TileKey &key) const {
+	stringstream ss;
+	ss << directory << key.zoom << '-' << key.x << '.' << key.y << ".png";
+	return ss.str();
+}
+
+string TileCache::meta_filename(const TileKey &key) const {
+	stringstream ss;
+	ss << directory << key.zoom << '-' << key.x << '.' << key.y << ".meta";
+	return ss.str();
+}
+
+bool TileCache::load(const TileKey &key, CacheEntry &entry) {
+	// Tiles still queued for writing are taken from the queue
+	const string file = filename(key), meta_file = meta_filename(key);
+	bool queued, queued_meta;
+	string meta;
+	{
+		unique_lock<mutex> lock(mtx);
+		queued = unwritten_data(file, entry.data);
+		queued_meta = unwritten_data(meta_file, meta);
+	}
+	if(!queued && !read_file(file, entry.data)) return false;
+	if(entry.data.empty()) return false;
+	entry.etag.clear();
+	entry.last_modified.clear();
+	entry.expires = 0;
+
+	// Missing metadata is fine, the tile is then considered stale
+	if(!queued_meta) read_file(meta_file, meta);
+	stringstream in(meta);
+	string line;
+	while(getline(in, line)) {
+		size_t colon = line.find(':');
+		if(colon == string::npos) continue;
+		string name = line.substr(0, colon);
+		string value = line.substr(colon + 1);
+		if(!value.empty() && value[0] == ' ') value = value.substr(1);
+		if(name == "etag") entry.etag = value;
+		else if(name == "last-modified") entry.last_modified = value;
+		else if(name == "expires") entry.expires = (time_t)atoll(value.c_str());
+	}
+	// A run that keeps no tiles must not write the index
+	if(!keep) return true;
+	unique_lock<mutex> lock(mtx);
+	touch(key);
+	return true;
+}
+
+void TileCache::store(const TileKey &key, const CacheEntry &entry) {
+	write_async(filename(key), entry.data, true);
+	{
+		unique_lock<mutex> lock(mtx);
+		IndexEntry &item = touch(key);
+		total = total - item.size + entry.data.size();
+		item.size = entry.data.size();
+	}
+	store_meta(key, entry);
+}
+
+void TileCache::store_meta(const TileKey &key, const CacheEntry &entry) {
+	stringstream ss;
+	if(!entry.etag.empty()) ss << "etag: " << entry.etag << endl;
+	if(!entry.last_modified.empty()) ss << "last-modified: " << entry.last_modified << endl;
+	ss << "expires: " << (long long)entry.expires << endl;
+	const string meta = ss.str();
+	write_async(meta_filename(key), meta);
+
+	unique_lock<mutex> lock(mtx);
+	IndexEntry &item = touch(key);
+	total = total - item.meta + meta.size();
+	item.meta = meta.size();
+	evict();
+}
+
+void TileCache::load_index() {
+	if(indexed) return;
+	indexed = true;
+
+	struct Line {
+		TileKey key;
+		size_t size, meta;
+		time_t access;
+
+		Line() : size(0), meta(0), access(0) {}
+		bool operator<(const Line &other) const { return access < other.access; }
+	};
+	vector<Line> lines;
+	ifstream in((directory + INDEX_FILE).c_str());
+	if(in) {
+		string text;
+		while(getline(in, text)) {
+			if(text.empty() || text[0] == '#') continue;
+			stringstream ss(text);
+			Line line;
+			long long access;
+			if(!(ss >> line.key.zoom >> line.key.x >> line.key.y >> line.size >> line.meta >> access)) continue;
+			line.access = (time_t)access;
+			lines.push_back(line);
+		}
+	} else {
+		// A cache without index, its tiles were last used when they were written or read
+		DIR *dir = opendir(directory.empty() ? "." : directory.c_str());
+		if(dir == NULL) return;
+		struct dirent *ent;
+		while((ent = readdir(dir)) != NULL) {
+			Line line;
+			int end = 0;
+			if(sscanf(ent->d_name, "%d-%d.%d.png%n", &line.key.zoom, &line.key.x, &line.key.y, &end) != 3
+					|| end == 0 || ent->d_name[end] != '\0')
+				continue;
+			struct stat st;
+			if(stat(filename(line.key).c_str(), &st) != 0) continue;
+			line.size = (size_t)st.st_size;
+			line.meta = file_size(meta_filename(line.key));
+			line.access = max(st.st_atime, st.st_mtime);
+			lines.push_back(line);
+		}
+		closedir(dir);
+		dirty = !lines.empty();
+	}
+
+	// From the least to the most recently used, equal times keep their order
+	stable_sort(lines.begin(), lines.end());
+	for(size_t i = 0; i < lines.size(); i++) {
+		const Line &line = lines[i];
+		if(index.count(line.key) > 0) continue;
+		IndexEntry entry;
+		entry.size = line.size;
+		entry.meta = line.meta;
+		entry.access = line.access;
+		lru.push_front(line.key);
+		entry.position = lru.begin();
+		index[line.key] = entry;
+		total += line.size + line.meta;
+	}
+	// The limit may be lower than in the run before
+	evict();
+}
+
+void TileCache::save_index() {
+	unique_lock<mutex> lock(mtx);
+	if(!dirty) return;
+	stringstream ss;
+	ss << "# zoom x y size meta access" << endl;
+	for(list<TileKey>::reverse_iterator it = lru.rbegin(); it != lru.rend(); it++) {
+		const IndexEntry &entry = index[*it];
+		ss << it->zoom << ' ' << it->x << ' ' << it->y << ' ' << entry.size << ' ' << entry.meta
+			<< ' ' << (long long)entry.access << endl;
+	}
+	if(write_file(directory + INDEX_FILE, ss.str())) dirty = false;
+	else failed++;
+}
+
+TileCache::IndexEntry& TileCache::touch(const TileKey &key) {
+	load_index();
+	map<TileKey, IndexEntry>::iterator it = index.find(key);
+	if(it == index.end()) {
+		IndexEntry entry;
+		entry.size = file_size(filename(key));
+		entry.meta = file_size(meta_filename(key));
+		lru.push_front(key);
+		entry.position = lru.begin();
+		it = index.insert(make_pair(key, entry)).first;
+		total += entry.size + entry.meta;
+	} else {
+		lru.splice(lru.begin(), lru, it->second.position);
+	}
+	it->second.access = time(NULL);
+	dirty = true;
+	return it->second;
+}
+
+void TileCache::evict() {
+	if(max_size == 0) return;
+	// The most recently used tile stays, even if it alone exceeds the limit
+	while(total > max_size && lru.size() > 1) {
+		map<TileKey, IndexEntry>::iterator it = index.find(lru.back());
+		total -= it->second.size + it->second.meta;
+		Write write;
+		write.file = filename(it->first);
+		write.shared = false;
+		write.remove = true;
+		enqueue(write);
+		lru.pop_back();
+		index.erase(it);
+		removed++;
+		dirty = true;
+	}
+}
+
+void TileCache::write_async(const string &file, const string &data, bool shared) {
+	unique_lock<mutex> lock(mtx);
+	Write write;
+	write.file = file;
+	write.data = data;
+	write.shared = shared;
+	write.remove = false;
+	enqueue(write);
+}
+
+// Called with mtx held
+void TileCache::enqueue(const Write &write) {
+	if(!writer.joinable())
+		writer = thread(&TileCache::write_loop, this);
+	writes.push_back(write);
+	writes.back().sequence = ++sequence;
+	if(write.remove) {
+		unwritten.erase(write.file);
+		unwritten.erase(write.file.substr(0, write.file.size() - 4) + ".meta");
+	} else {
+		Unwritten &pending = unwritten[write.file];
+		pending.sequence = sequence;
+		pending.data = write.data;
+	}
+	cond.notify_all();
+}
+
+// Called with mtx held
+bool TileCache::unwritten_data(const string &file, string &data) const {
+	map<string, Unwritten>::const_iterator it = unwritten.find(file);
+	if(it == unwritten.end()) return false;
+	data = it->second.data;
+	return true;
+}
+
+bool TileCache::write_shared(const string &file, const string &data, bool &linked) {
+	// A tile with new contents drops its link to the old object
+	string previous;
+	const bool replaced = read_file(file, previous) && previous != data;
+	const bool ok = link_object(file, data, linked);
+	if(ok && replaced) release_object(previous);
+	return ok;
+}
+
+bool TileCache::link_object(const string &file, const string &data, bool &linked) {
+	const string objects = directory + "objects";
+	const string object = object_filename(directory, data);
+
+	// Hash collisions are caught by comparing the contents. A replaced object
+	// does not affect tiles linked to it before, rename gives it a new inode
+	string existing;
+	linked = read_file(object, existing) && existing == data;
+	if(!linked) {
+		mkdir(objects.c_str(), S_IRWXU);
+		if(!write_file(object, data)) return write_file(file, data);
+	}
+	string tmp = file + ".tmp";
+	remove(tmp.c_str());
+	if(link(object.c_str(), tmp.c_str()) != 0) {
+		linked = false;
+		return write_file(file, data);
+	}
+	bool ok = rename(tmp.c_str(), file.c_str()) == 0;
+	// If file is a link to the object already, rename leaves tmp in place
+	remove(tmp.c_str());
+	return ok;
+}
+
+bool TileCache::remove_tile(const string &file) {
+	// The metadata file has the same name, ending in .meta instead of .png
+	remove((file.substr(0, file.size() - 4) + ".meta").c_str());
+	string data;
+	if(!read_file(file, data)) return true;
+	if(remove(file.c_str()) != 0) return false;
+	release_object(data);
+	return true;
+}
+
+void TileCache::release_object(const string &data) {
+	// Only the objects directory links to an object no tile uses anymore
+	const string object = object_filename(directory, data);
+	struct stat st;
+	if(stat(object.c_str(), &st) == 0 && st.st_nlink == 1) remove(object.c_str());
+}
+
+size_t TileCache::deduplicated() {
+	unique_lock<mutex> lock(mtx);
+	return linked;
+}
+
+size_t TileCache::evicted() {
+	unique_lock<mutex> lock(mtx);
+	return removed;
+}
+
+size_t TileCache::flush() {
+	{
+		unique_lock<mutex> lock(mtx);
+		while(!writes.empty() || writing)
+			cond.wait(lock);
+	}
+	save_index();
+	unique_lock<mutex> lock(mtx);
+	size_t result = failed;
+	failed = 0;
+	return result;
+}
+
+void TileCache::write_loop() {
+	unique_lock<mutex> lock(mtx);
+	while(true) {
+		while(writes.empty() && !stopping)
+			cond.wait(lock);
+		if(writes.empty()) return;
+
+		Write job = writes.front();
+		writes.pop_front();
+		writing = true;
+		lock.unlock();
+		bool shared = false;
+		bool ok;
+		if(job.remove) ok = remove_tile(job.file);
+		else if(job.shared) ok = write_shared(job.file, job.data, shared);
+		else ok = write_file(job.file, job.data);
+		lock.lock();
+		writing = false;
+		// Unless the file is queued again, it is read from the disk now
+		map<string, Unwritten>::iterator it = unwritten.find(job.file);
+		if(it != unwritten.end() && it->second.sequence == job.sequence) unwritten.erase(it);
+		if(!ok) failed++;
+		if(shared) linked++;
+		cond.notify_all();
+	}
+}
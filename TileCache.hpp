@@ -0,0 +1,144 @@
+/* TileCache.hpp
+ * Persistent tile cache with HTTP cache metadata
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#ifndef _OSMPNG_TILECACHE_HPP_
+#define _OSMPNG_TILECACHE_HPP_
+
+#include <string>
+#include <deque>
+#include <list>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <time.h>
+
+#include "TileStore.hpp"
+
+
+// A cached tile together with its validators
+struct CacheEntry {
+	std::string data;
+	std::string etag;
+	std::string last_modified;
+	time_t expires;			// Fresh until, 0 if unknown
+
+	CacheEntry() : expires(0) {}
+
+	// True if the tile can be used without asking the server
+	bool fresh(time_t now) const { return expires > now; }
+	// True if a conditional request is possible
+	bool validatable() const { return !etag.empty() || !last_modified.empty(); }
+};
+
+/* Tile cache in a directory. Every tile is stored as `zoom-x.y.png` next to
+ * a `zoom-x.y.meta` file holding ETag, Last-Modified and the expiry time.
+ * Tile contents are stored once in `objects/`, named by their hash, and
+ * `zoom-x.y.png` is a hard link to it, so identical tiles take the disk
+ * space of one. Without hard link support tiles are plain copies.
+ * The file `tiles.index` records size and last access of every tile. With
+ * a size limit, the least recently used tiles are evicted when new ones
+ * are stored. Identical tiles count once per position, so the disk space
+ * taken stays below the limit. A cache without index is scanned once.
+ * A cache, whose tiles are not kept, is only read and leaves the index alone.
+ * Writes are done by a background thread, reads are synchronous and see
+ * the tiles still queued for writing */
+class TileCache {
+public:
+	// max_size in bytes of tiles and metadata, 0 for no limit. Without keep
+	// tiles are only loaded, and their use is not recorded in the index
+	TileCache(const std::string &directory, size_t max_size = 0, bool keep = true);
+	virtual ~TileCache();
+
+	// Standardized cache filename of a tile
+	std::string filename(const TileKey &key) const;
+
+	// Load a cached tile and mark it as used, if tiles are kept. Returns false, if the tile is not cached
+	bool load(const TileKey &key, CacheEntry &entry);
+	// Store tile and metadata
+	void store(const TileKey &key, const CacheEntry &entry);
+	// Store only the metadata of an already cached tile, e.g. after revalidation
+	void store_meta(const TileKey &key, const CacheEntry &entry);
+
+	// Wait until all pending writes are done and save the index. Returns the
+	// number of failed writes
+	size_t flush();
+	// Number of stored tiles, that were linked to an existing object
+	size_t deduplicated();
+	// Number of tiles removed to stay within the size limit
+	size_t evicted();
+
+private:
+	std::string directory;
+	size_t max_size;
+	bool keep;
+
+	std::string meta_filename(const TileKey &key) const;
+
+	// Index of the cached tiles, loaded on first use. lru holds the keys
+	// from the most to the least recently used
+	struct IndexEntry {
+		size_t size, meta;			// Bytes of tile and metadata
+		time_t access;
+		std::list<TileKey>::iterator position;
+	};
+	std::map<TileKey, IndexEntry> index;
+	std::list<TileKey> lru;
+	size_t total;
+	bool indexed;
+	bool dirty;
+	size_t removed;
+
+	// Read tiles.index or scan the directory if there is none
+	void load_index();
+	void save_index();
+	// Mark a tile as used. Tiles missing from the index are added with the
+	// sizes of their files
+	IndexEntry& touch(const TileKey &key);
+	// Remove the least recently used tiles until the cache fits into max_size
+	void evict();
+
+	// Background writer
+	struct Write {
+		std::string file;
+		std::string data;
+		bool shared;		// Store the contents as object and link to it
+		bool remove;		// Delete the tile, its metadata and its unused object
+		size_t sequence;
+	};
+	// Contents of the queued writes by file, until they are on disk
+	struct Unwritten {
+		size_t sequence;	// Of the last write of the file
+		std::string data;
+	};
+	std::map<std::string, Unwritten> unwritten;
+	size_t sequence;
+	std::thread writer;
+	std::mutex mtx;
+	std::condition_variable cond;
+	std::deque<Write> writes;
+	bool writing;
+	bool stopping;
+	size_t failed;
+	size_t linked;
+
+	void write_async(const std::string &file, const std::string &data, bool shared = false);
+	void enqueue(const Write &write);
+	// Contents of a queued write of file, false if there is none
+	bool unwritten_data(const std::string &file, std::string &data) const;
+	void write_loop();
+	// Write a tile as hard link to the object of its contents. Returns
+	// false on error, linked tells if the object existed already. The
+	// object of replaced contents is released
+	bool write_shared(const std::string &file, const std::string &data, bool &linked);
+	bool link_object(const std::string &file, const std::string &data, bool &linked);
+	// Delete a tile and its metadata. Its object goes once no other tile links to it
+	bool remove_tile(const std::string &file);
+	// Delete the object of data, if no tile links to it anymore
+	void release_object(const std::string &data);
+};
+
+#endif
@@ -0,0 +1,49 @@
+/* TileStore.cpp
+ * In-memory store for fetched, still encoded tiles
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#include "TileStore.hpp"
+
+using namespace std;
+
+
+void TileStore::put(const TileKey &key, const string &data) {
+	lock_guard<mutex> lock(mtx);
+	// Elements of an unordered_map keep their address on rehashing
+	unordered_map<string, size_t>::iterator content = contents.insert(make_pair(data, 0)).first;
+	content->second++;
+	map<TileKey, const string*>::iterator it = tiles.find(key);
+	if(it != tiles.end()) {
+		// Release the replaced contents
+		unordered_map<string, size_t>::iterator old = contents.find(*it->second);
+		if(--old->second == 0) contents.erase(old);
+		it->second = &content->first;
+	} else {
+		tiles[key] = &content->first;
+	}
+}
+
+const string* TileStore::get(const TileKey &key) const {
+	lock_guard<mutex> lock(mtx);
+	map<TileKey, const string*>::const_iterator it = tiles.find(key);
+	if(it == tiles.end()) return NULL;
+	return it->second;
+}
+
+size_t TileStore::size() const {
+	lock_guard<mutex> lock(mtx);
+	return tiles.size();
+}
+
+size_t TileStore::distinct() const {
+	lock_guard<mutex> lock(mtx);
+	return contents.size();
+}
+
+void TileStore::clear() {
+	lock_guard<mutex> lock(mtx);
+	tiles.clear();
+	contents.clear();
+}
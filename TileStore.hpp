@@ -0,0 +1,60 @@
+/* TileStore.hpp
+ * In-memory store for fetched, still encoded tiles
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#ifndef _OSMPNG_TILESTORE_HPP_
+#define _OSMPNG_TILESTORE_HPP_
+
+#include <string>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+
+
+// Slippy map tile coordinates
+struct TileKey {
+	int zoom, x, y;
+
+	TileKey() : zoom(0), x(0), y(0) {}
+	TileKey(int x, int y, int zoom) : zoom(zoom), x(x), y(y) {}
+
+	bool operator<(const TileKey &other) const {
+		if(zoom != other.zoom) return zoom < other.zoom;
+		if(y != other.y) return y < other.y;
+		return x < other.x;
+	}
+	bool operator==(const TileKey &other) const {
+		return zoom == other.zoom && x == other.x && y == other.y;
+	}
+};
+
+/* Keeps the encoded tiles of a run in memory, so they can be decoded
+ * without a round trip through the file system.
+ * Identical tiles (open sea, empty land) are stored only once: get returns
+ * the same pointer for all tiles with the same contents, so consumers can
+ * tell duplicates apart by address.
+ * put and get may be called from different threads, e.g. while fetched
+ * tiles are decoded. A pointer from get stays valid and unchanged, until
+ * its tile is put again or the store is cleared. Replacing or clearing a
+ * tile another thread still reads is up to the caller to avoid */
+class TileStore {
+public:
+	void put(const TileKey &key, const std::string &data);
+	// Get the encoded tile or NULL, if not present
+	const std::string* get(const TileKey &key) const;
+	size_t size() const;
+	// Number of distinct tile contents
+	size_t distinct() const;
+	// Drop all tiles
+	void clear();
+
+private:
+	std::map<TileKey, const std::string*> tiles;
+	// Distinct contents and the number of tiles referring to them
+	std::unordered_map<std::string, size_t> contents;
+	mutable std::mutex mtx;
+};
+
+#endif
@@ -0,0 +1,59 @@
+/* Bench.hpp
+ * Timing and reporting helpers of the benchmarks
+ *
+ * Results are printed as one JSON object per line, e.g.
+ *   {"benchmark":"decode","threads":1,"value":1520.3,"unit":"tiles/s"}
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#ifndef _OSMPNG_BENCH_HPP_
+#define _OSMPNG_BENCH_HPP_
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <chrono>
+
+
+typedef std::chrono::steady_clock bench_clock;
+
+// Call fn repeatedly for at least the given time and return the calls per second
+template<class F> double measure(F fn, double min_seconds = 0.5) {
+	// Warm up
+	fn();
+	bench_clock::time_point start = bench_clock::now();
+	int runs = 0;
+	double seconds = 0.0;
+	do {
+		fn();
+		runs++;
+		seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+	} while(seconds < min_seconds);
+	return (double)runs / seconds;
+}
+
+// A result line. Further fields are added with field(), the line is printed by value()
+class Report {
+public:
+	Report(const std::string &benchmark) {
+		line << "{\"benchmark\":\"" << benchmark << '"';
+	}
+	Report& field(const std::string &name, const std::string &value) {
+		line << ",\"" << name << "\":\"" << value << '"';
+		return *this;
+	}
+	Report& field(const std::string &name, double value) {
+		line << ",\"" << name << "\":" << value;
+		return *this;
+	}
+	void value(double value, const std::string &unit) {
+		line << ",\"value\":" << value << ",\"unit\":\"" << unit << "\"}";
+		std::cout << line.str() << std::endl;
+	}
+
+private:
+	std::stringstream line;
+};
+
+#endif
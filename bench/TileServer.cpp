@@ -0,0 +1,257 @@
+/* TileServer.cpp
+ * Local stand-in for a slippy map tile server, serving synthetic PNG tiles
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#include <sstream>
+#include <chrono>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+#include "TileServer.hpp"
+
+using namespace std;
+
+
+static void put_uint32(string &out, uint32_t value) {
+	out += (char)(value >> 24);
+	out += (char)(value >> 16);
+	out += (char)(value >> 8);
+	out += (char)value;
+}
+
+static void put_chunk(string &out, const char *type, const string &data) {
+	put_uint32(out, (uint32_t)data.size());
+	string chunk = string(type, 4) + data;
+	out += chunk;
+	put_uint32(out, (uint32_t)crc32(0, (const Bytef*)chunk.data(), chunk.size()));
+}
+
+/* Flat areas, a grid of streets and a diagonal road, roughly as
+ * large as a rendered map tile */
+string synthetic_tile(int x, int y, int zoom, int size) {
+	const unsigned char land[3] = { (unsigned char)(200 + (x * 7) % 40), (unsigned char)(220 + (y * 3) % 30), (unsigned char)(180 + zoom) };
+	string raw;
+	raw.reserve((size_t)(size * 3 + 1) * size);
+	for(int j = 0; j < size; j++) {
+		raw += (char)0;		// Filter type none
+		for(int i = 0; i < size; i++) {
+			const bool street = (i + x) % 64 < 3 || (j + y) % 64 < 3;
+			const bool road = abs(i - j) < 4;
+			for(int c = 0; c < 3; c++) {
+				if(road) raw += (char)(c == 2 ? 80 : 240);
+				else if(street) raw += (char)255;
+				else {
+					// Blocks of slightly varying color, like area fills and labels
+					const unsigned hash = (unsigned)((i / 4 + x * 64) * 73856093) ^ (unsigned)((j / 4 + y * 64) * 19349663);
+					raw += (char)(land[c] + ((hash >> (c * 3)) & 7));
+				}
+			}
+		}
+	}
+	uLongf len = compressBound(raw.size());
+	string compressed(len, '\0');
+	compress2((Bytef*)&compressed[0], &len, (const Bytef*)raw.data(), raw.size(), 6);
+	compressed.resize(len);
+
+	string png = "\x89PNG\r\n\x1a\n";
+	string ihdr;
+	put_uint32(ihdr, (uint32_t)size);
+	put_uint32(ihdr, (uint32_t)size);
+	ihdr += (char)8;	// Bit depth
+	ihdr += (char)2;	// RGB
+	ihdr += string(3, '\0');
+	put_chunk(png, "IHDR", ihdr);
+	put_chunk(png, "IDAT", compressed);
+	put_chunk(png, "IEND", "");
+	return png;
+}
+
+TileServer::TileServer(const TileServerOptions &options) : random(42) {
+	this->options = options;
+	this->listen_fd = -1;
+	this->bound_port = 0;
+	this->stopping = false;
+	this->tokens = options.rate_limit;
+	this->refilled = chrono::steady_clock::now();
+}
+
+TileServer::~TileServer() {
+	stop();
+}
+
+void TileServer::start() {
+	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(listen_fd < 0) throw string("Cannot create socket");
+	int one = 1;
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons((uint16_t)options.port);
+	if(::bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listen_fd, 128) != 0) {
+		close(listen_fd);
+		listen_fd = -1;
+		throw string("Cannot listen on port ") + to_string(options.port) + ": " + strerror(errno);
+	}
+	socklen_t addrlen = sizeof(addr);
+	getsockname(listen_fd, (sockaddr*)&addr, &addrlen);
+	bound_port = ntohs(addr.sin_port);
+	stopping = false;
+	acceptor = thread(&TileServer::accept_loop, this);
+}
+
+void TileServer::stop() {
+	if(listen_fd < 0) return;
+	stopping = true;
+	shutdown(listen_fd, SHUT_RDWR);
+	acceptor.join();
+	close(listen_fd);
+	listen_fd = -1;
+	{
+		lock_guard<std::mutex> lock(mtx);
+		for(size_t i = 0; i < clients.size(); i++) shutdown(clients[i], SHUT_RDWR);
+	}
+	for(size_t i = 0; i < handlers.size(); i++) handlers[i].join();
+	handlers.clear();
+	clients.clear();
+}
+
+string TileServer::url() const {
+	stringstream ss;
+	ss << "http://127.0.0.1:" << bound_port;
+	return ss.str();
+}
+
+TileServerStats TileServer::stats() {
+	lock_guard<std::mutex> lock(mtx);
+	return statistics;
+}
+
+void TileServer::accept_loop() {
+	while(!stopping) {
+		int fd = accept(listen_fd, NULL, NULL);
+		if(fd < 0) {
+			if(stopping || errno != EINTR) break;
+			continue;
+		}
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		lock_guard<std::mutex> lock(mtx);
+		statistics.connections++;
+		clients.push_back(fd);
+		handlers.push_back(thread(&TileServer::handle, this, fd));
+	}
+}
+
+int TileServer::next_status() {
+	lock_guard<std::mutex> lock(mtx);
+	statistics.requests++;
+	const double r = uniform_real_distribution<double>(0.0, 1.0)(random);
+	if(r < options.error_rate) {
+		statistics.errors++;
+		return 500;
+	}
+	if(r < options.error_rate + options.throttle_rate) {
+		statistics.throttled++;
+		return 429;
+	}
+	if(options.rate_limit > 0.0) {
+		chrono::steady_clock::time_point now = chrono::steady_clock::now();
+		tokens += chrono::duration<double>(now - refilled).count() * options.rate_limit;
+		tokens = min(tokens, options.rate_limit);
+		refilled = now;
+		if(tokens < 1.0) {
+			statistics.throttled++;
+			return 429;
+		}
+		tokens -= 1.0;
+	}
+	statistics.served++;
+	return 200;
+}
+
+const string& TileServer::tile(int x, int y, int zoom) {
+	stringstream ss;
+	ss << zoom << '/' << x << '/' << y;
+	lock_guard<std::mutex> lock(mtx);
+	map<string, string>::iterator it = tiles.find(ss.str());
+	if(it != tiles.end()) return it->second;
+	return tiles[ss.str()] = synthetic_tile(x, y, zoom, options.tile_size);
+}
+
+bool TileServer::send_all(int fd, const string &data, bool throttle) {
+	// With limited bandwidth the response is sent in 20 slices per second
+	const size_t slice = throttle && options.bandwidth > 0 ? max((size_t)options.bandwidth / 20, (size_t)1) : data.size();
+	size_t sent = 0;
+	while(sent < data.size()) {
+		const size_t len = min(slice, data.size() - sent);
+		ssize_t n = send(fd, data.data() + sent, len, MSG_NOSIGNAL);
+		if(n <= 0) return false;
+		sent += (size_t)n;
+		if(sent < data.size() && slice < data.size())
+			this_thread::sleep_for(chrono::milliseconds(50));
+	}
+	return true;
+}
+
+void TileServer::handle(int fd) {
+	string buffer;
+	char chunk[4096];
+	while(!stopping) {
+		size_t end = buffer.find("\r\n\r\n");
+		if(end == string::npos) {
+			ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+			if(n <= 0) break;
+			buffer.append(chunk, (size_t)n);
+			continue;
+		}
+		string request = buffer.substr(0, end);
+		buffer.erase(0, end + 4);
+		string lower = request;
+		transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+		const bool keep_alive = lower.find("connection: close") == string::npos;
+
+		if(options.latency > 0)
+			this_thread::sleep_for(chrono::milliseconds(options.latency));
+
+		int x, y, zoom;
+		int status = 404;
+		const string *body = NULL;
+		if(sscanf(request.c_str(), "GET /%d/%d/%d.png", &zoom, &x, &y) == 3) {
+			status = next_status();
+			if(status == 200) body = &tile(x, y, zoom);
+		}
+
+		stringstream header;
+		header << "HTTP/1.1 " << status << ' ';
+		switch(status) {
+		case 200: header << "OK"; break;
+		case 404: header << "Not Found"; break;
+		case 429: header << "Too Many Requests"; break;
+		default: header << "Internal Server Error"; break;
+		}
+		header << "\r\nContent-Length: " << (body == NULL ? 0 : body->size()) << "\r\n";
+		if(body != NULL) header << "Content-Type: image/png\r\nCache-Control: max-age=3600\r\n";
+		if(status == 429) header << "Retry-After: " << options.retry_after << "\r\n";
+		if(!keep_alive) header << "Connection: close\r\n";
+		header << "\r\n";
+
+		if(!send_all(fd, header.str(), false)) break;
+		if(body != NULL && !send_all(fd, *body, true)) break;
+		if(!keep_alive) break;
+	}
+	lock_guard<std::mutex> lock(mtx);
+	clients.erase(std::remove(clients.begin(), clients.end(), fd), clients.end());
+	close(fd);
+}
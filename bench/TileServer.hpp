@@ -0,0 +1,88 @@
+/* TileServer.hpp
+ * Local stand-in for a slippy map tile server, serving synthetic PNG tiles
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#ifndef _OSMPNG_TILESERVER_HPP_
+#define _OSMPNG_TILESERVER_HPP_
+
+#include <string>
+#include <map>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <random>
+
+
+// Tile server settings
+struct TileServerOptions {
+	int port;				// TCP port on 127.0.0.1, 0 for any free port
+	int latency;			// Delay before every response in milliseconds
+	long bandwidth;			// Bytes per second and connection, 0 for unlimited
+	double error_rate;		// Fraction of requests failing with 500
+	double throttle_rate;	// Fraction of requests rejected with 429
+	double rate_limit;		// Requests per second, more are rejected with 429. 0 for unlimited
+	int retry_after;		// Retry-After seconds of 429 responses
+	int tile_size;			// Width and height of the tiles
+	TileServerOptions() : port(0), latency(0), bandwidth(0), error_rate(0.0),
+		throttle_rate(0.0), rate_limit(0.0), retry_after(1), tile_size(256) {}
+};
+
+// Request counters
+struct TileServerStats {
+	size_t requests;
+	size_t served;			// 200 responses
+	size_t errors;			// 500 responses
+	size_t throttled;		// 429 responses
+	size_t connections;
+	TileServerStats() : requests(0), served(0), errors(0), throttled(0), connections(0) {}
+};
+
+// Synthetic RGB PNG tile for the given coordinates
+std::string synthetic_tile(int x, int y, int zoom, int size = 256);
+
+/* HTTP/1.1 server answering GET /zoom/x/y.png with keep-alive, one thread
+ * per connection. Errors and throttling are injected at random, with a fixed
+ * seed so that runs are reproducible */
+class TileServer {
+public:
+	TileServer(const TileServerOptions &options = TileServerOptions());
+	virtual ~TileServer();
+	// Start listening. Throws a string on error
+	void start();
+	// Close all connections and wait for the threads
+	void stop();
+	// Port the server listens on
+	int port() const { return bound_port; }
+	// Base URL for --source
+	std::string url() const;
+	TileServerStats stats();
+
+private:
+	TileServerOptions options;
+	int listen_fd;
+	int bound_port;
+	std::atomic<bool> stopping;
+	std::thread acceptor;
+	std::vector<std::thread> handlers;
+	std::vector<int> clients;
+	std::mutex mtx;
+	std::mt19937 random;
+	TileServerStats statistics;
+	// Token bucket of the rate limit, holding up to one second of requests
+	double tokens;
+	std::chrono::steady_clock::time_point refilled;
+	std::map<std::string, std::string> tiles;	// Encoded tiles by path
+
+	void accept_loop();
+	void handle(int fd);
+	// Status code for the next request
+	int next_status();
+	const std::string& tile(int x, int y, int zoom);
+	bool send_all(int fd, const std::string &data, bool throttle);
+};
+
+#endif
@@ -0,0 +1,71 @@
+/* convert_bench.cpp
+ * Microbenchmark for the pixel conversion kernels
+ *
+ * Reports the throughput of every kernel supported by this CPU in
+ * megapixels per second and checks, that all kernels produce the same
+ * output as the scalar reference.
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#include <vector>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../Convert.hpp"
+#include "Bench.hpp"
+
+using namespace std;
+
+// Pixels per conversion call, as in a 256 pixel wide tile row
+static const size_t ROW = 256;
+// Rows per measurement
+static const size_t ROWS = 256 * 64;
+
+int main() {
+	srand(42);
+	vector<uint8_t> index(ROW * ROWS), rgba(ROW * ROWS * 4);
+	for(size_t i = 0; i < index.size(); i++) index[i] = (uint8_t)rand();
+	for(size_t i = 0; i < rgba.size(); i++) rgba[i] = (uint8_t)rand();
+	// Rows of twice the width for downsampling
+	vector<uint8_t> wide((ROWS + 1) * ROW * 6);
+	for(size_t i = 0; i < wide.size(); i++) wide[i] = (uint8_t)rand();
+	uint32_t palette[256];
+	for(int i = 0; i < 256; i++) palette[i] = (uint32_t)rand();
+	const uint8_t background[3] = { 0xf2, 0xef, 0xe9 };
+
+	vector<uint8_t> reference[4];
+	vector<uint8_t> out(ROW * ROWS * 3);
+	const char *names[] = { "scalar", "sse2", "avx2" };
+	const char *ops[] = { "palette_to_rgb", "rgba_to_rgb", "rgba_blend_rgb", "downsample_rgb" };
+	int errors = 0;
+
+	for(int k = 0; k < 3; k++) {
+		const ConvertKernels *kernels = convert_kernels(names[k]);
+		if(kernels == NULL) continue;
+
+		for(int op = 0; op < 4; op++) {
+			double runs = measure([&]() {
+				for(size_t r = 0; r < ROWS; r++) {
+					uint8_t *dst = &out[r * ROW * 3];
+					switch(op) {
+					case 0: kernels->palette_to_rgb(&index[r * ROW], palette, dst, ROW); break;
+					case 1: kernels->rgba_to_rgb(&rgba[r * ROW * 4], dst, ROW); break;
+					case 2: kernels->rgba_blend_rgb(&rgba[r * ROW * 4], background, dst, ROW); break;
+					default: kernels->downsample_rgb(&wide[r * ROW * 6], &wide[(r + 1) * ROW * 6], dst, ROW); break;
+					}
+				}
+			});
+			Report("convert").field("kernel", kernels->name).field("operation", ops[op])
+				.field("selected", kernels == &convert_kernels() ? 1 : 0)
+				.value(runs * ROW * ROWS / 1e6, "Mpixel/s");
+
+			if(k == 0) reference[op] = out;
+			else if(out != reference[op]) {
+				cerr << kernels->name << ' ' << ops[op] << " differs from scalar kernel" << endl;
+				errors++;
+			}
+		}
+	}
+	return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
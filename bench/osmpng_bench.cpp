@@ -0,0 +1,195 @@
+/* osmpng_bench.cpp
+ * Benchmarks of the osmpng stages: tile projection, decode, merge, encode
+ * and fetching from a local mock tile server
+ *
+ * Results are reported as JSON lines (see Bench.hpp), so that they can be
+ * compared between versions. Benchmarks can be selected by name:
+ *   bench/osmpng_bench [projection] [decode] [merge] [encode] [fetch]
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#include <vector>
+#include <set>
+#include <string>
+#include <thread>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <curl/curl.h>
+#include "../Projection.hpp"
+#include "../Png.hpp"
+#include "../Image.hpp"
+#include "../Merge.hpp"
+#include "../Fetcher.hpp"
+#include "../TileStore.hpp"
+#include "../ThreadPool.hpp"
+#include "TileServer.hpp"
+#include "Bench.hpp"
+
+using namespace std;
+
+// Tile area of the merge benchmark
+static const int MERGE_TILES = 8;
+// Image size of the encode benchmark
+static const size_t ENCODE_SIZE = 2048;
+// Tiles per fetch scenario
+static const int FETCH_TILES = 10;
+
+
+static void bench_projection() {
+	const int CALLS = 1 << 16;
+	volatile REAL sink = 0;
+	double runs = measure([&]() {
+		REAL sum = 0;
+		for(int i = 0; i < CALLS; i++) {
+			const REAL f = (REAL)i / CALLS;
+			sum += getTileX(f * 360.0 - 180.0, 16384) + getTileY(f * 170.0 - 85.0, 16384);
+		}
+		sink = sink + sum;
+	});
+	Report("projection").value(runs * CALLS / 1e6, "Mcalls/s");
+}
+
+static void bench_decode() {
+	const string tile = synthetic_tile(1, 2, 3);
+	size_t width, height;
+	png_dimensions(tile, width, height);
+	vector<unsigned char> rgb(width * height * 3);
+	double runs = measure([&]() {
+		decode_png((const unsigned char*)tile.data(), tile.size(), &rgb[0], width * 3, width, height);
+	});
+	Report("decode").value(runs, "tiles/s");
+}
+
+// Merge with the decoded tiles in a slab, if slab_file is not NULL
+static void bench_merge(int threads, const char *slab_file = NULL) {
+	TileStore tiles;
+	for(int x = 0; x < MERGE_TILES; x++)
+		for(int y = 0; y < MERGE_TILES; y++)
+			tiles.put(TileKey(x, y, 10), synthetic_tile(x, y, 10));
+	const int bounds[4] = { 0, MERGE_TILES - 1, 0, MERGE_TILES - 1 };
+	ThreadPool pool(threads);
+	SlabCache *slab = NULL;
+	if(slab_file != NULL) {
+		remove(slab_file);
+		slab = new SlabCache(slab_file, MERGE_TILES * MERGE_TILES * 256 * 256 * 3);
+	}
+	double runs = measure([&]() {
+		merge_tiles(tiles, bounds, 10, "/dev/null", PngOptions(), NULL, pool, NULL, NULL, slab);
+	}, 1.0);
+	Report("merge").field("threads", pool.size()).field("decoded_cache", slab != NULL ? "slab" : "none")
+		.value(runs * MERGE_TILES * MERGE_TILES * 256 * 256 / 1e6, "Mpixel/s");
+	if(slab != NULL) {
+		delete slab;
+		remove(slab_file);
+	}
+}
+
+static void bench_encode(const string &name, int threads) {
+	ImageFormat format;
+	if(!parse_image_format(name, format)) throw "Unknown format " + name;
+	// Map like content: flat areas with some structure
+	vector<unsigned char> image(ENCODE_SIZE * ENCODE_SIZE * 3);
+	for(size_t j = 0; j < ENCODE_SIZE; j++)
+		for(size_t i = 0; i < ENCODE_SIZE * 3; i++)
+			image[j * ENCODE_SIZE * 3 + i] = (unsigned char)(((i / 3) % 64 < 3 || j % 64 < 3) ? 255 : 200 + ((i + j) & 7));
+	ThreadPool pool(threads);
+	double runs = measure([&]() {
+		ImageWriter *writer = open_image(format, "/dev/null", ENCODE_SIZE, ENCODE_SIZE, PngOptions(), &pool);
+		for(size_t j = 0; j < ENCODE_SIZE; j += 256)
+			writer->write_rows(&image[j * ENCODE_SIZE * 3], 256);
+		writer->finish();
+		delete writer;
+	}, 1.0);
+	Report("encode").field("format", name).field("threads", pool.size()).value(runs * ENCODE_SIZE * ENCODE_SIZE / 1e6, "Mpixel/s");
+}
+
+// Fetch FETCH_TILES x FETCH_TILES tiles from a mock server
+static void bench_fetch(const string &scenario, const TileServerOptions &serverOptions, int jobs) {
+	TileServer server(serverOptions);
+	server.start();
+	FetchOptions options;
+	options.jobs = jobs;
+	options.rate = 0.0;
+	options.sources.push_back(server.url());
+	Fetcher fetcher(options);
+	for(int x = 0; x < FETCH_TILES; x++)
+		for(int y = 0; y < FETCH_TILES; y++)
+			fetcher.add(x, y, 12);
+	size_t ok = 0, bytes = 0;
+	bench_clock::time_point start = bench_clock::now();
+	fetcher.run([&](const TileResult &result) {
+		if(result.ok) {
+			ok++;
+			bytes += result.size;
+		}
+	});
+	const double seconds = chrono::duration<double>(bench_clock::now() - start).count();
+	server.stop();
+	const FetchStats &stats = fetcher.stats();
+	Report("fetch").field("scenario", scenario).field("jobs", jobs)
+		.field("failed", FETCH_TILES * FETCH_TILES - (double)ok)
+		.field("connections", stats.connections)
+		.field("retries", stats.retries)
+		.field("MB/s", bytes / seconds / 1e6)
+		.value(ok / seconds, "tiles/s");
+}
+
+static void bench_fetch() {
+	TileServerOptions options;
+	bench_fetch("local", options, 8);
+	options.latency = 20;
+	bench_fetch("latency_20ms", options, 2);
+	bench_fetch("latency_20ms", options, 8);
+	options.latency = 0;
+	options.bandwidth = 200 * 1024;
+	bench_fetch("bandwidth_200k", options, 8);
+	options.bandwidth = 0;
+	options.error_rate = 0.05;
+	options.throttle_rate = 0.05;
+	bench_fetch("errors_5pct_throttled_5pct", options, 8);
+	options.error_rate = 0.0;
+	options.throttle_rate = 0.0;
+	options.rate_limit = 50;
+	options.retry_after = 0;
+	bench_fetch("rate_limited_50rps", options, 8);
+}
+
+int main(int argc, char** argv) {
+	set<string> selected(argv + 1, argv + argc);
+	#define SELECTED(name) (selected.empty() || selected.count(name) > 0)
+
+	try {
+		if(SELECTED("projection")) bench_projection();
+		if(SELECTED("decode")) bench_decode();
+		// Single threaded and with one thread per core
+		const bool multicore = thread::hardware_concurrency() > 1;
+		if(SELECTED("merge")) {
+			bench_merge(1);
+			if(multicore) bench_merge(0);
+			bench_merge(1, "bench/merge.slab");
+			if(multicore) bench_merge(0, "bench/merge.slab");
+		}
+		if(SELECTED("encode")) {
+			bench_encode("png", 1);
+			if(multicore) bench_encode("png", 0);
+			// The other formats are written by the calling thread
+			bench_encode("ppm", 1);
+			bench_encode("raw", 1);
+			bench_encode("qoi", 1);
+		}
+		if(SELECTED("fetch")) {
+			curl_global_init(CURL_GLOBAL_DEFAULT);
+			bench_fetch();
+			curl_global_cleanup();
+		}
+	} catch (string &msg) {
+		cerr << msg << endl;
+		return EXIT_FAILURE;
+	} catch (const char *msg) {
+		cerr << msg << endl;
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
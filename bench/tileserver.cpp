@@ -0,0 +1,85 @@
+/* tileserver.cpp
+ * Standalone mock tile server for testing and benchmarking osmpng
+ *
+ *   bench/tileserver --port 8080 --latency 50 --throttle 0.05 &
+ *   osmpng --source http://127.0.0.1:8080 ...
+ *
+ * Licensed under the conditions of GPLv3
+ */
+
+#include <iostream>
+#include <string>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "TileServer.hpp"
+
+using namespace std;
+
+
+static volatile sig_atomic_t running = 1;
+
+static void signal_function(int) {
+	running = 0;
+}
+
+static void printHelp(const char *progname) {
+	cout << "Usage: " << progname << " [OPTIONS]" << endl << endl <<
+		"OPTIONS" << endl <<
+		"\t--port PORT              Port on 127.0.0.1 (default: 8080)" << endl <<
+		"\t--latency MS             Delay before every response" << endl <<
+		"\t--bandwidth BYTES        Bytes per second and connection (default: unlimited)" << endl <<
+		"\t--errors FRACTION        Fraction of requests failing with 500" << endl <<
+		"\t--throttle FRACTION      Fraction of requests rejected with 429" << endl <<
+		"\t--rate-limit R           Max. requests per second, more are rejected with 429" << endl <<
+		"\t--retry-after SECONDS    Retry-After of 429 responses (default: 1)" << endl <<
+		"\t--tile-size N            Tile width and height (default: 256)" << endl;
+}
+
+int main(int argc, char** argv) {
+	TileServerOptions options;
+	options.port = 8080;
+	for(int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		if(arg == "--help" || arg == "-h") {
+			printHelp(argv[0]);
+			return EXIT_SUCCESS;
+		}
+		if(i + 1 >= argc) {
+			cerr << "Missing value for " << arg << endl;
+			return EXIT_FAILURE;
+		}
+		const char *value = argv[++i];
+		if(arg == "--port") options.port = atoi(value);
+		else if(arg == "--latency") options.latency = atoi(value);
+		else if(arg == "--bandwidth") options.bandwidth = atol(value);
+		else if(arg == "--errors") options.error_rate = atof(value);
+		else if(arg == "--throttle") options.throttle_rate = atof(value);
+		else if(arg == "--rate-limit") options.rate_limit = atof(value);
+		else if(arg == "--retry-after") options.retry_after = atoi(value);
+		else if(arg == "--tile-size") options.tile_size = atoi(value);
+		else {
+			cerr << "Illegal argument: " << arg << endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	signal(SIGINT, signal_function);
+	signal(SIGTERM, signal_function);
+	TileServer server(options);
+	try {
+		server.start();
+	} catch (string &msg) {
+		cerr << msg << endl;
+		return EXIT_FAILURE;
+	}
+	cout << "Serving tiles at " << server.url() << endl;
+	while(running) pause();
+
+	server.stop();
+	TileServerStats stats = server.stats();
+	cout << stats.requests << " requests, " << stats.served << " served, " << stats.errors << " errors, "
+		<< stats.throttled << " throttled, " << stats.connections << " connections" << endl;
+	return EXIT_SUCCESS;
+}
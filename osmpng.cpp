@@ -9,8 +9,10 @@
 
 #include <dirent.h>
 #include <iostream>
+#include <fstream>
 #include <string>
 #include <vector>
+#include <set>
 #include <stdlib.h>
 #include <sstream>
 #include <signal.h>
@@ -19,11 +21,25 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/timeb.h>
+#include <thread>
+#include <mutex>
 
 #include <curl/curl.h>
-#include <png++/png.hpp>
-
 #include "String.hpp"
+#include "Fetcher.hpp"
+#include "Png.hpp"
+#include "Image.hpp"
+#include "TileStore.hpp"
+#include "ThreadPool.hpp"
+#include "Projection.hpp"
+#include "Merge.hpp"
+#include "Metrics.hpp"
+#include "Pyramid.hpp"
+#include "Journal.hpp"
+#include "SlabCache.hpp"
+#include "Queue.hpp"
+#include "Server.hpp"
+#include "MapService.hpp"
 
 
 using namespace std;
@@ -31,31 +47,65 @@ using namespace std;
 // VERSION
 #define VERSION "0.3 JUL 2015"
 
-// Use float or double precision
-#define REAL float
-
 // Makro for printing stuff only when not quiet
 #define COUT if(!quiet) cout
 
+// Tile rows buffered between downloading and merging
+#define PIPELINE_DEPTH 8
+
+// Largest map served in server mode, in tiles
+#define SERVE_MAX_TILES 4096
+
 
 
 /* ==== GLOBAL PROGRAM VARIABLES ============================================ */
 
-// Rectangle to be downloaded
-static REAL bounds[4];
 // True if we should be quiet
 static bool quiet = false;
 // Cache directory
 static String cacheDir = "/tmp/.osmpng_cache";
-// Destination file
+// Destination file, "-" for stdout
 static String destFile = "output.png";
-// If cached files should be deleted
+// Image format of --format, otherwise by the extension of the destination
+static bool formatGiven = false;
+static ImageFormat imageFormat = FORMAT_PNG;
+// Job file for batch mode
+static String batchFile;
+// Listen address of the server mode, see HttpServer
+static String serveAddress;
+// Metrics file, JSON or Prometheus text (.prom)
+static String metricsFile;
+// If downloaded tiles should not be kept in the cache directory
 static bool deleteCached = true;
+// Reuse the tiles journaled by an interrupted run
+static bool resume = false;
+// Download, merge and encoder settings
+static MapOptions options;
+// Lowest zoom level to synthesize from the tiles of a job, -1 for none
+static int pyramidZoom = -1;
+// Files whose shapes define the area instead of LONGITUDE and LATITUDE
+static String geojsonFile, gpxFile;
+// Corridor around lines, tracks and points in meters to each side
+static REAL bufferMeters = 1000.0;
 
 /* ==== INTERNAL PROGRAM VARIABLES ========================================== */
 
-// Cached files
-static vector<string> files;
+// A map to be produced
+struct Job : MapArea {
+	// Destination file
+	std::string output;
+};
+
+// Downloaded tiles
+static TileStore tiles;
+// Running server, stopped by SIGINT and SIGTERM
+static HttpServer *server = NULL;
+// Set by SIGINT and SIGTERM once threads are running, the run then stops and
+// cleans up. fetching is the provider of a fetch in progress, it is cancelled
+static volatile sig_atomic_t started = 0, cancelled = 0;
+static TileProvider *fetching = NULL;
+// Timings and counters of this run
+static Metrics metrics;
 
 // Get milliseconds since epoch
 static unsigned long get_millis() {
@@ -64,15 +114,9 @@ static unsigned long get_millis() {
 	return tb.millitm + (tb.time & 0xfffff) * 1000L;
 }
 
-// Get slippy map tile coordinates
-/* See http://wiki.openstreetmap.org/wiki/Slippy_map_tilenames for details */
-REAL getTileY(REAL latitude, REAL n) {
-	REAL rad_lat = latitude * M_PI / 180.0;
-	REAL sec = 1.0/cos(rad_lat);
-	return n * (1.0 - (log(tan(rad_lat) + sec) / M_PI)) / 2.0;
-}
-REAL getTileX(REAL longitude, REAL n) {
-	return n * ((longitude + 180.0) / 360.0);
+// Image format of a destination file
+static ImageFormat output_format(const std::string &output) {
+	return formatGiven ? imageFormat : image_format(output);
 }
 
 inline REAL toReal(std::string str) { return atof(str.c_str()); }
@@ -88,13 +132,6 @@ REAL fround(const REAL f, const int precision) {
 inline REAL fround(const REAL f) { return fround(f,2); }
 
 
-static void clear_cached_files() {
-	for(vector<string>::iterator it = files.begin(); it != files.end(); it++) {
-		std::string file = *it;
-		remove(file.c_str());
-	}
-}
-
 static void printHeader() {
 	if(quiet) return;
 	else {
@@ -116,88 +153,6 @@ static inline bool dir_exists(string name) {
 		return false;
 }
 
-// Get file size in bytes
-static size_t get_file_size(std::string filename)
-{
-    struct stat stat_buf;
-    int rc = stat(filename.c_str(), &stat_buf);
-    return rc == 0 ? stat_buf.st_size : -1;
-}
-
-
-// Callback for receiving http data
-static size_t write_http(void *ptr, size_t size, size_t nmemb, FILE *stream) {
-    return fwrite(ptr, size, nmemb, stream);
-}
-
-// Download a slippy map tile to a given destination file
-size_t download(int tileX, int tileY, int zoom, string file) {
-	stringstream ss;
-	static int i = 0;
-	switch(i++) {
-	case 0:
-		ss << "http://a.tile.openstreetmap.org/";
-		break;
-	case 1:
-		ss << "http://b.tile.openstreetmap.org/";
-		break;
-	default:
-		ss << "http://c.tile.openstreetmap.org/";
-		i = 0;
-		break;
-	}
-	ss << zoom << '/' << tileX << '/' << tileY << ".png";
-	String url = ss.str();
-	
-	CURL *curl;
-	CURLcode code;
-	curl = curl_easy_init();
-	if (curl) {
-		FILE *fp = fopen(file.c_str(), "wb");
-		curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_http);
-		curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
-		// Allow max. 10 redirections
-		// curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 10L);
-		
-		code = curl_easy_perform(curl);
-		curl_easy_cleanup(curl);
-        fclose(fp);
-        
-        if(code != CURLE_OK) {
-    	    ss.str(std::string());
-	        ss << "CURL returned error code" << code << ".";
-	        throw ss.str();
-        }
-        
-        // Check response code
-        long response_code;
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-        if (response_code != 200) {
-	        if (response_code == 429) {
-    	    	throw "Too many requests";
-    	    }
-    	    cerr << "http respose code " << response_code << endl;
-    	    throw "Invalid http response code";
-    	}
-        
-        return get_file_size(file);
-		
-	} else
-		throw "Error setting up curl";
-}
-
-// Create standartized cache filename
-std::string get_filename(int x, int y, int zoom) {
-	stringstream ss;
-	
-	ss << cacheDir;
-	if(!cacheDir.endsWith('/')) ss << '/';
-	ss << zoom << '-' << x << '.' << y << ".png";
-	return ss.str();
-}
-
-
 // Header message, when an error occurred
 static void error_help_msg() {
 	cerr << "A terrible error happend. Please consider in reporting a bug to "
@@ -216,73 +171,22 @@ static void signal_function(int sig_nr) {
 		exit(101);
 	case SIGINT:
         case SIGTERM:
-		cerr << "Caught cancel signal. Cleaning up ... ";
-		cerr.flush();
-		if(deleteCached) clear_cached_files();
-		cerr << "done" << endl;
-		exit(42);
-	}
-}
-
-// Merge routine to merge different PNG files.
-// Writes the result to the given destination filename
-static void merge(int* bounds, int zoom, std::string destination) {
-	size_t width, height;
-	size_t total_width, total_height;
-	std::string file = get_filename(bounds[0],bounds[2], zoom);
-	try {
-		png::image<png::rgb_pixel> source(file.c_str());
-		width = source.get_width();
-		height = source.get_height();
-		
-		total_width = width * (bounds[1]-bounds[0]+1);
-		total_height = height * (bounds[3]-bounds[2]+1);
-	} catch (png::error &e) {
-		cerr << "png error while processing " << file << ": " << e.what() << endl;
-		return;
-	}
-	
-	// cout << "Creating picture (" << total_width << "x" << total_height << ") ... " << endl;
-	
-	png::image<png::rgb_pixel> image(total_width, total_height);
-	size_t offset[2];
-	offset[0] = 0;
-	offset[1] = 0;
-	int index[2];
-	for(int x = bounds[0]; x<=bounds[1]; x++) {
-		index[0] = x - bounds[0];
-		offset[0]++;
-		offset[1]=0;
-		for(int y = bounds[2]; y<=bounds[3]; y++) {
-			size_t base[2];
-			index[1] = y - bounds[2];
-
-			file = get_filename(x,y, zoom);
-			png::image<png::rgb_pixel> source(file.c_str());
-			size_t c_width, c_height;
-			c_width = source.get_width();
-			c_height = source.get_height();
-			if (c_width != width) throw "Width of tile mismatch";
-			if (c_height != height) throw "Width of tile mismatch";
-			
-			// Copy image pixels
-			base[0] = width * ( index[0] );
-			base[1] = height * ( index[1] );
-
-			// Copy pixel data
-			for(size_t p_x = 0; p_x < c_width; p_x++) {
-				for(size_t p_y = 0; p_y < c_height; p_y++) {
-					image.set_pixel(p_x + base[0],p_y + base[1],source.get_pixel(p_x,p_y));
-				}
-			}
-
-
-			offset[1]++;
+		if(server != NULL) {
+			// Finish the requests in progress and shut down
+			server->stop();
+			return;
 		}
+		// Nothing to clean up yet, or the second signal: leave at once
+		if(!started || cancelled) {
+			// Only async-signal-safe calls here
+			static const char message[] = "Caught cancel signal\n";
+			ssize_t written = write(STDERR_FILENO, message, sizeof(message) - 1);
+			(void)written;
+			_exit(42);
+		}
+		cancelled = 1;
+		if(fetching != NULL) fetching->cancel();
 	}
-	
-	// cout << "Writing destination file ... " << endl;
-	image.write(destination.c_str());
 }
 
 // Print help message
@@ -296,11 +200,54 @@ static void printHelp(char* progname) {
 			"\t-version                 Print program version" << endl <<
 			"\t--cache=CACHE" << endl <<
 			"\t-c CACHE                 Define cache directory" << endl;
-	cout << "\t-o OUTPUT                Define output file" << endl <<
+	cout << "\t--batch FILE             Process all jobs of FILE, one per line:" << endl <<
+			"\t                         LONGITUDE LATITUDE ZOOM OUTPUT" << endl;
+	cout << "\t--geojson FILE           Fetch only the tiles intersecting the polygons, lines" << endl <<
+			"\t                         and points of a GeoJSON file" << endl <<
+			"\t--gpx FILE               Fetch only the tiles along the tracks of a GPX file" << endl <<
+			"\t--buffer METERS          Corridor around lines, tracks and points to each side" << endl <<
+			"\t                         (default: 1000)" << endl;
+	cout << "\t-o OUTPUT                Define output file, - for stdout. Files ending in" << endl <<
+			"\t                         .pmtiles become a PMTiles archive of the tiles" << endl <<
+			"\t--format FORMAT          Image format: png, ppm, raw or qoi (default: by the" << endl <<
+			"\t                         extension of OUTPUT, .png otherwise)" << endl <<
 			"\t--keep-cache" << endl <<
-			"\t-k                       Do not delete cached files after download" << endl;
+			"\t-k                       Keep downloaded tiles in the cache directory" << endl <<
+			"\t--cache-max-size MB      Keep downloaded tiles, but at most MB MiB of them. The" << endl <<
+			"\t                         least recently used tiles are evicted. Implies -k" << endl <<
+			"\t--resume                 Continue an interrupted run, verified tiles of the" << endl <<
+			"\t                         cache journal are not fetched again. Implies -k" << endl <<
+			"\t--jobs N" << endl <<
+			"\t-j N                     Number of concurrent downloads (default: 2)" << endl <<
+			"\t--rate R                 Max. requests per second and host (default: 1, 0 = unlimited)" << endl <<
+			"\t                         Throttled hosts are slowed down below that" << endl <<
+			"\t--retries N              Retries per tile after throttling or transient errors" << endl <<
+			"\t                         (default: 4)" << endl <<
+			"\t--source URL             Tile server base URL or template with {z}, {x}, {y}" << endl <<
+			"\t                         and {s} or {s:a,b,c} for subdomains. file:// reads" << endl <<
+			"\t                         local tiles. May be given multiple times for mirrors" << endl <<
+			"\t                         (default: the OpenStreetMap tile servers)" << endl <<
+			"\t--http2                  Use HTTP/2 and multiplex requests per host" << endl <<
+			"\t--serve ADDRESS          Serve maps over HTTP on PORT, HOST:PORT or unix:PATH" << endl <<
+			"\t                         at /map?bbox=WEST,SOUTH,EAST,NORTH&zoom=Z&format=png" << endl <<
+			"\t                         (or pmtiles, ppm, raw, qoi)" << endl <<
+			"\t                         Tiles are always kept in the cache directory" << endl <<
+			"\t--metrics FILE           Write timings and transfer metrics to FILE as JSON," << endl <<
+			"\t                         or in Prometheus text format if FILE ends in .prom" << endl <<
+			"\t--threads N" << endl <<
+			"\t-t N                     Number of threads for merging (default: one per core)" << endl <<
+			"\t--decoded-cache MB       Keep up to MB MiB of decoded tiles in the cache directory" << endl <<
+			"\t                         for faster merges (default: 0, disabled)" << endl <<
+			"\t--pyramid MINZOOM        Also produce the zoom levels MINZOOM up to ZOOM-1," << endl <<
+			"\t                         computed from the tiles of ZOOM" << endl <<
+			"\t--whole-tiles            Do not crop the image to the requested area" << endl <<
+			"\t--background RRGGBB      Composite transparent tiles onto this color" << endl <<
+			"\t--compression N          PNG compression level 0-9 (default: 6)" << endl <<
+			"\t--filter FILTER          PNG row filter: none, sub, up, average, paeth" << endl <<
+			"\t                         or adaptive (default)" << endl;
 	cout << endl;
 	cout << "If the destination is given, LONGITUDE LATITUDE and ZOOM must be defined" << endl;
+	cout << "With --geojson or --gpx only ZOOM is given, tiles outside of the shapes stay blank" << endl;
 }
 
 
@@ -340,6 +287,97 @@ static string speedHumandReadable(double speed) {
 	return ss.str();
 }
 
+// Output file of a pyramid level: The zoom level is inserted before the extension
+static std::string level_output(const std::string &output, int zoom) {
+	const size_t dot = output.find_last_of('.');
+	const size_t slash = output.find_last_of('/');
+	stringstream ss;
+	if(dot == string::npos || (slash != string::npos && dot < slash))
+		ss << output << '-' << zoom;
+	else
+		ss << output.substr(0, dot) << '-' << zoom << output.substr(dot);
+	return ss.str();
+}
+
+// Read the shapes of the --geojson and --gpx files and calculate the tiles they cover
+static Status parse_shapes(String szoom, Job &job) {
+	Geometry geometry;
+	try {
+		if(!geojsonFile.isEmpty()) geometry.add(read_geojson(geojsonFile));
+		if(!gpxFile.isEmpty()) geometry.add(read_gpx(gpxFile));
+	} catch (string &msg) {
+		return Status(OSMPNG_INVALID_ARGUMENT, msg);
+	} catch (const char *msg) {
+		return Status(OSMPNG_INVALID_ARGUMENT, msg);
+	}
+	return MapArea::from_geometry(geometry, toInt(szoom), bufferMeters, job);
+}
+
+// Parse LONGITUDE LATITUDE ZOOM of a job and calculate the tile coordinates
+static Status parse_job(String slon, String slat, String szoom, Job &job) {
+	REAL bounds[4];
+	if(slon.contains("-")) {
+		std::vector<String> vec = slon.split('-');
+		bounds[0] = toReal(vec[0].trim());
+		bounds[1] = toReal(vec[1].trim());
+	} else {
+		bounds[0] = toReal(slon);
+		bounds[1] = bounds[0];
+	}
+	if(slat.contains("-")) {
+		std::vector<String> vec = slat.split('-');
+		bounds[2] = toReal(vec[0].trim());
+		bounds[3] = toReal(vec[1].trim());
+	} else {
+		bounds[2] = toReal(slat);
+		bounds[3] = bounds[2];
+	}
+	return MapArea::from_degrees(bounds[0], bounds[1], bounds[2], bounds[3], toInt(szoom), job);
+}
+
+/* Read the jobs of a batch file. Each line holds LONGITUDE LATITUDE ZOOM OUTPUT,
+ * empty lines and lines starting with '#' are ignored */
+static bool read_batch(const std::string &filename, std::vector<Job> &jobs) {
+	ifstream in(filename.c_str());
+	if(!in.is_open()) {
+		cerr << "Cannot open batch file " << filename << endl;
+		return false;
+	}
+	std::string line;
+	int lineno = 0;
+	while(getline(in, line)) {
+		lineno++;
+		String trimmed = String(line).trim();
+		if(trimmed.isEmpty() || trimmed.startsWith('#')) continue;
+		
+		stringstream ss(trimmed);
+		std::string slon, slat, szoom, output;
+		if(!(ss >> slon >> slat >> szoom >> output)) {
+			cerr << filename << ":" << lineno << ": Expected LONGITUDE LATITUDE ZOOM OUTPUT" << endl;
+			return false;
+		}
+		Job job;
+		Status status = parse_job(slon, slat, szoom, job);
+		if(!status.ok()) {
+			cerr << filename << ":" << lineno << ": Bounds invalid (" << status.message << ")" << endl;
+			return false;
+		}
+		job.output = output;
+		jobs.push_back(job);
+	}
+	return true;
+}
+
+// Write the metrics file, if requested
+static void write_metrics() {
+	if(metricsFile.isEmpty()) return;
+	try {
+		metrics.write(metricsFile);
+	} catch (string &msg) {
+		cerr << msg << endl;
+	}
+}
+
 static void _mkdir(const char *dir) {
 	char tmp[1024];
 	char *p = NULL;
@@ -358,13 +396,137 @@ static void _mkdir(const char *dir) {
 	mkdir(tmp, S_IRWXU);
 }
 
+/* ==== SERVER MODE ========================================================= */
+
+/* GET /map?bbox=WEST,SOUTH,EAST,NORTH&zoom=ZOOM[&format=png|pmtiles|ppm|raw|qoi]
+ * Tiles are taken from the cache, only missing and stale ones are fetched */
+static void serve_map(MapService &service, const HttpRequest &request, HttpResponse &response) {
+	static const struct {
+		const char *name;
+		MapFormat format;
+		const char *type;
+	} formats[] = {
+		{ "png", MAP_PNG, "image/png" },
+		{ "pmtiles", MAP_PMTILES, "application/vnd.pmtiles" },
+		{ "ppm", MAP_PPM, "image/x-portable-pixmap" },
+		{ "raw", MAP_RAW, "application/octet-stream" },
+		{ "qoi", MAP_QOI, "image/qoi" }
+	};
+	const std::string format = request.param("format", "png");
+	std::vector<String> bbox = String(request.param("bbox")).split(',');
+	if(bbox.size() != 4 || request.param("zoom").empty()) {
+		response.status = 400;
+		response.body = "Expected bbox=WEST,SOUTH,EAST,NORTH and zoom=ZOOM\n";
+		return;
+	}
+	size_t f = 0;
+	while(f < sizeof(formats) / sizeof(formats[0]) && format != formats[f].name) f++;
+	if(f == sizeof(formats) / sizeof(formats[0])) {
+		response.status = 400;
+		response.body = "Unknown format " + format + ", expected png, pmtiles, ppm, raw or qoi\n";
+		return;
+	}
+	MapArea area;
+	Status status = MapArea::from_degrees(toReal(bbox[0]), toReal(bbox[2]), toReal(bbox[1]), toReal(bbox[3]),
+		toInt(request.param("zoom")), area);
+	if(status.ok())
+		status = service.render(area, formats[f].format, &response.body);
+	if(!status.ok()) {
+		switch(status.code) {
+		case OSMPNG_INVALID_ARGUMENT:
+		case OSMPNG_AREA_TOO_LARGE:
+			response.status = 400;
+			break;
+		case OSMPNG_FETCH_FAILED:
+			response.status = 502;
+			break;
+		default:
+			response.status = 500;
+		}
+		response.body = status.message + "\n";
+		return;
+	}
+	response.type = formats[f].type;
+}
+
+// Serve maps over HTTP until SIGINT or SIGTERM
+static int serve() {
+	options.keep_tiles = true;
+	options.max_tiles = SERVE_MAX_TILES;
+	MapService service(options);
+	if(!service.status().ok()) {
+		cerr << service.status().message << endl;
+		return EXIT_FAILURE;
+	}
+	if(!service.mosaic().decoded_cache_status().ok())
+		cerr << service.mosaic().decoded_cache_status().message << ", decoding without cache" << endl;
+	try {
+		HttpServer http(serveAddress);
+		server = &http;
+		COUT << "Serving maps on " << http.address() << ", tiles are cached in " << options.tile_dir() << endl;
+		http.run([&](const HttpRequest &request, HttpResponse &response) {
+			Span span(&metrics, "server_request_seconds");
+			unsigned long millis = -get_millis();
+			if(request.path == "/map") {
+				serve_map(service, request, response);
+			} else {
+				response.status = 404;
+				response.body = "Not found, maps are served at /map\n";
+			}
+			millis += get_millis();
+			metrics.add("server_requests_total");
+			if(response.status != 200) metrics.add("server_errors_total");
+			if(!quiet) {
+				// A single write, so lines of concurrent requests do not mix
+				stringstream ss;
+				ss << request.method << " " << request.target << " " << response.status << " "
+					<< sizeHumanReadable(response.body.size()) << " " << millis << " ms" << endl;
+				cout << ss.str();
+				cout.flush();
+			}
+		});
+		server = NULL;
+		
+		COUT << "Writing cache ... ";
+		COUT.flush();
+		size_t failedWrites = service.tiles().flush();
+		if(failedWrites > 0)
+			cerr << failedWrites << " tiles could not be written to " << options.tile_dir() << endl;
+		COUT << "done" << endl;
+		metrics.add("cache_tiles_evicted_total", service.tiles().evicted());
+		const FetchStats stats = service.tiles().stats();
+		metrics.add("connections_opened_total", stats.connections);
+		metrics.add("connections_reused_total", stats.reused);
+		metrics.add("transfers_http2_total", stats.http2);
+		metrics.add("responses_throttled_total", stats.throttled);
+		metrics.add("transfers_retried_total", stats.retries);
+		SlabCache *slab = service.mosaic().decoded_cache();
+		if(slab != NULL) {
+			metrics.add("decoded_cache_hits_total", slab->hits());
+			metrics.add("decoded_cache_misses_total", slab->misses());
+		}
+	} catch (string &msg) {
+		server = NULL;
+		cerr << msg << endl;
+		return EXIT_FAILURE;
+	} catch (const char *msg) {
+		server = NULL;
+		cerr << msg << endl;
+		return EXIT_FAILURE;
+	}
+	write_metrics();
+	return EXIT_SUCCESS;
+}
+
 int main(int argc, char** argv) {
 	// Register signal handler
 	signal(SIGINT, signal_function);
+	signal(SIGTERM, signal_function);
 	signal(SIGSEGV, signal_function);
 
 	// slon, slat and szoom are the LONGITUE LATITUDE ZOOM paramters
 	String slon, slat, szoom;
+	std::vector<String> positional;
 	bool stdinInput = true;		// If we must read LONGITUDE LATITUDE ZOOM from
 								// stdin
 	
@@ -390,9 +552,124 @@ int main(int argc, char** argv) {
 			} else if(arg == "-o") {
 				if(isLast) continue;
 				destFile = argv[++i];
+			} else if(arg == "--format") {
+				if(isLast) continue;
+				if(!parse_image_format(argv[++i], imageFormat)) {
+					cerr << "Unknown format: " << argv[i] << endl;
+					return EXIT_FAILURE;
+				}
+				formatGiven = true;
+			} else if(arg == "--geojson") {
+				if(isLast) continue;
+				geojsonFile = argv[++i];
+			} else if(arg == "--gpx") {
+				if(isLast) continue;
+				gpxFile = argv[++i];
+			} else if(arg == "--buffer") {
+				if(isLast) continue;
+				bufferMeters = toReal(argv[++i]);
+				if(bufferMeters < 0.0) {
+					cerr << "Buffer must not be negative" << endl;
+					return EXIT_FAILURE;
+				}
+			} else if(arg == "--batch") {
+				if(isLast) continue;
+				batchFile = argv[++i];
+			} else if(arg == "--serve") {
+				if(isLast) continue;
+				serveAddress = argv[++i];
+			} else if(arg == "--metrics") {
+				if(isLast) continue;
+				metricsFile = argv[++i];
+			} else if(arg == "--pyramid") {
+				if(isLast) continue;
+				pyramidZoom = toInt(argv[++i]);
+				if(pyramidZoom < 0) {
+					cerr << "Pyramid zoom level must not be negative" << endl;
+					return EXIT_FAILURE;
+				}
+			} else if(arg == "--decoded-cache") {
+				if(isLast) continue;
+				const long megabytes = atol(argv[++i]);
+				if(megabytes < 0) {
+					cerr << "Decoded cache size must not be negative" << endl;
+					return EXIT_FAILURE;
+				}
+				options.decoded_cache = (size_t)megabytes * 1024 * 1024;
+			} else if(arg == "--whole-tiles") {
+				options.whole_tiles = true;
 			} else if(arg == "--keep-cache" || arg == "-k") {
 				// Keep cache
 				deleteCached = false;
+			} else if(arg == "--cache-max-size") {
+				if(isLast) continue;
+				const long megabytes = atol(argv[++i]);
+				if(megabytes <= 0) {
+					cerr << "Cache size must be at least 1 MB" << endl;
+					return EXIT_FAILURE;
+				}
+				options.cache_max_size = (size_t)megabytes * 1024 * 1024;
+				deleteCached = false;
+			} else if(arg == "--resume") {
+				resume = true;
+				deleteCached = false;
+			} else if(arg == "--jobs" || arg == "-j") {
+				if(isLast) continue;
+				options.fetch.jobs = toInt(argv[++i]);
+				if(options.fetch.jobs < 1) {
+					cerr << "Number of jobs must be at least 1" << endl;
+					return EXIT_FAILURE;
+				}
+			} else if(arg == "--rate") {
+				if(isLast) continue;
+				options.fetch.rate = atof(argv[++i]);
+				if(options.fetch.rate < 0.0) {
+					cerr << "Rate must not be negative" << endl;
+					return EXIT_FAILURE;
+				}
+			} else if(arg == "--retries") {
+				if(isLast) continue;
+				options.fetch.retries = toInt(argv[++i]);
+				if(options.fetch.retries < 0) {
+					cerr << "Number of retries must not be negative" << endl;
+					return EXIT_FAILURE;
+				}
+			} else if(arg == "--threads" || arg == "-t") {
+				if(isLast) continue;
+				options.threads = toInt(argv[++i]);
+				if(options.threads < 0) {
+					cerr << "Number of threads must not be negative" << endl;
+					return EXIT_FAILURE;
+				}
+			} else if(arg == "--background") {
+				if(isLast) continue;
+				String color = argv[++i];
+				if(color.startsWith('#')) color = color.substr(1);
+				if(color.size() != 6 || color.find_first_not_of("0123456789abcdefABCDEF") != string::npos) {
+					cerr << "Background must be given as RRGGBB" << endl;
+					return EXIT_FAILURE;
+				}
+				for(int c=0;c<3;c++)
+					options.background[c] = (unsigned char)strtol(color.substr(2*c, 2).c_str(), NULL, 16);
+				options.blend = true;
+			} else if(arg == "--compression") {
+				if(isLast) continue;
+				options.png.level = toInt(argv[++i]);
+				if(options.png.level < 0 || options.png.level > 9) {
+					cerr << "Compression level must be between 0 and 9" << endl;
+					return EXIT_FAILURE;
+				}
+			} else if(arg == "--filter") {
+				if(isLast) continue;
+				if(!parse_png_filter(argv[++i], options.png.filter)) {
+					cerr << "Unknown filter: " << argv[i] << endl;
+					return EXIT_FAILURE;
+				}
+			} else if(arg == "--source") {
+				if(isLast) continue;
+				options.fetch.sources.push_back(argv[++i]);
+			} else if(arg == "--http2") {
+				options.fetch.http2 = true;
 			} else if(arg == "-q") {
 				quiet = true;
 			} else {
@@ -401,30 +678,53 @@ int main(int argc, char** argv) {
 					cerr << "Illegal argument: " << argv[i] << endl;
 					return EXIT_FAILURE;
 				} else {
-					// Check if enough parameters left
-					if (i+1 >= argc) {
-						cerr << "If providing a LONGITUDE you must also provide a LATITUDE" << endl;
-						return EXIT_FAILURE;
-					}
-					slon = argv[i];
-					slat = argv[i+1];
-					if(i+2 >= argc) {
-						szoom = "12";
-						i++;
-					} else {
-						szoom = argv[i+2];
-						i+=2;
-					}
-					stdinInput = false;
+					positional.push_back(arg);
 				}
 			}
 		}
+		
+		// The image goes to stdout, messages would corrupt it
+		if(destFile == "-") {
+			if(pyramidZoom >= 0) {
+				cerr << "--pyramid writes several files and cannot be used with -o -" << endl;
+				return EXIT_FAILURE;
+			}
+			quiet = true;
+		}
+		
+		// LONGITUDE LATITUDE [ZOOM], or only [ZOOM] if the area comes from a file
+		if(!geojsonFile.isEmpty() || !gpxFile.isEmpty()) {
+			if(positional.size() > 1) {
+				cerr << "With --geojson or --gpx only ZOOM must be given" << endl;
+				return EXIT_FAILURE;
+			}
+			szoom = positional.empty() ? "12" : positional[0];
+			stdinInput = false;
+		} else if(!positional.empty()) {
+			// Check if enough parameters are given
+			if(positional.size() < 2) {
+				cerr << "If providing a LONGITUDE you must also provide a LATITUDE" << endl;
+				return EXIT_FAILURE;
+			}
+			if(positional.size() > 3) {
+				cerr << "Too many arguments, expected LONGITUDE LATITUDE ZOOM" << endl;
+				return EXIT_FAILURE;
+			}
+			slon = positional[0];
+			slat = positional[1];
+			szoom = positional.size() > 2 ? positional[2] : "12";
+			stdinInput = false;
+		}
 
 		// Print options if not quiet
 		if(!quiet) {
 			printHeader();
-			if(!deleteCached) cout << "Keeping cached files" << endl;
-			if(!stdinInput) {
+			if(!deleteCached) cout << "Keeping downloaded tiles in " << cacheDir << endl;
+			if(!geojsonFile.isEmpty()) cout << "GeoJSON  : " << geojsonFile << endl;
+			if(!gpxFile.isEmpty()) cout << "GPX      : " << gpxFile << " (buffer " << bufferMeters << " m)" << endl;
+			if(!stdinInput && slon.isEmpty()) {
+				cout << "Zoom:      " << szoom << endl;
+			} else if(!stdinInput) {
 				cout << "Longitude: " << slon << endl 
 					<< "Latitude : " << slat << endl
 					<< "Zoom:      " << szoom << endl;
@@ -436,154 +736,414 @@ int main(int argc, char** argv) {
 	// cacheDir must end with "/"
 	if(cacheDir.isEmpty()) cacheDir = "./";
 	if(!cacheDir.endsWith('/')) cacheDir += '/';
+	options.cache_dir = cacheDir;
+	options.keep_tiles = !deleteCached;
+	options.metrics = &metrics;
+	
+	if(!serveAddress.isEmpty()) return serve();
 	
 	// Read from stdin, if not yet given as program parameter
-	if (stdinInput) {
+	if (stdinInput && batchFile.isEmpty()) {
 		try {
 			COUT << "No input parameters given. Use " << argv[0] << " --help if you need help" << endl;
 			COUT << "Type in coordinates for the map to download" << endl;
 			COUT << "  Longitude and Latitude can also be a range of coordinates" << endl;
 			COUT << endl;
-			cout << "Longitude : "; getline(cin, slon); if (cin.eof()) throw "";
-			cout << "Latitude  : "; getline(cin, slat); if (cin.eof()) throw "";
-			cout << "Zoom      : "; getline(cin, szoom);if (cin.eof()) throw "";
+			ostream &prompt = destFile == "-" ? cerr : cout;
+			prompt << "Longitude : "; getline(cin, slon); if (cin.eof()) throw "";
+			prompt << "Latitude  : "; getline(cin, slat); if (cin.eof()) throw "";
+			prompt << "Zoom      : "; getline(cin, szoom);if (cin.eof()) throw "";
 		} catch (...) {
 			cerr << "Cancelled" << endl;
 			return EXIT_FAILURE;
 		}
 	}
 	
-	// Parse LONGITUDE LATITUDE ZOOM
-	int zoom = toInt(szoom);
-	REAL n = pow(2.0, zoom);
-	if(slon.contains("-")) {
-		std::vector<String> vec = slon.split('-');
-		bounds[0] = toReal(vec[0].trim());
-		bounds[1] = toReal(vec[1].trim());
-	} else {
-		bounds[0] = toReal(slon);
-		bounds[1] = bounds[0];
-	}
-	if(slat.contains("-")) {
-		std::vector<String> vec = slat.split('-');
-		bounds[2] = toReal(vec[0].trim());
-		bounds[3] = toReal(vec[1].trim());
-	} else {
-		bounds[2] = toReal(slat);
-		bounds[3] = bounds[2];
-	}
-	
-	
-	// Check bounds and organise bounds
-	try {
-		for(int i=0;i<2;i++) {
-			if(bounds[i] < -180.0) throw "Longitude < -180 degree";
-			if(bounds[i] > 180.0) throw "Longitude > 180 degree";
+	// Collect the jobs
+	std::vector<Job> jobs;
+	if(!batchFile.isEmpty()) {
+		if(!read_batch(batchFile, jobs)) return EXIT_FAILURE;
+		if(jobs.empty()) {
+			cerr << "No jobs in " << batchFile << endl;
+			return EXIT_FAILURE;
 		}
-		
-		for(int i=2;i<4;i++) {
-			if(bounds[i] < -90.0) throw "Latitude < -90 degree";
-			if(bounds[i] > 90.0) throw "Latitude > 90 degree";
+	}
+	if(!stdinInput || batchFile.isEmpty()) {
+		Job job;
+		const bool shapes = !geojsonFile.isEmpty() || !gpxFile.isEmpty();
+		Status status = shapes ? parse_shapes(szoom, job) : parse_job(slon, slat, szoom, job);
+		if(!status.ok()) {
+			cerr << "ERROR: " << (shapes ? "Area" : "Bounds") << " invalid (" << status.message << ")" << endl;
+			return EXIT_FAILURE;
 		}
-		
-	} catch (const char* msg) {
-		cerr << "ERROR: Bounds invalid (" << msg << ")" << endl;
-		return EXIT_FAILURE;
+		job.output = destFile;
+		jobs.push_back(job);
 	}
 	
-	// Create destination folder, if not existing
-	if(!dir_exists(cacheDir))
-		mkdir(cacheDir.c_str(), S_IRWXU | S_IRWXG);
-
-
-	// Calculate tile coordinates
-	bounds[0] = getTileX(bounds[0], n);
-	bounds[1] = getTileX(bounds[1], n);
-	bounds[2] = getTileY(bounds[2], n);
-	bounds[3] = getTileY(bounds[3], n);
-	if(bounds[0] > bounds[1]) {
-		REAL tmp = bounds[0];
-		bounds[0] = bounds[1];
-		bounds[1] = tmp;
-	}
-	if(bounds[2] > bounds[3]) {
-		REAL tmp = bounds[2];
-		bounds[2] = bounds[3];
-		bounds[3] = tmp;
+	// Create cache dir, if tiles should be kept
+	// Tiles of other sources than the OpenStreetMap servers go to a subdirectory
+	const std::string tileDir = options.tile_dir();
+	if((!deleteCached || options.decoded_cache > 0) && !dir_exists(tileDir))
+		_mkdir(tileDir.c_str());
+	
+	// Union of the tiles of all jobs. Each tile is fetched only once
+	std::set<TileKey> required;
+	for(size_t i = 0; i < jobs.size(); i++) {
+		const Job &job = jobs[i];
+		for(int x=job.ibounds[0];x<=job.ibounds[1];x++)
+			for (int y=job.ibounds[2];y<=job.ibounds[3];y++)
+				if(job.covers(x, y)) required.insert(TileKey(x,y,job.zoom));
 	}
 	
-	// Create cache dir, if not yet done
-	_mkdir(cacheDir.c_str());
+	// A single map is merged while its tiles are downloading: every complete
+	// row is handed to a merge thread. Archives, pyramids and batches are
+	// produced once all tiles are there
+	const bool pipelined = jobs.size() == 1 && !String(jobs[0].output).endsWith(".pmtiles")
+		&& (pyramidZoom < 0 || pyramidZoom >= jobs[0].zoom);
 	
 	// Begin download
-	COUT << "Downloading tiles (" << bounds[0] << " - " << bounds[1] << ") - ("
-		<< bounds[2] << " - " << bounds[3] << ") ... " << endl;
+	if(jobs.size() == 1 && jobs[0].coverage) {
+		const int *ibounds = jobs[0].ibounds;
+		COUT << "Area covers " << required.size() << " of "
+			<< (ibounds[1] - ibounds[0] + 1) * (ibounds[3] - ibounds[2] + 1) << " tiles of its bounding box" << endl;
+	}
+	if(jobs.size() == 1) {
+		COUT << "Downloading tiles (" << jobs[0].bounds[0] << " - " << jobs[0].bounds[1] << ") - ("
+			<< jobs[0].bounds[2] << " - " << jobs[0].bounds[3] << ") ... " << endl;
+	} else {
+		COUT << "Downloading " << required.size() << " tiles for " << jobs.size() << " jobs ... " << endl;
+	}
 	COUT.flush();
 	
-	int ibounds[4];
-	for (int i=0;i<4;i++) 
-		ibounds[i] = (int)bounds[i];
-	int total = (bounds[1] - bounds[0] + 1) * (bounds[3] - bounds[2] + 1);
+	int total = 0;
 	int progress = 0;
 	size_t total_size = 0;
+	int failed = 0;
 	
-	unsigned long total_millis = -get_millis();
-	try {
-		for(int x=ibounds[0];x<=ibounds[1];x++) {
-			for (int y=ibounds[2];y<=ibounds[3];y++) {
-				COUT << " ["<< fround(100.0 * (REAL)progress / (REAL)total) << "%]" 
-					<< "\tDownloading tile [" << x << "-" << y << "] ... ";
-				COUT.flush();
-				
-				std::string file = get_filename(x,y,zoom);
-				files.push_back(file);
-				unsigned long millis = -get_millis();
-				size_t size = download(x,y,zoom, file);
-				millis += get_millis();
-				total_size += size;
-				progress++;
-				
-				if (!quiet) {
-					double speed = fround(size*1000.0/(double)millis);
-					printSizeHumanReadable(size);
-					cout << " @ " << speedHumandReadable(speed);
-					cout << "                    \r";
-					cout.flush();
+	// From here on threads run, a signal stops the run in an orderly way
+	started = 1;
+	TileProvider provider(options);
+	if(!provider.status().ok()) {
+		cerr << provider.status().message << endl;
+		return EXIT_FAILURE;
+	}
+	MosaicBuilder builder(options);
+	if(!builder.decoded_cache_status().ok())
+		cerr << builder.decoded_cache_status().message << ", decoding without cache" << endl;
+	
+	// Rows of the pipelined map, the fetcher blocks while the merge thread is behind
+	const Job &first = jobs[0];
+	BoundedQueue<TileRow> rows(PIPELINE_DEPTH);
+	std::vector<int> outstanding;		// Tiles per row still to be fetched
+	size_t nextRow = 0;
+	bool merged = false;
+	std::string mergeError;
+	std::string blank;					// Stands in for the tiles outside of the coverage
+	std::thread merging;
+	if(pipelined) {
+		outstanding.resize(first.ibounds[3] - first.ibounds[2] + 1, 0);
+		merging = std::thread([&]() {
+			Span span(&metrics, "stage_merge_seconds");
+			Merger *merger = NULL;
+			try {
+				TileRow row;
+				if(rows.pop(row)) {
+					merger = builder.merger(first, *row[0], first.output, output_format(first.output));
+					size_t written = 0;
+					do {
+						merger->write(row);
+						written++;
+					} while(rows.pop(row));
+					// The queue is closed early if a tile failed
+					if(written == merger->rows()) {
+						merger->finish();
+						merged = true;
+					}
 				}
-				sleep(1);
+			} catch (string &msg) {
+				mergeError = msg;
+				rows.abort();
+			} catch (const char *msg) {
+				mergeError = msg;
+				rows.abort();
 			}
+			delete merger;
+		});
+	}
+	// Hand over the complete rows in order
+	auto push_rows = [&]() {
+		while(nextRow < outstanding.size() && outstanding[nextRow] == 0) {
+			TileRow row;
+			const int y = first.ibounds[2] + (int)nextRow;
+			for(int x=first.ibounds[0];x<=first.ibounds[1];x++)
+				row.push_back(first.covers(x, y) ? tiles.get(TileKey(x, y, first.zoom)) : NULL);
+			// The top row has covered tiles, so the blank tile exists before it is needed
+			for(size_t k = 0; k < row.size() && first.coverage; k++) {
+				if(blank.empty() && row[k] != NULL) blank = builder.blank_tile(*row[k]);
+				if(row[k] == NULL) row[k] = &blank;
+			}
+			nextRow++;
+			if(!rows.push(row)) nextRow = outstanding.size();
 		}
-		total_millis += get_millis();
-		if (!quiet) {
-			double speed = fround(total_size*1000.0/(double)total_millis);
-			
-			cout << "Downloaded totally ";
-			printSizeHumanReadable(total_size);
-			cout << " within " << total_millis << " ms @ " 
-				<< speedHumandReadable(speed) 
-				<< "                                        " << endl;
-		}
+	};
+	// Wait for the merge thread. An unfinished map is removed
+	auto finish_pipeline = [&]() {
+		if(!merging.joinable()) return;
+		rows.close();
+		merging.join();
+		if(!merged && first.output != "-") unlink(first.output.c_str());
+	};
+	// Stop after SIGINT or SIGTERM. Fetched tiles are written to the cache, so
+	// that --resume finds all journaled ones
+	auto cancel_run = [&]() {
+		cerr << "Caught cancel signal" << endl;
+		rows.abort();
+		finish_pipeline();
+		provider.flush();
+		if(!deleteCached) cerr << "Completed tiles are journaled, rerun with --resume to continue" << endl;
+		write_metrics();
+		return 42;
+	};
+	
+	// Serve fresh tiles from the cache and revalidate stale ones
+	size_t fresh = 0, revalidated = 0, resumed = 0;
+	
+	// Completed tiles are journaled, so an interrupted run can be resumed
+	Journal journal(tileDir + "osmpng.journal");
+	if(resume) {
+		size_t journaled = journal.load();
+		COUT << "Resuming: " << journaled << " tiles journaled" << endl;
+	}
+	try {
+		if(!deleteCached) journal.open(resume);
 	} catch (string &msg) {
 		cerr << msg << endl;
+		finish_pipeline();
+		write_metrics();
 		exit(EXIT_FAILURE);
 	} catch (const char *msg) {
 		cerr << msg << endl;
+		finish_pipeline();
+		write_metrics();
 		exit(EXIT_FAILURE);
 	}
 	
-	COUT << "Merging tiles ... ";
-	COUT.flush();
-	merge(ibounds, zoom, destFile);
-	COUT << "done" << "                                        \r";
+	TileHooks hooks;
+	// Journaled tiles are taken as they are, even if stale
+	hooks.trusted = [&](const TileKey &key, const std::string &data) {
+		if(!resume || !journal.verify(key, data)) return false;
+		resumed++;
+		return true;
+	};
+	std::unique_ptr<Span> fetchSpan;
+	Span lookup(&metrics, "stage_cache_lookup_seconds");
+	hooks.fetching = [&](const std::vector<TileJob> &jobs) {
+		total = (int)jobs.size();
+		fresh = required.size() - jobs.size() - resumed;
+		if(pipelined) {
+			for(size_t i = 0; i < jobs.size(); i++) outstanding[jobs[i].y - first.ibounds[2]]++;
+			push_rows();
+		}
+		lookup.stop();
+		fetchSpan.reset(new Span(&metrics, "stage_fetch_seconds"));
+	};
+	hooks.completed = [&](const TileKey &key, const std::string &data) {
+		if(!deleteCached) journal.record(key, data);
+	};
+	hooks.fetched = [&](const TileResult &result) {
+		progress++;
+		if (!result.ok) {
+			failed++;
+			cerr << "Error downloading tile [" << result.x << "-" << result.y << "]: "
+				<< result.error << endl;
+			return;
+		}
+		if(result.not_modified) revalidated++;
+		else total_size += result.size;
+		if (!quiet) {
+			double speed = fround(result.size*1000.0/(double)(result.millis+1));
+			cout << " ["<< fround(100.0 * (REAL)progress / (REAL)total) << "%]" 
+				<< (result.not_modified ? "\tRevalidated tile [" : "\tDownloaded tile [")
+				<< result.x << "-" << result.y << "] ... ";
+			printSizeHumanReadable(result.size);
+			cout << " @ " << speedHumandReadable(speed);
+			cout << "                    \r";
+			cout.flush();
+		}
+		if(pipelined) {
+			outstanding[result.y - first.ibounds[2]]--;
+			push_rows();
+		}
+	};
+	
+	unsigned long total_millis = -get_millis();
+	// A signal before the fetch is registered is caught by the check after it
+	fetching = &provider;
+	Status fetchStatus;
+	if(!cancelled)
+		fetchStatus = provider.get(std::vector<TileKey>(required.begin(), required.end()), tiles, hooks);
+	fetching = NULL;
+	fetchSpan.reset();
+	total_millis += get_millis();
+	if(cancelled) return cancel_run();
+	// Failed tiles are reported one by one, anything else ends the run
+	if(!fetchStatus.ok() && failed == 0) {
+		cerr << fetchStatus.message << endl;
+		finish_pipeline();
+		// Keep what was downloaded so far for --resume
+		provider.flush();
+		write_metrics();
+		exit(EXIT_FAILURE);
+	}
+	const FetchStats stats = provider.stats();
+	metrics.add("tiles_distinct_total", tiles.distinct());
+	metrics.add("connections_opened_total", stats.connections);
+	metrics.add("connections_reused_total", stats.reused);
+	metrics.add("transfers_http2_total", stats.http2);
+	metrics.add("responses_throttled_total", stats.throttled);
+	metrics.add("transfers_retried_total", stats.retries);
+	if (!quiet) {
+		double speed = fround(total_size*1000.0/(double)total_millis);
+		
+		cout << "Downloaded totally ";
+		printSizeHumanReadable(total_size);
+		cout << " within " << total_millis << " ms @ " 
+			<< speedHumandReadable(speed) 
+			<< "                                        " << endl;
+		cout << "Connections: " << stats.connections << " opened, "
+			<< stats.reused << " reused";
+		if(stats.http2 > 0) cout << ", " << stats.http2 << " transfers via HTTP/2";
+		cout << endl;
+		if(stats.retries > 0)
+			cout << "Retries: " << stats.retries << " (" << stats.throttled << " throttled)" << endl;
+		const std::vector<MirrorStats> mirrors = provider.mirrors();
+		if(!options.fetch.sources.empty() && mirrors.size() > 1) {
+			for(size_t i = 0; i < mirrors.size(); i++) {
+				cout << "Mirror " << mirrors[i].url << ": " << mirrors[i].requests << " requests";
+				if(mirrors[i].requests > mirrors[i].failures)
+					cout << ", " << fround(mirrors[i].latency) << " ms";
+				if(mirrors[i].failures > 0) cout << ", " << mirrors[i].failures << " failed";
+				cout << endl;
+			}
+		}
+		if(tiles.distinct() < tiles.size())
+			cout << "Tiles: " << tiles.distinct() << " distinct of " << tiles.size() << endl;
+		cout << "Cache: " << fresh << " fresh, ";
+		if(resume) cout << resumed << " resumed, ";
+		cout << revalidated << " revalidated, "
+			<< (total - revalidated - failed) << " downloaded" << endl;
+	}
+	if (failed > 0) {
+		cerr << failed << " of " << total << " tiles could not be downloaded" << endl;
+		if(jobs.size() == 1) {
+			finish_pipeline();
+			if(!deleteCached) {
+				provider.flush();
+				cerr << "Rerun with --resume to fetch only the missing tiles" << endl;
+			}
+			write_metrics();
+			exit(EXIT_FAILURE);
+		}
+	}
 	
-	if(deleteCached) {
-		COUT << "Clearing cache ... ";
+	// Produce the outputs of all jobs from the shared tiles
+	int failedJobs = 0;
+	for(size_t i = 0; i < jobs.size(); i++) {
+		const Job &job = jobs[i];
+		const bool pmtiles = String(job.output).endsWith(".pmtiles");
+		int missing = 0;
+		for(int x=job.ibounds[0];x<=job.ibounds[1];x++)
+			for (int y=job.ibounds[2];y<=job.ibounds[3];y++)
+				if(job.covers(x, y) && tiles.get(TileKey(x,y,job.zoom)) == NULL) missing++;
+		if(missing > 0) {
+			cerr << "Skipping " << job.output << ": " << missing << " tiles missing" << endl;
+			failedJobs++;
+			continue;
+		}
+		
+		const int minZoom = (pyramidZoom >= 0 && pyramidZoom < job.zoom) ? pyramidZoom : job.zoom;
+		if(jobs.size() > 1) COUT << job.output << ": ";
+		if(minZoom < job.zoom) COUT << "Building zoom levels " << minZoom << "-" << job.zoom - 1 << " ... ";
+		COUT << (pmtiles ? "Writing archive ... " : "Merging tiles ... ");
 		COUT.flush();
-		clear_cached_files();
-
-		COUT << "done" << endl;
+		// Images are rectangles, archives leave the uncovered tiles out
+		if(!pmtiles && !pipelined) {
+			Status status = builder.fill_uncovered(tiles, job);
+			if(!status.ok()) {
+				cerr << status.message << endl;
+				failedJobs++;
+				continue;
+			}
+		}
+		if(minZoom < job.zoom) {
+			try {
+				Span span(&metrics, "stage_pyramid_seconds");
+				// Tiles outside of the requested area are not fetched and become blank
+				size_t synthesized = build_pyramid(tiles, job.ibounds, job.zoom, minZoom, options.png,
+					builder.fill_color(), builder.thread_pool(), builder.background());
+				metrics.add("tiles_synthesized_total", synthesized);
+			} catch (string &msg) {
+				cerr << msg << endl;
+				failedJobs++;
+				continue;
+			} catch (const char *msg) {
+				cerr << msg << endl;
+				failedJobs++;
+				continue;
+			}
+		}
+		Status status;
+		if(pipelined) {
+			// Merged while downloading, what is left are the last rows
+			finish_pipeline();
+			if(!merged) status = Status(OSMPNG_RENDER_FAILED, mergeError);
+		} else if(pmtiles) {
+			status = builder.archive(tiles, job, minZoom, job.output);
+		} else {
+			for(int z=job.zoom;z>=minZoom && status.ok();z--)
+				status = builder.render(tiles, job.at_zoom(z), minZoom < job.zoom ? level_output(job.output, z) : job.output,
+					output_format(job.output));
+		}
+		if(cancelled) return cancel_run();
+		if(!status.ok()) {
+			cerr << status.message << endl;
+			failedJobs++;
+			continue;
+		}
+		COUT << "done" << (jobs.size() > 1 ? "\n" : "                                        \r");
+	}
+	
+	SlabCache *slab = builder.decoded_cache();
+	if(slab != NULL) {
+		metrics.add("decoded_cache_hits_total", slab->hits());
+		metrics.add("decoded_cache_misses_total", slab->misses());
+	}
+	
+	if(!deleteCached) {
+		COUT << "Writing cache ... ";
+		COUT.flush();
+		Span span(&metrics, "stage_cache_write_seconds");
+		size_t failedWrites = provider.flush();
+		span.stop();
+		metrics.add("cache_tiles_deduplicated_total", provider.deduplicated());
+		metrics.add("cache_tiles_evicted_total", provider.evicted());
+		if(failedWrites > 0)
+			cerr << failedWrites << " tiles could not be written to " << options.tile_dir() << endl;
+		// All tiles are on disk, there is nothing left to resume
+		else if(failed == 0)
+			journal.remove();
+		COUT << "done";
+		if(provider.evicted() > 0) COUT << " (" << provider.evicted() << " least recently used tiles evicted)";
+		COUT << endl;
 	}
 	
 	COUT << endl;
+	metrics.add("jobs_total", jobs.size());
+	metrics.add("jobs_failed_total", failedJobs);
+	write_metrics();
+	if(failedJobs > 0) {
+		if(jobs.size() > 1) cerr << failedJobs << " of " << jobs.size() << " jobs failed" << endl;
+		return EXIT_FAILURE;
+	}
 	return EXIT_SUCCESS;
 }